@@ -0,0 +1,38 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cpputils-base/binary_logging.h>
+#include <cpputils-base/unique_fd.h>
+
+// Prints a log written by BINLOG statements as text.
+//   binlog-decode [FILE]
+// reads standard input if FILE is missing or "-".
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: %s [FILE]\n", argv[0]);
+        return 2;
+    }
+    int fd = STDIN_FILENO;
+    cpputils::base::unique_fd file;
+    if (argc == 2 && strcmp(argv[1], "-") != 0)
+    {
+        file.reset(TEMP_FAILURE_RETRY(open(argv[1], O_RDONLY | O_CLOEXEC)));
+        if (file == -1)
+        {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return 1;
+        }
+        fd = file.get();
+    }
+    if (!cpputils::base::DecodeBinaryLog(fd, STDOUT_FILENO))
+    {
+        fprintf(stderr, "%s: %s\n", argv[0],
+                errno == EINVAL ? "not a binary log, or truncated" : strerror(errno));
+        return 1;
+    }
+    return 0;
+}
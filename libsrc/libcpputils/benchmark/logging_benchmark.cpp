@@ -0,0 +1,314 @@
+// Measures what logging costs the thread that logs.
+//
+//   logging-benchmark [--filter=SUBSTRING] [--iterations=N] [--threads=N] [--kernel]
+//
+// Each case logs --iterations messages from each of its threads and times
+// every call on its own, then prints the 50th, 99th and 99.9th percentile of
+// the per-call latency and the lines per second over the whole run. The
+// contention cases are run with 1, 2, 4... up to --threads threads, to show
+// contention on the logging lock. The per-call figures include the cost of
+// reading the clock, which is printed first. KernelLogger writes to the real
+// kernel log, so its case only runs with --kernel.
+//
+// StderrLogger appends to LOG_FILE when the library was built with it, as
+// the repo's own flags do; each case then cuts that file back to the size it
+// had when the benchmark started, so every case starts from the same file and
+// earlier lines in it are kept. Without LOG_FILE, stderr is pointed at a
+// temporary file instead. Either way nothing goes to the terminal.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpputils-base/file.h"
+#include "cpputils-base/logging.h"
+#include "cpputils-base/parseint.h"
+
+using namespace cpputils::base;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string filter;
+  size_t iterations = 100000;
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  bool kernel = false;
+};
+
+struct Case {
+  const char* name;
+  // Lines each call to `log` produces, for the lines per second figure.
+  size_t lines_per_call;
+  // Whether to run with 1, 2, 4... threads rather than just one.
+  bool sweep_threads;
+  std::function<void()> set_up;
+  std::function<void(size_t)> log;
+  std::function<void()> tear_down;
+};
+
+struct Result {
+  double lines_per_second;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+};
+
+void NullLogger(LogId, LogSeverity, const char*, const char*, unsigned int, const char*) {}
+
+uint64_t Percentile(std::vector<uint32_t>* samples, double fraction) {
+  auto nth = samples->begin() + static_cast<size_t>(fraction * (samples->size() - 1));
+  std::nth_element(samples->begin(), nth, samples->end());
+  return *nth;
+}
+
+Result Run(const Case& c, size_t threads, size_t iterations) {
+  std::vector<std::vector<uint32_t>> samples(threads, std::vector<uint32_t>(iterations));
+  std::atomic<size_t> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::vector<uint32_t>& out = samples[t];
+      ++ready;
+      while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+      for (size_t i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        c.log(i);
+        out[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+      }
+    });
+  }
+  while (ready.load() < threads) std::this_thread::yield();
+  Clock::time_point start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread& worker : workers) worker.join();
+  // Anything the logger still has queued is part of the cost.
+  FlushLogs();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  std::vector<uint32_t> all;
+  all.reserve(threads * iterations);
+  for (const std::vector<uint32_t>& s : samples) all.insert(all.end(), s.begin(), s.end());
+  Result result;
+  result.lines_per_second = threads * iterations * c.lines_per_call / elapsed.count();
+  result.p50_ns = Percentile(&all, 0.5);
+  result.p99_ns = Percentile(&all, 0.99);
+  result.p999_ns = Percentile(&all, 0.999);
+  return result;
+}
+
+uint64_t ClockOverheadNs() {
+  constexpr int kReads = 100000;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < kReads; ++i) Clock::now();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() /
+         kReads;
+}
+
+// Keeps what StderrLogger writes during a case off the terminal and off the
+// disk. With LOG_FILE, StderrLogger appends to that file, which Stop() cuts
+// back to its size from before the first case. Otherwise stderr is pointed at
+// a temporary file while the case runs.
+class StderrLoggerOutput {
+ public:
+  StderrLoggerOutput() {
+#if defined(LOG_FILE)
+    log_file_ = LOG_FILE;
+#endif
+    if (UsesLogFile()) {
+      struct stat st;
+      log_file_size_ = (stat(log_file_, &st) == 0) ? st.st_size : 0;
+    }
+  }
+
+  // The file StderrLogger writes to, if not stderr.
+  const char* LogFile() const { return UsesLogFile() ? log_file_ : nullptr; }
+
+  void Start() {
+    if (UsesLogFile()) return;
+    fflush(stderr);
+    saved_ = dup(STDERR_FILENO);
+    dup2(file_.fd, STDERR_FILENO);
+  }
+
+  void Stop() {
+    if (UsesLogFile()) {
+      // StderrLogger opened the file for appending, so it goes on writing at
+      // the new end.
+      if (truncate(log_file_, log_file_size_) == -1 && errno != ENOENT) perror(log_file_);
+      return;
+    }
+    fflush(stderr);
+    dup2(saved_, STDERR_FILENO);
+    close(saved_);
+    if (ftruncate(file_.fd, 0) == -1 || lseek(file_.fd, 0, SEEK_SET) == -1) perror("ftruncate");
+  }
+
+ private:
+  // An empty LOG_FILE means stderr, as in the library.
+  bool UsesLogFile() const { return log_file_ != nullptr && *log_file_ != '\0'; }
+
+  const char* log_file_ = nullptr;
+  off_t log_file_size_ = 0;
+  TemporaryFile file_;
+  int saved_ = -1;
+};
+
+const char kMultiLine[] =
+    "line 1\nline 2\nline 3\nline 4\nline 5\nline 6\nline 7\nline 8\n"
+    "line 9\nline 10\nline 11\nline 12\nline 13\nline 14\nline 15\nline 16";
+
+void LogInfo(size_t i) {
+  LOG(INFO) << "benchmark message " << i << " value " << 3.25;
+}
+
+std::vector<Case> MakeCases(StderrLoggerOutput* stderr_output, TemporaryFile* json_file,
+                            TemporaryDir* dir) {
+  auto use = [](const LogFunction& logger) {
+    return [logger] {
+      LogFunction copy = logger;
+      SetLogger(std::move(copy));
+    };
+  };
+  auto stderr_set_up = [stderr_output] {
+    stderr_output->Start();
+    SetLogger(StderrLogger);
+  };
+  auto stderr_tear_down = [stderr_output] { stderr_output->Stop(); };
+  auto nothing = [] {};
+
+  std::vector<Case> cases;
+  cases.push_back({"disabled_verbose", 1, false, use(NullLogger),
+                   [](size_t i) { LOG(VERBOSE) << "not logged " << i; }, nothing});
+  cases.push_back({"null_logger", 1, false, use(NullLogger), LogInfo, nothing});
+  cases.push_back({"null_logger_contention", 1, true, use(NullLogger), LogInfo, nothing});
+  cases.push_back({"stderr_logger", 1, false, stderr_set_up, LogInfo, stderr_tear_down});
+  cases.push_back({"stderr_logger_contention", 1, true, stderr_set_up, LogInfo,
+                   stderr_tear_down});
+  cases.push_back({"stderr_logger_async", 1, true,
+                   [stderr_set_up] {
+                     stderr_set_up();
+                     EnableAsyncLogging();
+                   },
+                   LogInfo,
+                   [stderr_tear_down] {
+                     DisableAsyncLogging();
+                     stderr_tear_down();
+                   }});
+  // Lines below the minimum severity that only the flight recorder keeps.
+  cases.push_back({"flight_recorder_verbose", 1, true,
+                   [] {
+                     SetLogger(NullLogger);
+                     EnableFlightRecorder();
+                   },
+                   [](size_t i) { LOG(VERBOSE) << "recorded " << i; },
+                   [] { DisableFlightRecorder(); }});
+  cases.push_back({"multi_line_null_logger", 16, false, use(NullLogger),
+                   [](size_t) { LOG(INFO) << kMultiLine; }, nothing});
+  cases.push_back({"multi_line_stderr_logger", 16, false, stderr_set_up,
+                   [](size_t) { LOG(INFO) << kMultiLine; }, stderr_tear_down});
+  cases.push_back({"structured_json_logger", 1, false,
+                   [json_file] {
+                     SetLogger(StructuredLogger(json_file->fd, LogEncoding::kJson));
+                   },
+                   [](size_t i) {
+                     LOG(INFO).With("i", i).With("value", 3.25) << "benchmark message";
+                   },
+                   [json_file] {
+                     SetLogger(NullLogger);
+                     if (ftruncate(json_file->fd, 0) == -1 ||
+                         lseek(json_file->fd, 0, SEEK_SET) == -1) {
+                       perror("ftruncate");
+                     }
+                   }});
+  cases.push_back({"file_logger", 1, true,
+                   [dir] {
+                     FileLoggerOptions options;
+                     options.path = std::string(dir->path) + "/benchmark.log";
+                     options.max_rotated_files = 0;
+                     SetLogger(FileLogger(options));
+                   },
+                   LogInfo,
+                   // Destroying the logger writes out what it has buffered.
+                   [] { SetLogger(NullLogger); }});
+#if defined(__linux__)
+  cases.push_back({"kernel_logger", 1, false, use(KernelLogger), LogInfo, nothing});
+#endif
+  return cases;
+}
+
+bool ParseArgs(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 9, "--filter=") == 0) {
+      options->filter = arg.substr(9);
+    } else if (arg.compare(0, 13, "--iterations=") == 0) {
+      if (!ParseUint(arg.substr(13), &options->iterations) || options->iterations == 0) {
+        return false;
+      }
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      if (!ParseUint(arg.substr(10), &options->max_threads) || options->max_threads == 0) {
+        return false;
+      }
+    } else if (arg == "--kernel") {
+      options->kernel = true;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    fprintf(stderr,
+            "usage: %s [--filter=SUBSTRING] [--iterations=N] [--threads=N] [--kernel]\n",
+            argv[0]);
+    return 2;
+  }
+
+  SetMinimumLogSeverity(INFO);
+  StderrLoggerOutput stderr_output;
+  TemporaryFile json_file;
+  TemporaryDir dir;
+  std::vector<Case> cases = MakeCases(&stderr_output, &json_file, &dir);
+
+  printf("clock overhead per call: %" PRIu64 " ns\n", ClockOverheadNs());
+  if (stderr_output.LogFile() != nullptr) {
+    printf("StderrLogger writes to %s\n", stderr_output.LogFile());
+  }
+  printf("%-28s %7s %14s %9s %9s %9s\n", "case", "threads", "lines/s", "p50 ns", "p99 ns",
+         "p99.9 ns");
+  for (const Case& c : cases) {
+    if (strcmp(c.name, "kernel_logger") == 0 && !options.kernel) continue;
+    if (!options.filter.empty() && strstr(c.name, options.filter.c_str()) == nullptr) continue;
+    for (size_t threads = 1; threads <= (c.sweep_threads ? options.max_threads : 1);
+         threads *= 2) {
+      c.set_up();
+      Result result = Run(c, threads, options.iterations);
+      c.tear_down();
+      printf("%-28s %7zu %14.0f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n", c.name, threads,
+             result.lines_per_second, result.p50_ns, result.p99_ns, result.p999_ns);
+      fflush(stdout);
+    }
+  }
+  SetLogger(StderrLogger);
+  return 0;
+}
@@ -0,0 +1,633 @@
+#include "cpputils-base/binary_logging.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cpputils-base/file.h"
+#include "cpputils-base/stringprintf.h"
+#include "cpputils-base/threads.h"
+
+namespace cpputils {
+namespace base {
+
+using binlog_internal::FormatSite;
+
+// A binary log is a header followed by records, all in host byte order:
+//
+//   header: char magic[8], uint32_t version, uint32_t byte order mark,
+//           int32_t pid, string default tag
+//   format: uint8_t kRecordFormat, uint32_t id, uint32_t line,
+//           string file, string tag, string format
+//   entry:  uint8_t kRecordEntry, uint8_t severity, uint32_t format id,
+//           int64_t wall clock time in ns, uint64_t thread id,
+//           uint32_t size, encoded arguments
+//
+// where a string is a uint32_t length and the bytes. A format record always
+// precedes the entries that refer to it.
+static constexpr char kMagic[8] = {'C', 'P', 'B', 'I', 'N', 'L', 'O', 'G'};
+static constexpr uint32_t kVersion = 1;
+static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+enum RecordType : uint8_t {
+  kRecordFormat = 1,
+  kRecordEntry = 2,
+};
+
+static constexpr size_t kEntryHeaderSize = 1 + 1 + 4 + 8 + 8 + 4;
+
+namespace binlog_internal {
+std::atomic<bool> gBinaryLogOpen(false);
+}  // namespace binlog_internal
+
+// Guards the file descriptor, the format sites, and writes to the file.
+static std::mutex& BinaryLogLock() {
+  static auto& lock = *new std::mutex();
+  return lock;
+}
+static int gBinaryLogFd = -1;
+static bool gBinaryLogWriteFailed = false;
+
+static std::vector<FormatSite*>& FormatSites() {
+  static auto& sites = *new std::vector<FormatSite*>();
+  return sites;
+}
+
+template <typename T>
+static void AppendValue(std::string* out, T value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void AppendString(std::string* out, const char* s) {
+  if (s == nullptr) s = "";
+  uint32_t size = strlen(s);
+  AppendValue(out, size);
+  out->append(s, size);
+}
+
+static void AppendFormatRecord(std::string* out, uint32_t id, const FormatSite* site) {
+  AppendValue(out, kRecordFormat);
+  AppendValue(out, id);
+  AppendValue(out, static_cast<uint32_t>(site->line));
+  AppendString(out, site->file);
+  AppendString(out, site->tag);
+  AppendString(out, site->format);
+}
+
+// Must be called with BinaryLogLock held. Data written while no log is open
+// is discarded.
+static void WriteLocked(const void* data, size_t size) {
+  if (gBinaryLogFd == -1) return;
+  if (!WriteFully(gBinaryLogFd, data, size) && !gBinaryLogWriteFailed) {
+    gBinaryLogWriteFailed = true;
+    PLOG(ERROR) << "writing binary log failed";
+  }
+}
+
+namespace binlog_internal {
+
+uint32_t RegisterFormatSite(FormatSite* site) {
+  std::lock_guard<std::mutex> lock(BinaryLogLock());
+  uint32_t id = site->id.load(std::memory_order_relaxed);
+  if (id != 0) return id;
+  std::vector<FormatSite*>& sites = FormatSites();
+  sites.push_back(site);
+  id = sites.size();
+  std::string record;
+  AppendFormatRecord(&record, id, site);
+  WriteLocked(record.data(), record.size());
+  site->id.store(id, std::memory_order_release);
+  return id;
+}
+
+}  // namespace binlog_internal
+
+// Records are appended to a buffer owned by the logging thread and written
+// out in bulk. The per-buffer lock is only ever contended by a flush.
+struct ThreadBuffer {
+  static constexpr size_t kCapacity = 64 * 1024;
+
+  ThreadBuffer() : data(new char[kCapacity]), capacity(kCapacity), tid(GetThreadId()) {}
+
+  // Must be called with `lock` held.
+  void FlushLocked() {
+    if (size == 0) return;
+    {
+      std::lock_guard<std::mutex> file_lock(BinaryLogLock());
+      WriteLocked(data.get(), size);
+    }
+    size = 0;
+  }
+
+  std::mutex lock;
+  std::unique_ptr<char[]> data;
+  size_t capacity;
+  size_t size = 0;
+  size_t pending = 0;
+  const uint64_t tid;
+};
+
+static std::mutex& ThreadBuffersLock() {
+  static auto& lock = *new std::mutex();
+  return lock;
+}
+
+static std::vector<ThreadBuffer*>& ThreadBuffers() {
+  static auto& buffers = *new std::vector<ThreadBuffer*>();
+  return buffers;
+}
+
+// As with the LogMessageData cache in logging.cpp, the pointer is trivially
+// destructible and a separate owner flushes and frees the buffer when the
+// thread exits. BINLOG statements in later thread_local destructors are lost.
+static thread_local ThreadBuffer* gThreadBuffer = nullptr;
+static thread_local bool gThreadBufferGone = false;
+
+struct ThreadBufferOwner {
+  ~ThreadBufferOwner() {
+    ThreadBuffer* buffer = gThreadBuffer;
+    gThreadBuffer = nullptr;
+    gThreadBufferGone = true;
+    if (buffer == nullptr) return;
+    {
+      std::lock_guard<std::mutex> lock(ThreadBuffersLock());
+      std::vector<ThreadBuffer*>& buffers = ThreadBuffers();
+      for (size_t i = 0; i < buffers.size(); ++i) {
+        if (buffers[i] == buffer) {
+          buffers[i] = buffers.back();
+          buffers.pop_back();
+          break;
+        }
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(buffer->lock);
+      buffer->FlushLocked();
+    }
+    delete buffer;
+  }
+};
+static thread_local ThreadBufferOwner gThreadBufferOwner;
+
+static ThreadBuffer* GetThreadBuffer() {
+  if (LIKELY(gThreadBuffer != nullptr)) return gThreadBuffer;
+  if (gThreadBufferGone) return nullptr;
+  // Odr-use the owner so that the buffer is flushed when the thread exits.
+  (void)&gThreadBufferOwner;
+  ThreadBuffer* buffer = new ThreadBuffer();
+  {
+    std::lock_guard<std::mutex> lock(ThreadBuffersLock());
+    ThreadBuffers().push_back(buffer);
+  }
+  gThreadBuffer = buffer;
+  return buffer;
+}
+
+namespace binlog_internal {
+
+char* BeginRecord(uint32_t id, LogSeverity severity, size_t size) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  if (buffer == nullptr) return nullptr;
+  buffer->lock.lock();
+
+  size_t total = kEntryHeaderSize + size;
+  if (buffer->size + total > buffer->capacity) {
+    buffer->FlushLocked();
+    if (total > buffer->capacity) {
+      buffer->data.reset(new char[total]);
+      buffer->capacity = total;
+    }
+  }
+
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t time_ns = static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  uint8_t type = kRecordEntry;
+  uint8_t severity_byte = severity;
+  uint32_t args_size = size;
+
+  char* p = buffer->data.get() + buffer->size;
+  memcpy(p, &type, sizeof(type));
+  p += sizeof(type);
+  memcpy(p, &severity_byte, sizeof(severity_byte));
+  p += sizeof(severity_byte);
+  memcpy(p, &id, sizeof(id));
+  p += sizeof(id);
+  memcpy(p, &time_ns, sizeof(time_ns));
+  p += sizeof(time_ns);
+  memcpy(p, &buffer->tid, sizeof(buffer->tid));
+  p += sizeof(buffer->tid);
+  memcpy(p, &args_size, sizeof(args_size));
+  p += sizeof(args_size);
+  buffer->pending = total;
+  return p;
+}
+
+void EndRecord() {
+  ThreadBuffer* buffer = gThreadBuffer;
+  buffer->size += buffer->pending;
+  buffer->pending = 0;
+  // Records that cannot be appended to a regular sized buffer were given one
+  // of their own; go back to the usual size once they have been written.
+  if (buffer->capacity > ThreadBuffer::kCapacity) {
+    buffer->FlushLocked();
+    buffer->data.reset(new char[ThreadBuffer::kCapacity]);
+    buffer->capacity = ThreadBuffer::kCapacity;
+  }
+  buffer->lock.unlock();
+}
+
+}  // namespace binlog_internal
+
+void FlushBinaryLog() {
+  std::lock_guard<std::mutex> lock(ThreadBuffersLock());
+  for (ThreadBuffer* buffer : ThreadBuffers()) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->lock);
+    buffer->FlushLocked();
+  }
+}
+
+void CloseBinaryLog() {
+  binlog_internal::gBinaryLogOpen.store(false, std::memory_order_relaxed);
+  FlushBinaryLog();
+  std::lock_guard<std::mutex> lock(BinaryLogLock());
+  if (gBinaryLogFd != -1) {
+    close(gBinaryLogFd);
+    gBinaryLogFd = -1;
+  }
+}
+
+static std::string GetBinaryLogDefaultTag() {
+  std::string tag = GetDefaultTag();
+  if (tag.empty()) {
+#if defined(__GLIBC__)
+    tag = program_invocation_short_name;
+#else
+    tag = getprogname();
+#endif
+  }
+  return tag;
+}
+
+bool OpenBinaryLog(const std::string& path) {
+  CloseBinaryLog();
+  int fd = TEMP_FAILURE_RETRY(
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_BINARY, 0644));
+  if (fd == -1) return false;
+
+  std::lock_guard<std::mutex> lock(BinaryLogLock());
+  if (gBinaryLogFd != -1) close(gBinaryLogFd);
+  gBinaryLogFd = -1;
+  std::string header(kMagic, sizeof(kMagic));
+  AppendValue(&header, kVersion);
+  AppendValue(&header, kByteOrderMark);
+  AppendValue(&header, static_cast<int32_t>(getpid()));
+  AppendString(&header, GetBinaryLogDefaultTag().c_str());
+  // Sites seen by an earlier log keep their ids, so define them all again.
+  const std::vector<FormatSite*>& sites = FormatSites();
+  for (size_t i = 0; i < sites.size(); ++i) {
+    AppendFormatRecord(&header, i + 1, sites[i]);
+  }
+  if (!WriteFully(fd, header.data(), header.size())) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return false;
+  }
+  gBinaryLogFd = fd;
+  gBinaryLogWriteFailed = false;
+  binlog_internal::gBinaryLogOpen.store(true, std::memory_order_relaxed);
+  return true;
+}
+
+// Buffered sequential reads for the decoder.
+class BinaryLogReader {
+ public:
+  explicit BinaryLogReader(int fd) : fd_(fd) {}
+
+  // Returns false at the end of the input (leaving errno alone) or on error.
+  bool Read(void* data, size_t size) {
+    while (buffer_.size() - pos_ < size) {
+      buffer_.erase(0, pos_);
+      pos_ = 0;
+      size_t old_size = buffer_.size();
+      buffer_.resize(old_size + kChunkSize);
+      ssize_t n = TEMP_FAILURE_RETRY(read(fd_, &buffer_[old_size], kChunkSize));
+      buffer_.resize(old_size + (n > 0 ? n : 0));
+      if (n <= 0) return false;
+    }
+    memcpy(data, buffer_.data() + pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  template <typename T>
+  bool ReadValue(T* value) {
+    return Read(value, sizeof(*value));
+  }
+
+  bool ReadString(std::string* s) {
+    uint32_t size;
+    if (!ReadValue(&size)) return false;
+    s->resize(size);
+    return size == 0 || Read(&(*s)[0], size);
+  }
+
+ private:
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  int fd_;
+  std::string buffer_;
+  size_t pos_ = 0;
+};
+
+// A format string split into literal text and printf conversions.
+struct DecodedFormat {
+  struct Piece {
+    std::string literal;
+    // Flags, width and precision, without the length modifier; empty for a
+    // piece that is only literal text.
+    std::string spec;
+    char conversion = 0;
+  };
+
+  std::string file;
+  std::string tag;
+  uint32_t line = 0;
+  std::vector<Piece> pieces;
+};
+
+static void ParseFormat(const std::string& format, std::vector<DecodedFormat::Piece>* pieces) {
+  DecodedFormat::Piece piece;
+  size_t i = 0;
+  while (i < format.size()) {
+    char c = format[i++];
+    if (c != '%') {
+      piece.literal += c;
+      continue;
+    }
+    if (i < format.size() && format[i] == '%') {
+      piece.literal += '%';
+      ++i;
+      continue;
+    }
+    size_t start = i - 1;
+    std::string spec = "%";
+    while (i < format.size() && strchr("-+ #0'", format[i]) != nullptr) spec += format[i++];
+    while (i < format.size() && (isdigit(format[i]) || format[i] == '*')) spec += format[i++];
+    if (i < format.size() && format[i] == '.') {
+      spec += format[i++];
+      while (i < format.size() && (isdigit(format[i]) || format[i] == '*')) spec += format[i++];
+    }
+    while (i < format.size() && strchr("hlLqjzt", format[i]) != nullptr) ++i;
+    if (i == format.size()) {
+      // A dangling '%' is printed as it is.
+      piece.literal += format.substr(start);
+      break;
+    }
+    piece.spec = spec;
+    piece.conversion = format[i++];
+    pieces->push_back(piece);
+    piece = DecodedFormat::Piece();
+  }
+  if (!piece.literal.empty()) pieces->push_back(piece);
+}
+
+// Decoded arguments of one entry.
+class ArgReader {
+ public:
+  ArgReader(const char* data, size_t size) : p_(data), end_(data + size) {}
+
+  bool Next(uint8_t* type, uint64_t* bits, std::string* s) {
+    if (p_ == end_) return false;
+    *type = *p_++;
+    size_t size;
+    switch (*type) {
+      case binlog_internal::kArgInt32:
+      case binlog_internal::kArgUInt32:
+      case binlog_internal::kArgString:
+        size = sizeof(uint32_t);
+        break;
+      case binlog_internal::kArgInt64:
+      case binlog_internal::kArgUInt64:
+      case binlog_internal::kArgDouble:
+      case binlog_internal::kArgPointer:
+        size = sizeof(uint64_t);
+        break;
+      default:
+        return false;
+    }
+    if (static_cast<size_t>(end_ - p_) < size) return false;
+    *bits = 0;
+    if (size == sizeof(uint32_t)) {
+      uint32_t v;
+      memcpy(&v, p_, sizeof(v));
+      *bits = (*type == binlog_internal::kArgInt32) ? static_cast<uint64_t>(static_cast<int32_t>(v))
+                                                      : v;
+    } else {
+      memcpy(bits, p_, sizeof(*bits));
+    }
+    p_ += size;
+    if (*type == binlog_internal::kArgString) {
+      if (static_cast<size_t>(end_ - p_) < *bits) return false;
+      s->assign(p_, *bits);
+      p_ += *bits;
+    }
+    return true;
+  }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+static bool IsSignedArg(uint8_t type) {
+  return type == binlog_internal::kArgInt32 || type == binlog_internal::kArgInt64;
+}
+
+static void FormatArg(std::string* out, std::string spec, char conversion, uint8_t type,
+                      uint64_t bits, const std::string& s) {
+  switch (type) {
+    case binlog_internal::kArgInt32:
+    case binlog_internal::kArgInt64:
+    case binlog_internal::kArgUInt32:
+    case binlog_internal::kArgUInt64:
+      if (strchr("eEfFgGaA", conversion) != nullptr) {
+        double value = IsSignedArg(type) ? static_cast<double>(static_cast<int64_t>(bits))
+                                         : static_cast<double>(bits);
+        StringAppendF(out, (spec + conversion).c_str(), value);
+      } else if (conversion == 'c') {
+        StringAppendF(out, (spec + 'c').c_str(), static_cast<int>(bits));
+      } else if (strchr("diouxX", conversion) != nullptr) {
+        StringAppendF(out, (spec + "ll" + conversion).c_str(), static_cast<long long>(bits));
+      } else if (IsSignedArg(type)) {
+        StringAppendF(out, (spec + "lld").c_str(), static_cast<long long>(bits));
+      } else {
+        StringAppendF(out, (spec + "llu").c_str(), static_cast<unsigned long long>(bits));
+      }
+      break;
+    case binlog_internal::kArgDouble: {
+      double value;
+      memcpy(&value, &bits, sizeof(value));
+      if (strchr("eEfFgGaA", conversion) == nullptr) conversion = 'g';
+      StringAppendF(out, (spec + conversion).c_str(), value);
+      break;
+    }
+    case binlog_internal::kArgPointer:
+      StringAppendF(out, (spec + 'p').c_str(), reinterpret_cast<void*>(static_cast<uintptr_t>(bits)));
+      break;
+    case binlog_internal::kArgString:
+      StringAppendF(out, (spec + 's').c_str(), s.c_str());
+      break;
+  }
+}
+
+static void FormatMessage(const DecodedFormat& format, const char* args, size_t args_size,
+                          std::string* out) {
+  ArgReader reader(args, args_size);
+  uint8_t type;
+  uint64_t bits;
+  std::string s;
+  for (const DecodedFormat::Piece& piece : format.pieces) {
+    out->append(piece.literal);
+    if (piece.conversion == 0) continue;
+    // Substitute '*' widths and precisions, which are recorded as arguments.
+    std::string spec;
+    for (size_t i = 0; i < piece.spec.size(); ++i) {
+      if (piece.spec[i] != '*') {
+        spec += piece.spec[i];
+        continue;
+      }
+      long long value = reader.Next(&type, &bits, &s) ? static_cast<long long>(bits) : 0;
+      if (spec.back() == '.' && value < 0) {
+        spec.pop_back();
+      } else {
+        spec += std::to_string(value);
+      }
+    }
+    if (!reader.Next(&type, &bits, &s)) {
+      out->append(spec).append(1, piece.conversion);
+      continue;
+    }
+    if (piece.conversion == 'n') continue;
+    FormatArg(out, spec, piece.conversion, type, bits, s);
+  }
+}
+
+static void AppendLines(const DecodedFormat& format, const std::string& tag, char severity_char,
+                        int64_t time_ns, int32_t pid, uint64_t tid, const std::string& message,
+                        std::string* out) {
+  struct tm now;
+  time_t t = time_ns / 1000000000;
+  localtime_r(&t, &now);
+  char timestamp[32];
+  strftime(timestamp, sizeof(timestamp), "%m-%d %H:%M:%S", &now);
+
+  // Like LogMessage, emit every line of a multi-line message separately.
+  size_t i = 0;
+  do {
+    size_t nl = message.find('\n', i);
+    size_t end = (nl == std::string::npos) ? message.size() : nl;
+    StringAppendF(out, "%s %c %s %5d %5" PRIu64 " %s:%u] ", tag.c_str(), severity_char, timestamp,
+                  pid, tid, format.file.c_str(), format.line);
+    out->append(message, i, end - i);
+    out->append(1, '\n');
+    if (nl == std::string::npos) break;
+    i = nl + 1;
+  } while (i < message.size());
+}
+
+bool DecodeBinaryLog(int in_fd, int out_fd) {
+  BinaryLogReader reader(in_fd);
+
+  char magic[sizeof(kMagic)];
+  uint32_t version;
+  uint32_t byte_order_mark;
+  int32_t pid;
+  std::string default_tag;
+  errno = 0;
+  if (!reader.Read(magic, sizeof(magic)) || !reader.ReadValue(&version) ||
+      !reader.ReadValue(&byte_order_mark) || !reader.ReadValue(&pid) ||
+      !reader.ReadString(&default_tag)) {
+    if (errno == 0) errno = EINVAL;
+    return false;
+  }
+  if (memcmp(magic, kMagic, sizeof(kMagic)) != 0 || version != kVersion ||
+      byte_order_mark != kByteOrderMark) {
+    errno = EINVAL;
+    return false;
+  }
+
+  static const char log_characters[] = "VDIWEFF";
+  std::vector<DecodedFormat> formats;
+  std::string args;
+  std::string message;
+  std::string out;
+  bool complete = false;
+  for (;;) {
+    errno = 0;
+    uint8_t type;
+    if (!reader.ReadValue(&type)) {
+      complete = (errno == 0);
+      break;
+    }
+    if (type == kRecordFormat) {
+      uint32_t id;
+      DecodedFormat format;
+      std::string format_string;
+      if (!reader.ReadValue(&id) || !reader.ReadValue(&format.line) ||
+          !reader.ReadString(&format.file) || !reader.ReadString(&format.tag) ||
+          !reader.ReadString(&format_string) || id == 0) {
+        break;
+      }
+      ParseFormat(format_string, &format.pieces);
+      if (formats.size() < id) formats.resize(id);
+      formats[id - 1] = std::move(format);
+    } else if (type == kRecordEntry) {
+      uint8_t severity;
+      uint32_t id;
+      int64_t time_ns;
+      uint64_t tid;
+      uint32_t args_size;
+      if (!reader.ReadValue(&severity) || !reader.ReadValue(&id) || !reader.ReadValue(&time_ns) ||
+          !reader.ReadValue(&tid) || !reader.ReadValue(&args_size)) {
+        break;
+      }
+      args.resize(args_size);
+      if ((args_size > 0 && !reader.Read(&args[0], args_size)) || id == 0 ||
+          id > formats.size() || severity > FATAL) {
+        break;
+      }
+      const DecodedFormat& format = formats[id - 1];
+      message.clear();
+      FormatMessage(format, args.data(), args.size(), &message);
+      AppendLines(format, format.tag.empty() ? default_tag : format.tag,
+                  log_characters[severity], time_ns, pid, tid, message, &out);
+    } else {
+      break;
+    }
+    if (out.size() >= 64 * 1024) {
+      if (!WriteFully(out_fd, out.data(), out.size())) return false;
+      out.clear();
+    }
+  }
+  int saved_errno = (errno != 0) ? errno : EINVAL;
+  if (!WriteFully(out_fd, out.data(), out.size())) return false;
+  if (!complete) {
+    errno = saved_errno;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace base
+}  // namespace cpputils
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "cpputils-base/macros.h"
+
+namespace cpputils {
+namespace base {
+
+// A bounded multi-producer/multi-consumer queue in the style of Dmitry Vyukov's
+// array queue. Every cell carries a sequence number that tells producers and
+// consumers whose turn it is, so neither side ever takes a lock.
+//
+// Elements are never destroyed while the queue is alive: producers assign into
+// and consumers swap out of the cells, which lets types such as std::string
+// keep their capacity around and stop allocating once the queue is warm.
+//
+// Note: this is an implementation detail of libcpputils, not a public API.
+template <typename T>
+class BoundedQueue {
+ public:
+  // `capacity` is rounded up to the next power of two.
+  explicit BoundedQueue(size_t capacity) : mask_(RoundUp(capacity) - 1) {
+    cells_.reset(new Cell[mask_ + 1]);
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    enqueue_pos_.store(0, std::memory_order_relaxed);
+    dequeue_pos_.store(0, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Claims a free cell and lets `fill` write into it. Returns false without
+  // calling `fill` if the queue is full.
+  template <typename Fill>
+  bool TryPush(Fill&& fill) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    fill(cell->value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Claims the oldest filled cell and lets `drain` read (or swap) out of it.
+  // Returns false without calling `drain` if the queue is empty.
+  template <typename Drain>
+  bool TryPop(Drain&& drain) {
+    Cell* cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    drain(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Number of cells ever claimed by producers and consumers respectively.
+  // Racy by nature: a claimed cell may not have been filled or drained yet.
+  size_t EnqueuePosition() const { return enqueue_pos_.load(std::memory_order_seq_cst); }
+  size_t DequeuePosition() const { return dequeue_pos_.load(std::memory_order_seq_cst); }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  static size_t RoundUp(size_t n) {
+    size_t result = 2;
+    while (result < n) result <<= 1;
+    return result;
+  }
+
+  // Keep the producer and consumer cursors on separate cache lines. Padding
+  // rather than alignas, because C++14 operator new ignores extended alignment.
+  static constexpr size_t kCacheLineSize = 64;
+  std::atomic<size_t> enqueue_pos_;
+  char pad0_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_pos_;
+  char pad1_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+  const size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+
+  DISALLOW_COPY_AND_ASSIGN(BoundedQueue);
+};
+
+}  // namespace base
+}  // namespace cpputils
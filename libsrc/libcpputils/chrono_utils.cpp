@@ -18,6 +18,17 @@
 
 #include <time.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "cpputils-base/metrics.h"
+
 namespace cpputils {
 namespace base {
 
@@ -33,6 +44,188 @@ boot_clock::time_point boot_clock::now() {
 #endif  // __linux__
 }
 
+namespace chrono_internal {
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static uint64_t MonotonicRawNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Reads the counter and CLOCK_MONOTONIC_RAW as close together as it can, and
+// returns the counter at the middle of the tightest of a few tries.
+static void ReadTscAndClock(uint64_t* tsc, uint64_t* ns) {
+  uint64_t best_window = UINT64_MAX;
+  for (int i = 0; i < 8; ++i) {
+    uint64_t before = __builtin_ia32_rdtsc();
+    uint64_t clock = MonotonicRawNs();
+    uint64_t after = __builtin_ia32_rdtsc();
+    if (after - before < best_window) {
+      best_window = after - before;
+      *tsc = before + (after - before) / 2;
+      *ns = clock;
+    }
+  }
+}
+
+static TscCalibration Calibrate() {
+  TscCalibration calibration = {false, uint64_t(1) << 32};
+  unsigned int eax, ebx, ecx, edx;
+  // The counter must run at a constant rate in every power state.
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || (edx & (1U << 8)) == 0) {
+    return calibration;
+  }
+  // Newer CPUs report the counter's frequency relative to their crystal.
+  if (__get_cpuid(0x15, &eax, &ebx, &ecx, &edx) && eax != 0 && ebx != 0 && ecx != 0) {
+    uint64_t hz = static_cast<uint64_t>(ecx) * ebx / eax;
+    calibration.ns_per_tick = (uint64_t(1000000000) << 32) / hz;
+    calibration.use_counter = true;
+    return calibration;
+  }
+  uint64_t tsc_start, ns_start, tsc_end, ns_end;
+  ReadTscAndClock(&tsc_start, &ns_start);
+  do {
+    ReadTscAndClock(&tsc_end, &ns_end);
+  } while (ns_end - ns_start < 10000000);
+  uint64_t ns = ns_end - ns_start;
+  uint64_t ticks = tsc_end - tsc_start;
+  // Keep ns << 32 within 64 bits, should the thread have been preempted for
+  // seconds; 32-bit targets have no 128-bit integers to spare the precision.
+  while ((ns >> 32) != 0) {
+    ns >>= 1;
+    ticks >>= 1;
+  }
+  calibration.ns_per_tick = (ns << 32) / ticks;
+  calibration.use_counter = true;
+  return calibration;
+}
+
+#elif defined(__aarch64__)
+
+static TscCalibration Calibrate() {
+  TscCalibration calibration = {false, uint64_t(1) << 32};
+  uint64_t hz;
+  asm volatile("mrs %0, cntfrq_el0" : "=r"(hz));
+  if (hz != 0) {
+    calibration.ns_per_tick = (uint64_t(1000000000) << 32) / hz;
+    calibration.use_counter = true;
+  }
+  return calibration;
+}
+
+#else
+
+static TscCalibration Calibrate() {
+  return TscCalibration{false, uint64_t(1) << 32};
+}
+
+#endif
+
+const TscCalibration& GetTscCalibration() {
+  static const TscCalibration calibration = Calibrate();
+  return calibration;
+}
+
+CoarseClockCache gCoarseClockCache;
+
+}  // namespace chrono_internal
+
+using chrono_internal::gCoarseClockCache;
+
+static int64_t ReadClockNs(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__linux__)
+static constexpr clockid_t kMonotonicCoarse = CLOCK_MONOTONIC_COARSE;
+static constexpr clockid_t kRealtimeCoarse = CLOCK_REALTIME_COARSE;
+#else
+static constexpr clockid_t kMonotonicCoarse = CLOCK_MONOTONIC;
+static constexpr clockid_t kRealtimeCoarse = CLOCK_REALTIME;
+#endif
+
+coarse_clock::time_point coarse_clock::read_now() {
+  // The coarse clock lags the precise one that the ticker published, so the
+  // last published time keeps the clock from going back once it stops.
+  int64_t ns = std::max(ReadClockNs(kMonotonicCoarse),
+                        gCoarseClockCache.monotonic_ns.load(std::memory_order_relaxed));
+  return time_point(duration(ns));
+}
+
+std::chrono::system_clock::time_point coarse_clock::read_system_now() {
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(ReadClockNs(kRealtimeCoarse))));
+}
+
+struct CoarseClockTicker {
+  // Held through StartTicker and StopTicker, so that a new ticker never
+  // starts while the old one is still stopping.
+  std::mutex control;
+  std::mutex lock;
+  std::condition_variable stop_cv;
+  bool stop = false;
+  std::thread thread;
+};
+
+// Leaked, since the ticker may still be running when the process exits.
+static CoarseClockTicker& GetCoarseClockTicker() {
+  static auto& ticker = *new CoarseClockTicker();
+  return ticker;
+}
+
+static void PublishTime() {
+  gCoarseClockCache.monotonic_ns.store(ReadClockNs(CLOCK_MONOTONIC), std::memory_order_relaxed);
+  gCoarseClockCache.realtime_ns.store(ReadClockNs(CLOCK_REALTIME), std::memory_order_relaxed);
+}
+
+bool coarse_clock::StartTicker(std::chrono::microseconds period) {
+  CoarseClockTicker& ticker = GetCoarseClockTicker();
+  std::lock_guard<std::mutex> control(ticker.control);
+  if (ticker.thread.joinable()) return false;
+  // Publish before readers are switched over, so that they never see 0.
+  PublishTime();
+  gCoarseClockCache.ticking.store(true, std::memory_order_release);
+  ticker.stop = false;
+  ticker.thread = std::thread([&ticker, period] {
+    std::unique_lock<std::mutex> lock(ticker.lock);
+    while (!ticker.stop_cv.wait_for(lock, period, [&ticker] { return ticker.stop; })) {
+      PublishTime();
+    }
+  });
+  return true;
+}
+
+void coarse_clock::StopTicker() {
+  CoarseClockTicker& ticker = GetCoarseClockTicker();
+  std::lock_guard<std::mutex> control(ticker.control);
+  if (!ticker.thread.joinable()) return;
+  gCoarseClockCache.ticking.store(false, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> guard(ticker.lock);
+    ticker.stop = true;
+  }
+  ticker.stop_cv.notify_one();
+  ticker.thread.join();
+}
+
+ScopedTimer::~ScopedTimer() {
+  // Counters of different CPUs may be slightly apart, so a thread that moves
+  // could see time go backwards.
+  uint64_t end = tsc_clock::ticks();
+  int64_t ns = (end > start_) ? tsc_clock::to_nanoseconds(end - start_) : 0;
+  if (counter_ != nullptr) counter_->Increment(ns);
+  if (histogram_ != nullptr) histogram_->Record(ns);
+}
+
+void Timer::RecordTo(Histogram& histogram) const {
+  histogram.Record((boot_clock::now() - start_).count());
+}
+
 std::ostream& operator<<(std::ostream& os, const Timer& t) {
   os << t.duration().count() << "ms";
   return os;
@@ -0,0 +1,215 @@
+#pragma once
+
+//
+// Binary (deferred formatting) logging.
+//
+// For loops where formatting a LOG line costs more than the work being
+// logged. A BINLOG statement records a static format id and the raw bytes of
+// its arguments into a per-thread buffer; the text is only produced later,
+// offline, by DecodeBinaryLog or the binlog-decode tool:
+//
+//   OpenBinaryLog("/data/local/tmp/app.binlog");
+//   BINLOG(INFO, "processed %d items in %.3f ms from %s", n, ms, name);
+//
+// The format must be a string literal using printf conversions, and it is
+// checked against the arguments at compile time like printf. Arguments may be
+// integers, enums, floating point values, pointers and C strings. Strings are
+// copied, so pass std::string as `s.c_str()`, and a char pointer is always
+// taken to be a string: cast it to `const void*` to record its address.
+//
+// BINLOG honours the minimum log severity and costs a single load while no
+// binary log is open. It never aborts, not even for FATAL.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+#include "cpputils-base/logging.h"
+
+namespace cpputils {
+namespace base {
+
+// Starts recording BINLOG statements into `path`, replacing any binary log
+// that is already open. Returns false and sets errno on failure.
+bool OpenBinaryLog(const std::string& path);
+
+// Flushes and closes the binary log. BINLOG statements are ignored afterwards.
+void CloseBinaryLog();
+
+// Writes out whatever every thread has buffered so far. Buffers are also
+// flushed when they fill up, when their thread exits and by CloseBinaryLog.
+void FlushBinaryLog();
+
+// Reads a binary log from `in_fd` and writes it to `out_fd` as text, one line
+// per logged line, in the same format as StderrLogger. Returns false and sets
+// errno on failure; a log cut short by a crash decodes up to the last complete
+// record and then fails with EINVAL.
+bool DecodeBinaryLog(int in_fd, int out_fd);
+
+namespace binlog_internal {
+
+// The static part of a BINLOG statement. `id` is assigned the first time the
+// statement is reached, and the other fields are written to the log once.
+struct FormatSite {
+  const char* file;
+  unsigned int line;
+  const char* tag;
+  const char* format;
+  std::atomic<uint32_t> id;
+};
+
+// How an argument was recorded. Every argument is a tag byte followed by its
+// value in host byte order; strings are a uint32_t length and the bytes.
+enum ArgType : uint8_t {
+  kArgInt32 = 1,
+  kArgInt64 = 2,
+  kArgUInt32 = 3,
+  kArgUInt64 = 4,
+  kArgDouble = 5,
+  kArgPointer = 6,
+  kArgString = 7,
+};
+
+struct StringArg {
+  const char* data;
+  uint32_t size;
+};
+
+extern std::atomic<bool> gBinaryLogOpen;
+
+inline bool IsBinaryLogOpen() {
+  return gBinaryLogOpen.load(std::memory_order_relaxed);
+}
+
+// Assigns `site` an id, writing its definition to the log, and returns it.
+uint32_t RegisterFormatSite(FormatSite* site);
+
+// Returns `size` bytes of the calling thread's buffer for the arguments of a
+// record, or nullptr if the calling thread is already exiting. Every
+// successful call must be paired with EndRecord.
+char* BeginRecord(uint32_t id, LogSeverity severity, size_t size);
+void EndRecord();
+
+// Reduces every argument to one of the recorded types.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value &&
+                            sizeof(T) <= sizeof(int32_t),
+                        int32_t>::type
+Normalize(T value) {
+  return value;
+}
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value &&
+                            (sizeof(T) > sizeof(int32_t)),
+                        int64_t>::type
+Normalize(T value) {
+  return value;
+}
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value &&
+                            sizeof(T) <= sizeof(uint32_t),
+                        uint32_t>::type
+Normalize(T value) {
+  return value;
+}
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value &&
+                            (sizeof(T) > sizeof(uint32_t)),
+                        uint64_t>::type
+Normalize(T value) {
+  return value;
+}
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, double>::type Normalize(T value) {
+  return static_cast<double>(value);
+}
+template <typename T>
+auto Normalize(T value) -> typename std::enable_if<
+    std::is_enum<T>::value,
+    decltype(Normalize(static_cast<typename std::underlying_type<T>::type>(value)))>::type {
+  return Normalize(static_cast<typename std::underlying_type<T>::type>(value));
+}
+template <typename T>
+const void* Normalize(T* value) {
+  return value;
+}
+inline StringArg Normalize(const char* value) {
+  if (value == nullptr) value = "(null)";
+  return StringArg{value, static_cast<uint32_t>(strlen(value))};
+}
+inline StringArg Normalize(char* value) {
+  return Normalize(static_cast<const char*>(value));
+}
+
+inline size_t EncodedSize(int32_t) { return 1 + sizeof(int32_t); }
+inline size_t EncodedSize(int64_t) { return 1 + sizeof(int64_t); }
+inline size_t EncodedSize(uint32_t) { return 1 + sizeof(uint32_t); }
+inline size_t EncodedSize(uint64_t) { return 1 + sizeof(uint64_t); }
+inline size_t EncodedSize(double) { return 1 + sizeof(double); }
+inline size_t EncodedSize(const void*) { return 1 + sizeof(uint64_t); }
+inline size_t EncodedSize(const StringArg& value) { return 1 + sizeof(uint32_t) + value.size; }
+
+template <typename T>
+inline char* EncodeValue(char* p, ArgType type, T value) {
+  *p++ = type;
+  memcpy(p, &value, sizeof(value));
+  return p + sizeof(value);
+}
+inline char* Encode(char* p, int32_t value) { return EncodeValue(p, kArgInt32, value); }
+inline char* Encode(char* p, int64_t value) { return EncodeValue(p, kArgInt64, value); }
+inline char* Encode(char* p, uint32_t value) { return EncodeValue(p, kArgUInt32, value); }
+inline char* Encode(char* p, uint64_t value) { return EncodeValue(p, kArgUInt64, value); }
+inline char* Encode(char* p, double value) { return EncodeValue(p, kArgDouble, value); }
+inline char* Encode(char* p, const void* value) {
+  return EncodeValue(p, kArgPointer, static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value)));
+}
+inline char* Encode(char* p, const StringArg& value) {
+  p = EncodeValue(p, kArgString, value.size);
+  memcpy(p, value.data, value.size);
+  return p + value.size;
+}
+
+template <typename... Args>
+void WriteRecord(FormatSite* site, LogSeverity severity, const Args&... args) {
+  uint32_t id = site->id.load(std::memory_order_acquire);
+  if (UNLIKELY(id == 0)) id = RegisterFormatSite(site);
+  size_t size = 0;
+  using expand = int[];
+  (void)expand{0, (size += EncodedSize(args), 0)...};
+  char* p = BeginRecord(id, severity, size);
+  if (p == nullptr) return;
+  (void)expand{0, (p = Encode(p, args), 0)...};
+  EndRecord();
+}
+
+template <typename... Args>
+void Log(FormatSite* site, LogSeverity severity, const Args&... args) {
+  WriteRecord(site, severity, Normalize(args)...);
+}
+
+// Never called; lets the compiler check BINLOG arguments against the format.
+inline void CheckFormat(const char*, ...) __attribute__((__format__(__printf__, 1, 2)));
+inline void CheckFormat(const char*, ...) {}
+
+}  // namespace binlog_internal
+
+// Records a message in the binary log, if one is open and `severity` is at
+// least the minimum log severity.
+#define BINLOG(severity, format, ...)                                                       \
+  do {                                                                                      \
+    static ::cpputils::base::binlog_internal::FormatSite binlog_site_ = {                   \
+        __FILE__, __LINE__, _LOG_TAG_INTERNAL, "" format "", {0}};                          \
+    if (false) ::cpputils::base::binlog_internal::CheckFormat(format, ##__VA_ARGS__);       \
+    if (UNLIKELY(::cpputils::base::binlog_internal::IsBinaryLogOpen()) &&                   \
+        WOULD_LOG_TO_LOGGER(severity)) {                                                    \
+      ::cpputils::base::binlog_internal::Log(&binlog_site_, SEVERITY_LAMBDA(severity),      \
+                                             ##__VA_ARGS__);                                \
+    }                                                                                       \
+  } while (0)
+
+}  // namespace base
+}  // namespace cpputils
@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <stdint.h>
+
+#include <atomic>
 #include <chrono>
 #include <sstream>
 
@@ -26,6 +29,9 @@ using namespace std::chrono_literals;
 namespace cpputils {
 namespace base {
 
+class Counter;
+class Histogram;
+
 // A std::chrono clock based on CLOCK_BOOTTIME.
 class boot_clock {
  public:
@@ -35,6 +41,160 @@ class boot_clock {
   static time_point now();
 };
 
+namespace chrono_internal {
+
+struct TscCalibration {
+  // Whether tsc_clock reads the CPU's counter rather than boot_clock.
+  bool use_counter;
+  // Nanoseconds per tick, as a 32.32 fixed point number.
+  uint64_t ns_per_tick;
+};
+
+const TscCalibration& GetTscCalibration();
+
+// (a * b) >> 32, truncated to 64 bits, from four 32x32 bit products.
+inline uint64_t MulShift32Split(uint64_t a, uint64_t b) {
+  uint64_t a_hi = a >> 32, a_lo = a & 0xffffffff;
+  uint64_t b_hi = b >> 32, b_lo = b & 0xffffffff;
+  return ((a_hi * b_hi) << 32) + a_hi * b_lo + a_lo * b_hi + ((a_lo * b_lo) >> 32);
+}
+
+// (a * b) >> 32, truncated to 64 bits. 32-bit targets have no 128-bit integers.
+inline uint64_t MulShift32(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 32);
+#else
+  return MulShift32Split(a, b);
+#endif
+}
+
+}  // namespace chrono_internal
+
+// A std::chrono clock based on the CPU's time stamp counter: rdtsc on x86,
+// where the counter must be invariant, and cntvct_el0 on ARM64. Reading it is
+// a single instruction rather than a clock_gettime call, so it is meant for
+// timing short stretches of hot code. Elsewhere, tsc_clock falls back to
+// boot_clock. Its epoch is unspecified, so only differences between its time
+// points mean anything.
+//
+// The counter's frequency is calibrated against CLOCK_MONOTONIC_RAW on first
+// use, which takes about 10 ms, unless the CPU reports it.
+class tsc_clock {
+ public:
+  typedef std::chrono::nanoseconds duration;
+  typedef std::chrono::time_point<tsc_clock, duration> time_point;
+  static constexpr bool is_steady = true;
+
+  static time_point now() { return time_point(duration(to_nanoseconds(ticks()))); }
+
+  // The raw counter.
+  static uint64_t ticks() {
+    static const chrono_internal::TscCalibration& calibration =
+        chrono_internal::GetTscCalibration();
+    if (calibration.use_counter) {
+#if defined(__x86_64__) || defined(__i386__)
+      return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+      uint64_t ticks;
+      asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks)::"memory");
+      return ticks;
+#endif
+    }
+    return boot_clock::now().time_since_epoch().count();
+  }
+
+  // Converts a number of ticks to nanoseconds.
+  static int64_t to_nanoseconds(uint64_t ticks) {
+    static const chrono_internal::TscCalibration& calibration =
+        chrono_internal::GetTscCalibration();
+    return static_cast<int64_t>(chrono_internal::MulShift32(ticks, calibration.ns_per_tick));
+  }
+
+  static bool uses_counter() { return chrono_internal::GetTscCalibration().use_counter; }
+};
+
+namespace chrono_internal {
+
+// What the coarse_clock ticker publishes, on a cache line of its own so that
+// other writes never invalidate it for the readers.
+struct alignas(64) CoarseClockCache {
+  std::atomic<bool> ticking;
+  std::atomic<int64_t> monotonic_ns;
+  std::atomic<int64_t> realtime_ns;
+};
+
+extern CoarseClockCache gCoarseClockCache;
+
+}  // namespace chrono_internal
+
+// A std::chrono clock based on CLOCK_MONOTONIC_COARSE, with a wall clock
+// counterpart based on CLOCK_REALTIME_COARSE. Both are only as precise as the
+// kernel's tick, typically 1 to 4 ms, but cost a fraction of a precise read,
+// which suits code that reads the time very often, such as for timeouts and
+// rate limits.
+//
+// While the ticker is running, a thread publishes the precise time every
+// period instead, and reading either clock becomes a plain load:
+//
+//   coarse_clock::StartTicker(std::chrono::microseconds(500));
+class coarse_clock {
+ public:
+  typedef std::chrono::nanoseconds duration;
+  typedef std::chrono::time_point<coarse_clock, duration> time_point;
+  static constexpr bool is_steady = true;
+
+  static time_point now() {
+    chrono_internal::CoarseClockCache& cache = chrono_internal::gCoarseClockCache;
+    if (cache.ticking.load(std::memory_order_acquire)) {
+      return time_point(duration(cache.monotonic_ns.load(std::memory_order_relaxed)));
+    }
+    return read_now();
+  }
+
+  static std::chrono::system_clock::time_point system_now() {
+    chrono_internal::CoarseClockCache& cache = chrono_internal::gCoarseClockCache;
+    if (cache.ticking.load(std::memory_order_acquire)) {
+      return std::chrono::system_clock::time_point(
+          std::chrono::duration_cast<std::chrono::system_clock::duration>(
+              duration(cache.realtime_ns.load(std::memory_order_relaxed))));
+    }
+    return read_system_now();
+  }
+
+  // Starts publishing the time every `period`. Returns false if the ticker is
+  // already running.
+  static bool StartTicker(std::chrono::microseconds period = std::chrono::milliseconds(1));
+  // Stops the ticker and waits for its thread to exit.
+  static void StopTicker();
+
+ private:
+  static time_point read_now();
+  static std::chrono::system_clock::time_point read_system_now();
+};
+
+// Times the rest of the enclosing scope with tsc_clock, and then adds the
+// time in nanoseconds to a counter or records it into a histogram, both from
+// cpputils-base/metrics.h:
+//
+//   static Histogram& parse_ns = GetHistogram("parse_ns");
+//   ScopedTimer timer(parse_ns);
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(Counter& counter)
+      : counter_(&counter), histogram_(nullptr), start_(tsc_clock::ticks()) {}
+  explicit ScopedTimer(Histogram& histogram)
+      : counter_(nullptr), histogram_(&histogram), start_(tsc_clock::ticks()) {}
+  ~ScopedTimer();
+
+ private:
+  Counter* const counter_;
+  Histogram* const histogram_;
+  const uint64_t start_;
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
 class Timer {
  public:
   Timer() : start_(boot_clock::now()) {}
@@ -43,6 +203,10 @@ class Timer {
     return std::chrono::duration_cast<std::chrono::milliseconds>(boot_clock::now() - start_);
   }
 
+  // Records the time since the timer was started, in nanoseconds, into a
+  // histogram from cpputils-base/metrics.h.
+  void RecordTo(Histogram& histogram) const;
+
  private:
   boot_clock::time_point start_;
 };
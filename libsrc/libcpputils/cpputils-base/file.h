@@ -78,6 +78,11 @@ namespace cpputils {
 namespace base {
 
 bool ReadFdToString(int fd, std::string* content);
+// Like ReadFdToString, for files whose size fstat cannot tell, such as pipes,
+// sockets and /proc files: `size_hint` is the size to expect, which saves
+// growing `content` many times. The read still goes to the end of the file
+// whether the hint is too small or too large.
+bool ReadFdToString(int fd, std::string* content, size_t size_hint);
 bool ReadFileToString(const std::string& path, std::string* content,
                       bool follow_symlinks = false);
 
@@ -89,6 +94,29 @@ bool WriteStringToFd(const std::string& content, int fd);
 bool WriteStringToFile(const std::string& content, const std::string& path,
                        mode_t mode, uid_t owner, gid_t group,
                        bool follow_symlinks = false);
+
+struct AtomicWriteOptions {
+  // The mode of the new file, less the umask.
+  mode_t mode = 0666;
+  // Whether to wait until the new content is on disk, so that it survives a
+  // power loss as well as a crash. Without it, the file is still never seen
+  // half written, but may go back to its old content after a power loss.
+  bool durable = true;
+  // Whether concurrent writers into the same directory may share the fsync
+  // of that directory, which makes renames durable. A writer still waits for
+  // an fsync that started after its own rename, so this trades nothing but
+  // a little latency for throughput.
+  bool group_commit = false;
+};
+
+// Replaces the file at `path` with `content` so that readers, and the file
+// after a crash, see either the old or the new content but never a mix. The
+// content is written to a new file in the same directory and renamed over
+// `path`; where O_TMPFILE is supported, the new file has no name until it is
+// complete. If `path` is a symlink, the symlink itself is replaced. Returns
+// false and sets errno on failure, leaving the old file as it was.
+bool WriteStringToFileAtomic(const std::string& content, const std::string& path,
+                             const AtomicWriteOptions& options = AtomicWriteOptions());
 #endif
 
 bool ReadFully(int fd, void* data, size_t byte_count);
@@ -45,6 +45,12 @@
 // By default, the process' name is used as the log tag.
 // Code can choose a specific log tag by defining LOG_TAG
 // before including this header.
+//
+// Building with -DCPPUTILS_MIN_LOG_SEVERITY=WARNING (any severity name) drops
+// LOG and PLOG statements below that severity from the build: their condition
+// is a constant false, so the optimizer removes the statement along with its
+// strings and call site state. FATAL is never dropped, and neither are CHECKs,
+// which log at FATAL.
 
 // This header also provides assertions:
 //
@@ -64,9 +70,15 @@
 #undef DEBUG
 #endif
 
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <ostream>
+#include <string>
+#include <type_traits>
 
 #include "cpputils-base/macros.h"
 
@@ -99,14 +111,27 @@ enum LogId {
   SYSTEM,
 };
 
+#ifndef CPPUTILS_MIN_LOG_SEVERITY
+#define CPPUTILS_MIN_LOG_SEVERITY VERBOSE
+#endif
+
+// The lowest severity compiled into this translation unit.
+constexpr LogSeverity kMinCompiledLogSeverity =
+    (CPPUTILS_MIN_LOG_SEVERITY) < FATAL ? (CPPUTILS_MIN_LOG_SEVERITY) : FATAL;
+
 using LogFunction = std::function<void(LogId, LogSeverity, const char*, const char*,
                                        unsigned int, const char*)>;
 using AbortFunction = std::function<void(const char*)>;
 
 // Loggers for use with InitLogging/SetLogger.
 
-// Log to the kernel log (dmesg).
+// Log to the kernel log (dmesg). Messages longer than a kernel log record
+// are split across several records.
 void KernelLogger(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
+// Makes KernelLogger drop messages rather than wait when the kernel log cannot
+// take them (O_NONBLOCK and EAGAIN), so that a slow console cannot stall the
+// caller. The number of dropped messages is logged once writes succeed again.
+void SetKernelLoggerNonBlocking(bool non_blocking);
 // Log to stderr in the full logcat format (with pid/tid/time/tag details).
 void StderrLogger(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
 // Log just the message to stdout/stderr (without pid/tid/time/tag details).
@@ -115,6 +140,116 @@ void StderrLogger(LogId, LogSeverity, const char*, const char*, unsigned int, co
 // Useful for replacing printf(3)/perror(3)/err(3)/error(3) in command-line tools.
 void StdioLogger(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
 
+// How StderrLogger timestamps its lines.
+enum class LogTimestampFormat {
+  // Local time to the second: "01-02 03:04:05". The default.
+  kWallClock,
+  // Local time with milliseconds: "01-02 03:04:05.678".
+  kWallClockMillis,
+  // Local time with microseconds: "01-02 03:04:05.678901".
+  kWallClockMicros,
+  // Seconds since boot (boot_clock) with microseconds, as in dmesg: "  123.456789".
+  kMonotonic,
+};
+
+// The local time part of wall clock timestamps is formatted once per second
+// and thread, and reused until the second changes.
+void SetLogTimestampFormat(LogTimestampFormat format);
+LogTimestampFormat GetLogTimestampFormat();
+
+struct FileLoggerOptions {
+  // File to append to. Missing parent directories are created.
+  std::string path;
+  // Once the file would grow past this many bytes, path.1 becomes path.2 and
+  // so on, and path becomes path.1. 0 disables rotation.
+  size_t max_file_size = 16 * 1024 * 1024;
+  // Number of rotated files to keep. With 0 the file is simply started over.
+  size_t max_rotated_files = 4;
+  // Lines are collected in a buffer of this many bytes and written in bulk.
+  size_t buffer_size = 256 * 1024;
+  // A background thread writes buffered lines out at least this often. With
+  // 0 lines are written only by flush_severity, a full buffer, or Flush().
+  std::chrono::milliseconds flush_interval = std::chrono::milliseconds(1000);
+  // Lines of this severity or above are written out before the logger
+  // returns. FATAL lines always are.
+  LogSeverity flush_severity = ERROR;
+};
+
+// A LogFunction that writes lines in the StderrLogger format to a file that
+// it rotates by size. Logging threads only copy their line into a buffer;
+// writes and rotation happen on a background thread, unless the buffer is
+// full or the severity of a line asks for it to be written right away.
+// Copies share one buffer and file. Lines still buffered at exit are written.
+//
+//   FileLoggerOptions options;
+//   options.path = "/data/misc/mydaemon/log";
+//   SetLogger(FileLogger(options));
+class FileLogger {
+ public:
+  explicit FileLogger(const FileLoggerOptions& options);
+
+  void operator()(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
+
+  // Writes out everything buffered so far.
+  void Flush();
+
+ private:
+  class Impl;
+  std::shared_ptr<Impl> impl_;
+};
+
+// Sends each line, in the same format as StderrLogger, as one datagram to the
+// AF_UNIX SOCK_DGRAM socket bound at `path`, such as a local log collector.
+// Sending never blocks: lines are dropped while nothing is bound at `path` or
+// the collector's receive buffer is full. Best used as a log sink (see
+// AddLogSink).
+class SocketLogger {
+ public:
+  explicit SocketLogger(const std::string& path);
+
+  void operator()(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
+
+ private:
+  class Impl;
+  std::shared_ptr<Impl> impl_;
+};
+
+// How StructuredLogger and EncodeLogLine encode a line.
+enum class LogEncoding {
+  // One JSON object per line:
+  // {"ts":1760685797.123456,"level":"info","tag":"app","pid":12,"tid":34,
+  //  "file":"main.cpp","line":56,"msg":"done","req_id":17}
+  kJson,
+  // One logfmt line per line:
+  // ts=1760685797.123456 level=info tag=app pid=12 tid=34 file=main.cpp line=56 msg=done req_id=17
+  kLogfmt,
+};
+
+// Appends `message`, one line of a message, to `out` in `encoding`, with the
+// fields that LogStream::With attached to the message as keys of their own.
+// The time, thread and fields are those of the message being logged, so this
+// is meant to be called from a LogFunction. "ts" is in seconds since the
+// epoch, or since boot with LogTimestampFormat::kMonotonic. No newline is
+// appended. Meant for sinks that keep `out` around, so that its capacity is
+// reused from line to line.
+void EncodeLogLine(LogEncoding encoding, LogSeverity severity, const char* tag, const char* file,
+                   unsigned int line, const char* message, std::string* out);
+
+// A LogFunction that writes each line to `fd` encoded with EncodeLogLine, for
+// log pipelines that would otherwise have to parse the StderrLogger format.
+// Lines are encoded into a buffer that each thread reuses, and written with a
+// single write(2). `fd` is not closed.
+class StructuredLogger {
+ public:
+  StructuredLogger(int fd, LogEncoding encoding);
+
+  void operator()(LogId, LogSeverity, const char*, const char*, unsigned int, const char*);
+
+ private:
+  int fd_;
+  LogEncoding encoding_;
+};
+
 void DefaultAborter(const char* abort_message);
 
 std::string GetDefaultTag();
@@ -159,6 +294,108 @@ void SetLogger(LogFunction&& logger);
 // Replace the current aborter.
 void SetAborter(AbortFunction&& aborter);
 
+// What asynchronous logging does when its queue is full.
+enum class LogOverflowPolicy {
+  // Wait for the drain thread to make room. Nothing is lost.
+  kBlock,
+  // Discard the message that is being logged.
+  kDropNewest,
+  // Discard the oldest queued message to make room for the new one.
+  kDropOldest,
+};
+
+struct AsyncLoggingOptions {
+  // Number of messages that can be queued; rounded up to a power of two.
+  size_t queue_capacity = 4096;
+  // Maximum number of messages handed to the logger per lock acquisition.
+  size_t max_batch = 256;
+  LogOverflowPolicy overflow_policy = LogOverflowPolicy::kBlock;
+};
+
+// Moves the work of the current logger off the logging threads. Finished
+// messages are pushed into a lock-free queue and a background thread hands
+// them to the logger in batches. The thread id and time of each message are
+// captured when it is logged, so StderrLogger output looks the same as in
+// synchronous mode. FATAL messages flush the queue and are then logged
+// synchronously, so the aborter runs only after every earlier message has
+// been written. Calling this again while already enabled has no effect.
+void EnableAsyncLogging(const AsyncLoggingOptions& options = AsyncLoggingOptions());
+
+// Drains the queue and goes back to logging on the calling thread.
+void DisableAsyncLogging();
+
+// Blocks until every message logged before this call has been handed to the
+// logger and to every log sink (or dropped, depending on the overflow
+// policies). This is a no-op when asynchronous logging is not enabled and there
+// are no log sinks.
+void FlushLogs();
+
+struct LogSinkOptions {
+  LogSinkOptions() { queue.overflow_policy = LogOverflowPolicy::kDropNewest; }
+
+  // Messages at or above this severity are queued for the sink even when the
+  // minimum log severity and its overrides keep them from the logger. As with
+  // the flight recorder, a low severity makes disabled LOG statements cost as
+  // much as enabled ones.
+  LogSeverity min_severity = INFO;
+  // The sink's own queue. By default a full queue drops new messages rather
+  // than making the logging thread wait for a slow sink.
+  AsyncLoggingOptions queue;
+};
+
+// Sends every message to `sink` as well as to the logger, the way
+// EnableAsyncLogging does but with a queue and thread of its own, so that a
+// slow sink only ever delays itself. Sinks see one call per line, with the
+// thread id and time of the thread that logged it. Messages logged by a sink
+// (or by the async logging thread) go to the logger only. Returns an id for
+// RemoveLogSink.
+uint64_t AddLogSink(LogFunction&& sink, const LogSinkOptions& options = LogSinkOptions());
+
+// Hands the sink's queued messages to it, stops its thread and destroys it.
+// Returns false if there is no sink with that id.
+bool RemoveLogSink(uint64_t id);
+
+struct FlightRecorderOptions {
+  // Bytes of recent lines to keep; rounded up to a power of two.
+  size_t capacity = 256 * 1024;
+  // Messages at or above this severity are recorded even when the minimum log
+  // severity and its overrides keep them from the logger. Recording a message
+  // means formatting it, so a low severity makes disabled LOG statements
+  // cost as much as enabled ones.
+  LogSeverity min_severity = VERBOSE;
+  // If set, the recorder lives in this file, mapped into memory, so that the
+  // lines are still there after the process dies. Read it with
+  // DumpFlightRecorderFile. An existing file is overwritten.
+  std::string path;
+};
+
+// Keeps the most recent log lines, in the same format as StderrLogger, in a
+// ring buffer that every LOG statement appends to without taking a lock. The
+// aborter and the handlers installed by InstallFlightRecorderSignalHandlers
+// write it to stderr, so a crash report shows what led up to it. Calling this
+// again replaces the recorder; the old one is never freed, as other threads
+// may still be writing to it. Returns false and sets errno on failure.
+bool EnableFlightRecorder(const FlightRecorderOptions& options = FlightRecorderOptions());
+
+// Stops recording. The recorded lines are kept for DumpFlightRecorderFile but
+// no longer dumped on a crash.
+void DisableFlightRecorder();
+
+// Writes the recorded lines, oldest first, to `fd`. A line that another
+// thread is still recording may come out cut short. Async-signal-safe, and a
+// no-op if the flight recorder is not enabled.
+void DumpFlightRecorder(int fd);
+
+// Dumps the flight recorder to stderr on SIGSEGV, SIGBUS, SIGILL, SIGFPE and
+// SIGABRT, then hands the signal to whatever handler was installed before.
+// Only the first crash dumps; DefaultAborter counts as one.
+void InstallFlightRecorderSignalHandlers();
+
+// Writes the lines in the flight recorder file left behind at `path` to
+// `out_fd`. Returns false and sets errno on failure (EINVAL if `path` is not a
+// flight recorder file).
+bool DumpFlightRecorderFile(const std::string& path, int out_fd);
+
 class ErrnoRestorer {
  public:
   ErrnoRestorer()
@@ -214,11 +451,32 @@ struct LogAbortAfterFullExpr {
 #endif
 #define ABORT_AFTER_LOG_FATAL_EXPR(x) ABORT_AFTER_LOG_EXPR_IF(true, x)
 
+// The cached minimum severities of the calling LOG statement, taking the
+// per-tag and per-file overrides into account.
+// Note: DO NOT USE DIRECTLY. This is an implementation detail.
+#define LOG_SITE_INTERNAL()                     \
+  ([]() -> ::cpputils::base::LogSite& {         \
+    static ::cpputils::base::LogSite log_site_; \
+    return log_site_;                           \
+  }())
+
 // Defines whether the given severity will be logged or silently swallowed.
-#define WOULD_LOG(severity) \
-  (UNLIKELY((SEVERITY_LAMBDA(severity)) >= ::cpputils::base::GetMinimumLogSeverity()) || \
+// The first comparison folds to a constant for a literal severity, which is
+// what compiles statements below CPPUTILS_MIN_LOG_SEVERITY away. Messages
+// that only the flight recorder or a log sink wants count as logged.
+#define WOULD_LOG(severity)                                                               \
+  (((SEVERITY_LAMBDA(severity)) >= ::cpputils::base::kMinCompiledLogSeverity &&           \
+    UNLIKELY((SEVERITY_LAMBDA(severity)) >=                                               \
+             LOG_SITE_INTERNAL().MinimumSeverity(__FILE__, _LOG_TAG_INTERNAL))) ||        \
    MUST_LOG_MESSAGE(severity))
 
+// Like WOULD_LOG, but leaving out messages that only the flight recorder or a
+// log sink wants.
+#define WOULD_LOG_TO_LOGGER(severity)                                                     \
+  ((SEVERITY_LAMBDA(severity)) >= ::cpputils::base::kMinCompiledLogSeverity &&            \
+   UNLIKELY((SEVERITY_LAMBDA(severity)) >=                                                \
+            LOG_SITE_INTERNAL().MinimumLoggedSeverity(__FILE__, _LOG_TAG_INTERNAL)))
+
 // Get an ostream that can be used for logging at the given severity and to the default
 // destination.
 //
@@ -244,8 +502,14 @@ struct LogAbortAfterFullExpr {
 // Checks if we want to log something, and sets up appropriate RAII objects if
 // so.
 // Note: DO NOT USE DIRECTLY. This is an implementation detail.
+// Unlike WOULD_LOG, the LogSite hands the severities it found over to the
+// LogMessage that LOG constructs right after, so that one cached state and one
+// generation check serve both.
 #define LOGGING_PREAMBLE(severity)                                                         \
-  (WOULD_LOG(severity) &&                                                                  \
+  ((((SEVERITY_LAMBDA(severity)) >= ::cpputils::base::kMinCompiledLogSeverity &&           \
+     LOG_SITE_INTERNAL().WantsMessage(SEVERITY_LAMBDA(severity), __FILE__,                 \
+                                      _LOG_TAG_INTERNAL)) ||                               \
+    MUST_LOG_MESSAGE(severity)) &&                                                         \
    ABORT_AFTER_LOG_EXPR_IF((SEVERITY_LAMBDA(severity)) == ::cpputils::base::FATAL, true) && \
    ::cpputils::base::ErrnoRestorer())
 
@@ -253,18 +517,67 @@ struct LogAbortAfterFullExpr {
 // stderr. If the severity is FATAL it also causes an abort.
 // Use an expression here so we can support the << operator following the macro,
 // like "LOG(DEBUG) << xxx;".
-#define LOG_TO(dest, severity) LOGGING_PREAMBLE(severity) && LOG_STREAM_TO(dest, severity)
+#define LOG_TO(dest, severity) \
+  LOGGING_PREAMBLE(severity) && LOG_MESSAGE_INTERNAL(dest, severity, -1).stream()
+
+// The LogMessage of a LOG statement, which takes over the severities that
+// LOGGING_PREAMBLE's LogSite handed off.
+// Note: DO NOT USE DIRECTLY. This is an implementation detail.
+#define LOG_MESSAGE_INTERNAL(dest, severity, error)                                  \
+  ::cpputils::base::LogMessage(__FILE__, __LINE__, ::cpputils::base::dest,           \
+                              SEVERITY_LAMBDA(severity), _LOG_TAG_INTERNAL, error, \
+                              ::cpputils::base::LogSiteHandOff())
 
 // A variant of LOG that also logs the current errno value. To be used when
 // library calls fail.
 #define PLOG(severity) PLOG_TO(DEFAULT, severity)
 
 // Behaves like PLOG, but logs to the specified log ID.
-#define PLOG_TO(dest, severity)                                                        \
-  LOGGING_PREAMBLE(severity) &&                                                        \
-      ::cpputils::base::LogMessage(__FILE__, __LINE__, ::cpputils::base::dest,           \
-                                  SEVERITY_LAMBDA(severity), _LOG_TAG_INTERNAL, errno) \
-          .stream()
+#define PLOG_TO(dest, severity) \
+  LOGGING_PREAMBLE(severity) && LOG_MESSAGE_INTERNAL(dest, severity, errno).stream()
+
+// Sampled and rate-limited variants of LOG for statements that may fire in a
+// tight loop. Each statement keeps its own lock-free state, and a suppressed
+// message costs a couple of atomic operations instead of a formatted line:
+//
+//     LOG_EVERY_N(WARNING, 1000) << "short read on " << fd;
+//     LOG_FIRST_N(INFO, 3) << "falling back to polling";
+//     LOG_EVERY_T(ERROR, std::chrono::seconds(10)) << "queue is full";
+//     LOG_RATELIMITED(ERROR, 5, 20) << "bad packet from " << peer;
+//
+// LOG_EVERY_N logs the 1st, (n+1)th, (2n+1)th... time it is reached.
+// LOG_FIRST_N logs only the first n times. LOG_EVERY_T logs at most once per
+// std::chrono duration. LOG_RATELIMITED is a token bucket allowing bursts of
+// `burst` messages that refills at `per_second` messages per second. The
+// latter two prefix a message with "[N messages suppressed] " when others were
+// dropped since the last one they let through.
+//
+// Only messages at or above the minimum severity (or the flight recorder's or
+// a log sink's) count: a statement that is filtered out does not use up its
+// quota.
+#define LOG_EVERY_N(severity, n) \
+  LOG_SAMPLED_INTERNAL(severity, LogEveryNSampler, Sample(n))
+#define LOG_FIRST_N(severity, n) \
+  LOG_SAMPLED_INTERNAL(severity, LogFirstNSampler, Sample(n))
+#define LOG_EVERY_T(severity, duration) \
+  LOG_SAMPLED_INTERNAL(severity, LogEveryTSampler, Sample(duration))
+#define LOG_RATELIMITED(severity, per_second, burst) \
+  LOG_SAMPLED_INTERNAL(severity, LogRateLimitSampler, Sample(per_second, burst))
+
+// Logs if `sampler_type`'s per-statement instance lets the message through.
+// The sampler returns the number of suppressed messages to report, or -1 to
+// drop the message.
+// Note: DO NOT USE DIRECTLY. This is an implementation detail.
+#define LOG_SAMPLED_INTERNAL(severity, sampler_type, sample)                            \
+  for (int64_t log_suppressed_ =                                                       \
+           WOULD_LOG(severity)                                                         \
+               ? ([]() -> ::cpputils::base::sampler_type& {                            \
+                   static ::cpputils::base::sampler_type log_sampler_;                 \
+                   return log_sampler_;                                                \
+                 }().sample)                                                           \
+               : -1;                                                                   \
+       log_suppressed_ >= 0; log_suppressed_ = -1)                                     \
+  LOG(severity).ReportSuppressed(log_suppressed_)
 
 // Marker that code is yet to be implemented.
 #define UNIMPLEMENTED(level) \
@@ -427,9 +740,81 @@ EAGER_PTR_EVALUATOR(const signed char*, signed char*);
 EAGER_PTR_EVALUATOR(signed char*, const signed char*);
 EAGER_PTR_EVALUATOR(signed char*, signed char*);
 
+// The stream behind LOG. Besides the text of the message, it collects
+// key/value fields for log pipelines:
+//
+//   LOG(INFO).With("req_id", id).With("lat_us", us) << "done";
+//
+// StructuredLogger gives every field a key of its own; other loggers get the
+// fields appended to the message in logfmt style: "done req_id=17 lat_us=250".
+// Values are formatted with operator<<, like the message. Keys should be
+// identifiers, and are not escaped in logfmt.
+class LogStream : public std::ostream {
+ public:
+  LogStream(std::streambuf* text, std::streambuf* fields)
+      : std::ostream(text), text_(text), fields_(fields) {}
+
+  template <typename T>
+  LogStream& With(const char* key, const T& value) {
+    BeginField(key, std::is_arithmetic<T>::value && !IsCharacter<T>::value ? kNumber : kString);
+    *this << value;
+    EndField();
+    return *this;
+  }
+
+  LogStream& With(const char* key, bool value) {
+    BeginField(key, kLiteral);
+    *this << (value ? "true" : "false");
+    EndField();
+    return *this;
+  }
+
+  // Writes the "[N messages suppressed] " prefix of a sampled message, if any.
+  // Note: DO NOT USE DIRECTLY. This is an implementation detail.
+  LogStream& ReportSuppressed(int64_t count) {
+    if (count > 0) {
+      *this << '[' << count << (count == 1 ? " message" : " messages") << " suppressed] ";
+    }
+    return *this;
+  }
+
+  // How a field is encoded: its kind, its key, a NUL, its value and a NUL.
+  enum FieldKind : char {
+    // Written as a JSON string.
+    kString = 's',
+    // Written as a JSON number if it looks like one (not "nan" or "inf").
+    kNumber = 'n',
+    // Written as is: true or false.
+    kLiteral = 'l',
+  };
+
+ private:
+  template <typename T>
+  struct IsCharacter
+      : std::integral_constant<bool, std::is_same<T, char>::value ||
+                                         std::is_same<T, signed char>::value ||
+                                         std::is_same<T, unsigned char>::value> {};
+
+  // Switches the stream over to the fields buffer and back.
+  void BeginField(const char* key, FieldKind kind);
+  void EndField();
+
+  std::streambuf* const text_;
+  std::streambuf* const fields_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogStream);
+};
+
+// Marks the LogMessage of a LOG statement.
+// Note: DO NOT USE DIRECTLY. This is an implementation detail.
+struct LogSiteHandOff {};
+
 // Data for the log message, not stored in LogMessage to avoid increasing the
-// stack size.
+// stack size. Instances are recycled per thread rather than freed.
 class LogMessageData;
+struct LogMessageDataReleaser {
+  void operator()(LogMessageData* data) const;
+};
 
 // A LogMessage is a temporarily scoped object used by LOG and the unlikely part
 // of a CHECK. The destructor will abort if the severity is FATAL.
@@ -438,18 +823,24 @@ class LogMessage {
   LogMessage(const char* file, unsigned int line, LogId id, LogSeverity severity, const char* tag,
              int error);
 
+  // Used by LOG, whose LogSite has just handed off the severities at its call
+  // site. The constructor above looks them up again when the message is
+  // logged, which takes a lock once there are tag or file overrides.
+  LogMessage(const char* file, unsigned int line, LogId id, LogSeverity severity, const char* tag,
+             int error, LogSiteHandOff);
+
   ~LogMessage();
 
   // Returns the stream associated with the message, the LogMessage performs
   // output when it goes out of scope.
-  std::ostream& stream();
+  LogStream& stream();
 
   // The routine that performs the actual logging.
   static void LogLine(const char* file, unsigned int line, LogId id, LogSeverity severity,
                       const char* tag, const char* msg);
 
  private:
-  const std::unique_ptr<LogMessageData> data_;
+  const std::unique_ptr<LogMessageData, LogMessageDataReleaser> data_;
 
   DISALLOW_COPY_AND_ASSIGN(LogMessage);
 };
@@ -460,6 +851,182 @@ LogSeverity GetMinimumLogSeverity();
 // Set the minimum severity level for logging, returning the old severity.
 LogSeverity SetMinimumLogSeverity(LogSeverity new_severity);
 
+// Overrides the minimum severity for messages with the given tag, which is
+// either LOG_TAG or, for code that does not define it, the default tag.
+void SetTagLogSeverity(const std::string& tag, LogSeverity severity);
+
+// Overrides the minimum severity for messages logged from matching source
+// files, like glog's --vmodule. The fnmatch(3) pattern is matched against the
+// file name without its directory and extension ("mapped_file", "parse*"), or
+// against the whole __FILE__ path if it contains a '/'. When several file
+// patterns match, the one set first wins; file patterns win over tags.
+void SetFileLogSeverity(const std::string& pattern, LogSeverity severity);
+
+// Removes all tag and file overrides.
+void ClearLogSeverityOverrides();
+
+extern std::atomic<uint32_t> gLogSeverityGeneration;
+
+// The per-call-site cache behind WOULD_LOG. Every change of the minimum
+// severity, the overrides, the default tag, the flight recorder or the log
+// sinks bumps gLogSeverityGeneration, and a site only looks the severities up
+// again when its cached generation is stale, so a disabled LOG statement costs
+// two relaxed loads.
+// Note: DO NOT USE DIRECTLY. This is an implementation detail.
+class LogSite {
+ public:
+  constexpr LogSite() : state_(0) {}
+
+  // Whether the logger, the flight recorder or a log sink wants a message of
+  // `severity`. If so, the severities are handed off to the LogMessage that
+  // the calling LOG statement constructs next on this thread.
+  bool WantsMessage(LogSeverity severity, const char* file, const char* tag) {
+    uint32_t severities = Severities(file, tag);
+    if (UNLIKELY(severity >= static_cast<LogSeverity>(severities & 0xff))) {
+      HandOff(severities);
+      return true;
+    }
+    return false;
+  }
+
+  // The minimum severity of messages for the logger, the flight recorder or a
+  // log sink.
+  LogSeverity MinimumSeverity(const char* file, const char* tag) {
+    return static_cast<LogSeverity>(Severities(file, tag) & 0xff);
+  }
+
+  // The minimum severity of messages for the logger.
+  LogSeverity MinimumLoggedSeverity(const char* file, const char* tag) {
+    return static_cast<LogSeverity>((Severities(file, tag) >> 8) & 0xff);
+  }
+
+ private:
+  uint32_t Severities(const char* file, const char* tag) {
+    uint64_t state = state_.load(std::memory_order_relaxed);
+    if (LIKELY((state >> 32) == gLogSeverityGeneration.load(std::memory_order_relaxed))) {
+      return static_cast<uint32_t>(state);
+    }
+    return Refresh(file, tag);
+  }
+
+  uint32_t Refresh(const char* file, const char* tag);
+  static void HandOff(uint32_t severities);
+
+  // The generation in the upper half, then the logged severity in bits 8-15
+  // and the overall minimum in bits 0-7.
+  std::atomic<uint64_t> state_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogSite);
+};
+
+// The per-statement state behind LOG_EVERY_N and friends. Sample() returns
+// the number of suppressed messages to report with the message it lets
+// through, or -1 to drop the message.
+// Note: DO NOT USE DIRECTLY. These are implementation details.
+class LogEveryNSampler {
+ public:
+  constexpr LogEveryNSampler() : count_(0) {}
+
+  // The number of suppressed messages is always n - 1, so it is not reported.
+  int64_t Sample(uint64_t n) {
+    uint64_t count = count_.fetch_add(1, std::memory_order_relaxed);
+    return (n <= 1 || count % n == 0) ? 0 : -1;
+  }
+
+ private:
+  std::atomic<uint64_t> count_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogEveryNSampler);
+};
+
+class LogFirstNSampler {
+ public:
+  constexpr LogFirstNSampler() : count_(0) {}
+
+  int64_t Sample(uint64_t n) {
+    // Stop writing the shared counter once the quota is used up.
+    if (count_.load(std::memory_order_relaxed) >= n) return -1;
+    return count_.fetch_add(1, std::memory_order_relaxed) < n ? 0 : -1;
+  }
+
+ private:
+  std::atomic<uint64_t> count_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogFirstNSampler);
+};
+
+// The clock of the time based samplers, in nanoseconds. It is coarse_clock,
+// whose precision of a few milliseconds is plenty for rate limits.
+int64_t LogSamplerNow();
+
+class LogEveryTSampler {
+ public:
+  constexpr LogEveryTSampler() : next_(0), suppressed_(0) {}
+
+  template <typename Rep, typename Period>
+  int64_t Sample(std::chrono::duration<Rep, Period> interval) {
+    int64_t now = LogSamplerNow();
+    int64_t next = next_.load(std::memory_order_relaxed);
+    if (now < next ||
+        !next_.compare_exchange_strong(
+            next, now + std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count(),
+            std::memory_order_relaxed)) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return -1;
+    }
+    return suppressed_.exchange(0, std::memory_order_relaxed);
+  }
+
+ private:
+  // The steady clock time at which the next message may be logged.
+  std::atomic<int64_t> next_;
+  std::atomic<int64_t> suppressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogEveryTSampler);
+};
+
+// A token bucket kept as a single "theoretical arrival time" (GCRA): the
+// bucket is full when it lies in the past, and every message moves it one
+// refill interval further into the future. A bucket that never refills
+// (per_second <= 0) runs on a stopped clock with an interval of one, so that
+// it lets exactly `burst` messages through. Otherwise the interval and the
+// burst tolerance saturate at kMaxInterval, far enough from INT64_MAX that
+// adding them to the clock cannot overflow.
+class LogRateLimitSampler {
+ public:
+  constexpr LogRateLimitSampler() : tat_(0), suppressed_(0) {}
+
+  int64_t Sample(double per_second, uint32_t burst) {
+    const int64_t kMaxInterval = INT64_MAX / 4;
+    int64_t interval = 1;
+    int64_t now = 0;
+    if (per_second > 0) {
+      double ns = 1e9 / per_second;
+      interval = ns < static_cast<double>(kMaxInterval) ? static_cast<int64_t>(ns) : kMaxInterval;
+      now = LogSamplerNow();
+    }
+    int64_t bursts = burst > 0 ? burst - 1 : 0;
+    int64_t tolerance = bursts > kMaxInterval / interval ? kMaxInterval : interval * bursts;
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    for (;;) {
+      int64_t start = tat > now ? tat : now;
+      if (start - now > tolerance) {
+        suppressed_.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+      }
+      if (tat_.compare_exchange_weak(tat, start + interval, std::memory_order_relaxed)) {
+        return suppressed_.exchange(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  std::atomic<int64_t> tat_;
+  std::atomic<int64_t> suppressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogRateLimitSampler);
+};
+
 // Allows to temporarily change the minimum severity level for logging.
 class ScopedLogSeverity {
  public:
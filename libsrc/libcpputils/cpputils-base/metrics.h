@@ -0,0 +1,209 @@
+#pragma once
+
+//
+// Process-wide metrics: counters, gauges and latency histograms.
+//
+// Metrics are looked up by name once, typically into a static, and are then
+// cheap enough to update on hot paths:
+//
+//   static Counter& requests = GetCounter("requests");
+//   static Histogram& latency = GetHistogram("request_latency_ns");
+//
+//   Timer timer;
+//   ...
+//   requests.Increment();
+//   timer.RecordTo(latency);
+//
+// SnapshotMetrics() reads every metric, and WriteMetrics or a MetricsServer
+// write the snapshot out as text, one metric per line:
+//
+//   counter requests 1234
+//   gauge queue_depth 7
+//   histogram request_latency_ns count=1234 sum=... min=... max=... p50=... p90=... p99=... p99.9=...
+//
+// Metrics are never destroyed, so references to them stay valid for the life
+// of the process.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpputils-base/macros.h"
+#include "cpputils-base/unique_fd.h"
+
+namespace cpputils {
+namespace base {
+
+namespace metrics_internal {
+
+// Counters are split into this many shards, each on a cache line of its own,
+// and each thread adds to one of them, so that threads updating the same
+// counter rarely write to the same cache line.
+constexpr size_t kShards = 16;
+
+struct Shard {
+  std::atomic<int64_t> value;
+  char padding[64 - sizeof(std::atomic<int64_t>)];
+};
+
+size_t NextShardIndex();
+
+// The shard of the calling thread. Threads are given shards in turn.
+inline size_t ShardIndex() {
+  static thread_local size_t index = NextShardIndex();
+  return index;
+}
+
+class ShardedValue {
+ public:
+  ShardedValue();
+
+  void Add(int64_t n) {
+    shards_[ShardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+  int64_t Sum() const;
+
+ private:
+  Shard shards_[kShards];
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedValue);
+};
+
+}  // namespace metrics_internal
+
+// A value that only goes up, such as the number of requests served.
+class Counter {
+ public:
+  Counter() {}
+
+  void Increment(int64_t n = 1) { value_.Add(n); }
+  int64_t Value() const { return value_.Sum(); }
+
+ private:
+  metrics_internal::ShardedValue value_;
+
+  DISALLOW_COPY_AND_ASSIGN(Counter);
+};
+
+// A value that is set, such as the depth of a queue.
+class Gauge {
+ public:
+  Gauge() : value_(0) {}
+
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void Add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t Value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_;
+
+  DISALLOW_COPY_AND_ASSIGN(Gauge);
+};
+
+// The distribution of the values recorded into a Histogram. Snapshots of
+// several histograms, for example of the same metric in several processes,
+// can be merged before asking for percentiles.
+struct HistogramSnapshot {
+  // Values recorded, by Histogram bucket. Empty when nothing was recorded.
+  std::vector<uint64_t> buckets;
+  uint64_t count = 0;
+  int64_t sum = 0;
+  int64_t min = 0;
+  int64_t max = 0;
+
+  void Merge(const HistogramSnapshot& other);
+
+  // The value below which `percentile` percent of the values fall, accurate
+  // to within 1%. Returns 0 if nothing was recorded.
+  int64_t Percentile(double percentile) const;
+
+  double Mean() const { return count == 0 ? 0 : static_cast<double>(sum) / count; }
+};
+
+// A distribution of non-negative values, such as latencies in nanoseconds;
+// negative values are recorded as 0. Values are counted in log-linear buckets:
+// those below 128 exactly, and larger ones in 64 buckets per power of two, so
+// that a bucket is never wider than 1/64th of the values in it.
+//
+// Unlike a Counter, a Histogram is not sharded: threads recording similar
+// values at the same time update the same bucket and sum, and contend for
+// their cache lines. Sharding the 29 KB of buckets as well would multiply the
+// size of every histogram by 16, so for a metric recorded by many threads at
+// very high rates, give each thread a Histogram of its own and Merge their
+// snapshots.
+class Histogram {
+ public:
+  static constexpr int kSubBucketBits = 7;
+  static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) << (kSubBucketBits - 1);
+
+  Histogram();
+
+  void Record(int64_t value);
+  HistogramSnapshot Snapshot() const;
+
+  // The bucket that `value` is counted in, and the smallest and largest value
+  // counted in `bucket`.
+  static size_t BucketIndex(int64_t value);
+  static int64_t BucketLowerBound(size_t bucket);
+  static int64_t BucketUpperBound(size_t bucket);
+
+ private:
+  std::atomic<uint64_t> buckets_[kBuckets];
+  std::atomic<int64_t> sum_;
+  std::atomic<int64_t> min_;
+  std::atomic<int64_t> max_;
+
+  DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+// Return the metric called `name`, creating it the first time. Counters,
+// gauges and histograms have separate names.
+Counter& GetCounter(const std::string& name);
+Gauge& GetGauge(const std::string& name);
+Histogram& GetHistogram(const std::string& name);
+
+struct MetricsSnapshot {
+  std::map<std::string, int64_t> counters;
+  std::map<std::string, int64_t> gauges;
+  std::map<std::string, HistogramSnapshot> histograms;
+};
+
+// Reads every metric. Each metric is read on its own, so updates made while
+// the snapshot is taken may be in some of them and not in others.
+MetricsSnapshot SnapshotMetrics();
+
+// Formats a snapshot as text, one metric per line.
+std::string FormatMetrics(const MetricsSnapshot& snapshot);
+
+// Write a snapshot of every metric as text. Return false and set errno on
+// failure.
+bool WriteMetrics(int fd);
+bool WriteMetricsToFile(const std::string& path);
+
+// Serves the metrics on a listening stream socket, such as one made with
+// libcutils' socket_local_server(): every client that connects is sent a
+// snapshot, as WriteMetrics writes it, and is then disconnected. The socket
+// is served from a thread of its own until the server is destroyed.
+class MetricsServer {
+ public:
+  explicit MetricsServer(unique_fd listen_fd);
+  ~MetricsServer();
+
+ private:
+  void Run();
+
+  unique_fd listen_fd_;
+  unique_fd stop_read_fd_;
+  unique_fd stop_write_fd_;
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricsServer);
+};
+
+}  // namespace base
+}  // namespace cpputils
@@ -0,0 +1,93 @@
+#pragma once
+
+//
+// Scoped tracing spans.
+//
+// TRACE_SCOPE marks the rest of the enclosing scope as a span. While tracing
+// is on, the start and the end of every span are recorded, with boot_clock
+// timestamps, into a buffer of the calling thread's own; the trace is then
+// written out as Chrome trace-event JSON, which chrome://tracing and Perfetto
+// (ui.perfetto.dev) display as a timeline per thread:
+//
+//   void HandleRequest() {
+//     TRACE_SCOPE("HandleRequest");
+//     ...
+//   }
+//
+//   StartTracing();
+//   ...
+//   StopTracing();
+//   WriteChromeTrace(fd);
+//
+// Only the name pointer is recorded, so names must outlive the trace; string
+// literals do. While tracing is off, TRACE_SCOPE costs one relaxed load.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "cpputils-base/macros.h"
+
+namespace cpputils {
+namespace base {
+
+struct TracingOptions {
+  // Events each thread can record in one trace. A thread whose buffer is
+  // full drops its new spans, but always has room to end the open ones.
+  size_t events_per_thread = 64 * 1024;
+};
+
+// Starts a new trace, discarding the events of the previous one.
+void StartTracing(const TracingOptions& options = TracingOptions());
+
+// Stops recording new spans. Spans that are open end as usual.
+void StopTracing();
+
+// Writes the events of the current or last trace to `fd` as Chrome trace
+// JSON. Meant to be called after StopTracing; spans that are recorded while it
+// runs may be left out. Returns false and sets errno on failure.
+bool WriteChromeTrace(int fd);
+
+namespace trace_internal {
+
+extern std::atomic<uint32_t> gTraceGeneration;
+
+// The generation of the trace being recorded, or 0 while tracing is off.
+inline uint32_t TracingGeneration() {
+  return gTraceGeneration.load(std::memory_order_relaxed);
+}
+
+// Records the start of a span, and returns the generation for EndSpan, or 0
+// if the span is dropped.
+uint32_t BeginSpan(const char* name, uint32_t generation);
+void EndSpan(const char* name, uint32_t generation);
+
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const char* name) : name_(name), generation_(TracingGeneration()) {
+    if (UNLIKELY(generation_ != 0)) generation_ = BeginSpan(name_, generation_);
+  }
+
+  ~ScopedSpan() {
+    if (UNLIKELY(generation_ != 0)) EndSpan(name_, generation_);
+  }
+
+ private:
+  const char* const name_;
+  uint32_t generation_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedSpan);
+};
+
+}  // namespace trace_internal
+
+#define TRACE_SCOPE_CONCAT_INNER(a, b) a##b
+#define TRACE_SCOPE_CONCAT(a, b) TRACE_SCOPE_CONCAT_INNER(a, b)
+
+// Records the rest of the enclosing scope as a span called `name`.
+#define TRACE_SCOPE(name) \
+  ::cpputils::base::trace_internal::ScopedSpan TRACE_SCOPE_CONCAT(trace_scope_, __LINE__)(name)
+
+}  // namespace base
+}  // namespace cpputils
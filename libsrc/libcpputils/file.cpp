@@ -27,6 +27,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -46,6 +50,7 @@
 
 #include "cpputils-base/logging.h" // and must be after windows.h for ERROR
 #include "cpputils-base/macros.h"  // For TEMP_FAILURE_RETRY on Darwin.
+#include "cpputils-base/stringprintf.h"
 #include "cpputils-base/unique_fd.h"
 
 #ifdef _WIN32
@@ -212,24 +217,61 @@ namespace cpputils
 
     bool ReadFdToString(int fd, std::string *content)
     {
-      content->clear();
+      return ReadFdToString(fd, content, 0);
+    }
 
-      // Although original we had small files in mind, this code gets used for
-      // very large files too, where the std::string growth heuristics might not
-      // be suitable. https://code.google.com/p/android/issues/detail?id=258500.
+    bool ReadFdToString(int fd, std::string *content, size_t size_hint)
+    {
+      // Reads go straight into the string's storage, which is sized up front
+      // when the size is known and otherwise grows geometrically, so that even
+      // very large files are copied once and /proc files are not reallocated
+      // for every page. https://code.google.com/p/android/issues/detail?id=258500.
+      // The extra byte lets the read that finds the end of the file go into the
+      // same storage.
+      size_t expected = (size_hint > 0) ? size_hint + 1 : 0;
       struct stat sb;
-      if (fstat(fd, &sb) != -1 && sb.st_size > 0)
+      if (fstat(fd, &sb) != -1 && S_ISREG(sb.st_mode) && sb.st_size > 0)
       {
-        content->reserve(sb.st_size);
+        // Files that claim to be empty, as /proc files do, are not trusted.
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset == -1 || offset > sb.st_size)
+        {
+          offset = 0;
+        }
+        expected = sb.st_size - offset + 1;
+#if defined(__linux__)
+        if (expected >= 1024 * 1024)
+        {
+          posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
       }
 
-      char buf[BUFSIZ];
-      ssize_t n;
-      while ((n = TEMP_FAILURE_RETRY(read(fd, &buf[0], sizeof(buf)))) > 0)
+      if (expected > 0 && (content->capacity() < expected || content->capacity() > 2 * expected))
       {
-        content->append(buf, n);
+        // Start from empty storage, so that it is allocated at exactly the
+        // expected size rather than by the string's growth policy, and so
+        // that an enormous buffer is not kept around for a small file.
+        std::string().swap(*content);
+      }
+      // Otherwise reuse whatever capacity the string already has.
+      content->resize(std::max(expected, content->capacity()));
+
+      size_t size = 0;
+      while (true)
+      {
+        if (size == content->size())
+        {
+          content->resize(size + std::max<size_t>(size, BUFSIZ));
+        }
+        ssize_t n = TEMP_FAILURE_RETRY(read(fd, &(*content)[size], content->size() - size));
+        if (n <= 0)
+        {
+          content->resize(size);
+          return n == 0;
+        }
+        size += n;
       }
-      return (n == 0) ? true : false;
     }
 
     bool ReadFileToString(const std::string &path, std::string *content, bool follow_symlinks)
@@ -304,6 +346,169 @@ namespace cpputils
       }
       return true;
     }
+
+    static int SyncFileData(int fd)
+    {
+#if defined(__APPLE__)
+      return fsync(fd);
+#else
+      return fdatasync(fd);
+#endif
+    }
+
+    // A rename is only durable once its directory is fsynced. With group
+    // commit, the writers into a directory take tickets after renaming, and
+    // one fsync covers every ticket taken before it started; writers that
+    // come along while it runs wait and share the next one.
+    struct DirectorySync
+    {
+      std::mutex lock;
+      std::condition_variable synced_cv;
+      uint64_t tickets = 0;
+      uint64_t synced = 0;
+      bool syncing = false;
+    };
+
+    static DirectorySync &GetDirectorySync(dev_t dev, ino_t ino)
+    {
+      static std::mutex &lock = *new std::mutex();
+      static auto &syncs = *new std::map<std::pair<dev_t, ino_t>, DirectorySync *>();
+      std::lock_guard<std::mutex> guard(lock);
+      DirectorySync *&sync = syncs[std::make_pair(dev, ino)];
+      if (sync == nullptr)
+      {
+        sync = new DirectorySync();
+      }
+      return *sync;
+    }
+
+    static bool SyncDirectory(int dir_fd, bool group_commit)
+    {
+      if (!group_commit)
+      {
+        return fsync(dir_fd) == 0;
+      }
+      struct stat sb;
+      if (fstat(dir_fd, &sb) == -1)
+      {
+        return false;
+      }
+      DirectorySync &sync = GetDirectorySync(sb.st_dev, sb.st_ino);
+      std::unique_lock<std::mutex> lock(sync.lock);
+      const uint64_t ticket = ++sync.tickets;
+      while (sync.synced < ticket)
+      {
+        if (sync.syncing)
+        {
+          sync.synced_cv.wait(lock);
+          continue;
+        }
+        // A failed fsync covers nobody, and the writers still waiting each
+        // try one of their own.
+        sync.syncing = true;
+        const uint64_t covered = sync.tickets;
+        lock.unlock();
+        int rc = fsync(dir_fd);
+        int saved_errno = errno;
+        lock.lock();
+        sync.syncing = false;
+        if (rc == 0)
+        {
+          sync.synced = std::max(sync.synced, covered);
+        }
+        sync.synced_cv.notify_all();
+        if (rc == -1)
+        {
+          errno = saved_errno;
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Writes `content` to a new file in `dir_fd`, named `temp_name` once it is
+    // complete.
+    static bool WriteAtomicTempFile(const std::string &content, int dir_fd,
+                                    const std::string &temp_name,
+                                    const AtomicWriteOptions &options)
+    {
+      auto clean_up = [dir_fd, &temp_name]() {
+        int saved_errno = errno;
+        unlinkat(dir_fd, temp_name.c_str(), 0);
+        errno = saved_errno;
+        return false;
+      };
+
+#if defined(O_TMPFILE)
+      // An O_TMPFILE file has no name to clean up after a crash until it is
+      // linked in, complete. That needs support from the file system, and
+      // linking needs /proc, which some sandboxes refuse; once linking has
+      // failed, named files are used from the start.
+      static std::atomic<bool> link_tmpfile_failed(false);
+      if (!link_tmpfile_failed.load(std::memory_order_relaxed))
+      {
+        cpputils::base::unique_fd tmp_fd(TEMP_FAILURE_RETRY(
+            openat(dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, options.mode)));
+        if (tmp_fd != -1)
+        {
+          if (!WriteStringToFd(content, tmp_fd))
+          {
+            return false;
+          }
+          std::string proc_path = StringPrintf("/proc/self/fd/%d", tmp_fd.get());
+          if (linkat(AT_FDCWD, proc_path.c_str(), dir_fd, temp_name.c_str(),
+                     AT_SYMLINK_FOLLOW) == 0)
+          {
+            return !(options.durable && SyncFileData(tmp_fd) == -1) || clean_up();
+          }
+          link_tmpfile_failed.store(true, std::memory_order_relaxed);
+        }
+      }
+#endif
+
+      cpputils::base::unique_fd fd(TEMP_FAILURE_RETRY(
+          openat(dir_fd, temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_BINARY,
+                 options.mode)));
+      if (fd == -1)
+      {
+        return false;
+      }
+      if (!WriteStringToFd(content, fd) || (options.durable && SyncFileData(fd) == -1))
+      {
+        return clean_up();
+      }
+      return true;
+    }
+
+    bool WriteStringToFileAtomic(const std::string &content, const std::string &path,
+                                 const AtomicWriteOptions &options)
+    {
+      // rename only replaces files in the same file system, so the new file
+      // goes into the same directory.
+      const std::string base = Basename(path);
+      cpputils::base::unique_fd dir_fd(
+          TEMP_FAILURE_RETRY(open(Dirname(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)));
+      if (dir_fd == -1)
+      {
+        return false;
+      }
+
+      static std::atomic<unsigned int> temp_counter(0);
+      const std::string temp_name =
+          StringPrintf(".%s.%d.%u.tmp", base.c_str(), getpid(), temp_counter.fetch_add(1));
+      if (!WriteAtomicTempFile(content, dir_fd, temp_name, options))
+      {
+        return false;
+      }
+      if (renameat(dir_fd, temp_name.c_str(), dir_fd, base.c_str()) == -1)
+      {
+        int saved_errno = errno;
+        unlinkat(dir_fd, temp_name.c_str(), 0);
+        errno = saved_errno;
+        return false;
+      }
+      return !options.durable || SyncDirectory(dir_fd, options.group_commit);
+    }
 #endif
 
     bool WriteStringToFile(const std::string &content, const std::string &path,
@@ -21,8 +21,10 @@
 #include "cpputils-base/logging.h"
 
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <stddef.h>
 #include <time.h>
 
 // For getprogname(3) or program_invocation_short_name.
@@ -32,15 +34,27 @@
 #include <errno.h>
 #endif
 
-#if defined(__linux__)
+#if !defined(_WIN32)
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <limits>
 #include <mutex>
+#include <new>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -53,12 +67,15 @@
 #include <unistd.h>
 #endif
 
+#include <cpputils-base/chrono_utils.h>
 #include <cpputils-base/file.h>
 #include <cpputils-base/macros.h>
 #include <cpputils-base/parseint.h>
 #include <cpputils-base/strings.h>
 #include <cpputils-base/threads.h>
 
+#include "bounded_queue.h"
+
 namespace cpputils
 {
   namespace base
@@ -198,6 +215,101 @@ namespace cpputils
 #endif
       return TEMP_FAILURE_RETRY(open("/dev/kmsg", O_WRONLY | O_CLOEXEC));
     }
+
+    // The /dev/kmsg fd shared by every KernelLogger call, or -1 until the
+    // first one. It is never closed: a broken fd is replaced in place with
+    // dup3, so a thread that has just loaded it cannot write to a descriptor
+    // that was closed and handed out again.
+    static std::atomic<int> gKmsgFd(-1);
+    static std::atomic<bool> gKernelLoggerNonBlocking(false);
+    static std::atomic<uint64_t> gKernelLoggerDropped(0);
+
+    static void SetNonBlocking(int fd, bool non_blocking)
+    {
+      int flags = fcntl(fd, F_GETFL);
+      if (flags == -1)
+      {
+        return;
+      }
+      int new_flags = non_blocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+      if (new_flags != flags)
+      {
+        fcntl(fd, F_SETFL, new_flags);
+      }
+    }
+
+    static int GetKmsgFd()
+    {
+      int fd = gKmsgFd.load(std::memory_order_acquire);
+      if (fd != -1)
+      {
+        return fd;
+      }
+      int new_fd = OpenKmsg();
+      if (new_fd == -1)
+      {
+        return -1;
+      }
+      SetNonBlocking(new_fd, gKernelLoggerNonBlocking.load(std::memory_order_relaxed));
+      if (gKmsgFd.compare_exchange_strong(fd, new_fd, std::memory_order_acq_rel))
+      {
+        return new_fd;
+      }
+      // Another thread got there first. An fd inherited from init is the same
+      // number for both of us, and must not be closed.
+      if (new_fd != fd)
+      {
+        close(new_fd);
+      }
+      return fd;
+    }
+
+    // Replaces `fd`, whose last write failed with `error`, with a freshly
+    // opened /dev/kmsg. Returns the fd to retry with, or -1.
+    static int ReopenKmsgFd(int fd, int error)
+    {
+      int new_fd = TEMP_FAILURE_RETRY(open("/dev/kmsg", O_WRONLY | O_CLOEXEC));
+      if (new_fd == -1)
+      {
+        return -1;
+      }
+      SetNonBlocking(new_fd, gKernelLoggerNonBlocking.load(std::memory_order_relaxed));
+      if (error == EBADF)
+      {
+        // Somebody closed our fd, so its number may already belong to another
+        // file and must not be dup3'd over. Publish the new number instead.
+        if (gKmsgFd.compare_exchange_strong(fd, new_fd, std::memory_order_acq_rel))
+        {
+          return new_fd;
+        }
+        close(new_fd);
+        return fd;
+      }
+      int result = (TEMP_FAILURE_RETRY(dup3(new_fd, fd, O_CLOEXEC)) == -1) ? -1 : fd;
+      close(new_fd);
+      return result;
+    }
+
+    // Writes one kmsg record, reopening the fd once if the write fails.
+    // Returns false if the record was dropped, which in non-blocking mode
+    // includes the kernel log being busy.
+    static bool WriteKmsgRecord(iovec *iov, int count)
+    {
+      int fd = GetKmsgFd();
+      for (int attempt = 0; fd != -1; ++attempt)
+      {
+        if (TEMP_FAILURE_RETRY(writev(fd, iov, count)) != -1)
+        {
+          return true;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || attempt > 0)
+        {
+          return false;
+        }
+        fd = ReopenKmsgFd(fd, errno);
+      }
+      return false;
+    }
 #endif
 
     static std::mutex &LoggingLock()
@@ -216,43 +328,387 @@ namespace cpputils
       return logger;
     }
 
+    // Whether Logger() is StderrLogger, whose lines LogMessageLines can write
+    // in one batch. Guarded by LoggingLock().
+#ifdef __ANDROID__
+    static bool gLoggerIsStderrLogger = false;
+#else
+    static bool gLoggerIsStderrLogger = true;
+#endif
+
     static AbortFunction &Aborter()
     {
       static auto &aborter = *new AbortFunction(DefaultAborter);
       return aborter;
     }
 
-    static std::recursive_mutex &TagLock()
+    // The default tag, or nullptr if none is set. It is published RCU-style:
+    // a string is never changed or freed once stored here, since a logging
+    // thread may be reading it without any lock. SetDefaultTag is rare
+    // (typically once, from InitLogging), so replaced tags are simply kept.
+    static std::atomic<const std::string *> gDefaultTag(nullptr);
+
+    // Serializes SetDefaultTag and guards the replaced tags.
+    static std::mutex &TagLock()
     {
-      static auto &tag_lock = *new std::recursive_mutex();
+      static auto &tag_lock = *new std::mutex();
       return tag_lock;
     }
-    static std::string *gDefaultTag;
+
+    static std::vector<const std::string *> &RetiredDefaultTags()
+    {
+      static auto &retired = *new std::vector<const std::string *>();
+      return retired;
+    }
+
+    // Returns the tag for messages logged without one. The string stays valid
+    // for the life of the process.
+    static const char *DefaultTag()
+    {
+      const std::string *tag = gDefaultTag.load(std::memory_order_acquire);
+      return (tag != nullptr) ? tag->c_str() : getprogname();
+    }
+
     std::string GetDefaultTag()
     {
-      std::lock_guard<std::recursive_mutex> lock(TagLock());
-      if (gDefaultTag == nullptr)
+      const std::string *tag = gDefaultTag.load(std::memory_order_acquire);
+      return (tag != nullptr) ? *tag : std::string();
+    }
+    static void BumpLogSeverityGeneration();
+
+    void SetDefaultTag(const std::string &tag)
+    {
       {
-        return "";
+        std::lock_guard<std::mutex> lock(TagLock());
+        const std::string *new_tag = tag.empty() ? nullptr : new std::string(tag);
+        const std::string *old_tag = gDefaultTag.exchange(new_tag, std::memory_order_acq_rel);
+        if (old_tag != nullptr)
+        {
+          RetiredDefaultTags().push_back(old_tag);
+        }
       }
-      return *gDefaultTag;
+      // Tag overrides apply to the default tag too.
+      BumpLogSeverityGeneration();
     }
-    void SetDefaultTag(const std::string &tag)
+
+    static bool gInitialized = false;
+    static std::atomic<LogSeverity> gMinimumLogSeverity(INFO);
+
+    // Starts at 1 so that call sites, which start out at 0, look it up first.
+    std::atomic<uint32_t> gLogSeverityGeneration(1);
+
+    struct LogSeverityOverrides
+    {
+      std::unordered_map<std::string, LogSeverity> tags;
+      // File patterns, in the order in which they were first set.
+      std::vector<std::pair<std::string, LogSeverity>> files;
+    };
+    static std::atomic<bool> gHaveLogSeverityOverrides(false);
+
+    // The ring buffer behind EnableFlightRecorder. `header` and `data` are
+    // either anonymous memory or a shared mapping of the recorder's file.
+    struct FlightRecorderHeader;
+    struct FlightRecorder
+    {
+      FlightRecorderHeader *header;
+      char *data;
+      uint64_t capacity;
+      LogSeverity min_severity;
+    };
+    static std::atomic<FlightRecorder *> gFlightRecorder(nullptr);
+    static void DumpFlightRecorderForCrash();
+
+    // The lowest min_severity of the log sinks, or FATAL + 1 if there are
+    // none. Changed under LogSinksLock() together with the sinks.
+    static std::atomic<int> gLowestLogSinkSeverity(FATAL + 1);
+
+    // Guards the overrides and changes of gMinimumLogSeverity. Every change
+    // bumps gLogSeverityGeneration afterwards, and LogSite::Refresh reads the
+    // generation before the settings, so a call site may cache an old
+    // generation with new settings but never the other way round.
+    static std::mutex &LogSeverityLock()
+    {
+      static auto &lock = *new std::mutex();
+      return lock;
+    }
+
+    static LogSeverityOverrides &GetLogSeverityOverrides()
+    {
+      static auto &overrides = *new LogSeverityOverrides();
+      return overrides;
+    }
+
+    // Must be called with LogSeverityLock held.
+    static void BumpLogSeverityGenerationLocked()
+    {
+      // Skip 0, which would match call sites that never looked it up.
+      if (gLogSeverityGeneration.fetch_add(1, std::memory_order_relaxed) + 1 == 0)
+      {
+        gLogSeverityGeneration.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    static void BumpLogSeverityGeneration()
+    {
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      BumpLogSeverityGenerationLocked();
+    }
+
+    static bool MatchesFilePattern(const std::string &pattern, const char *file)
+    {
+      if (pattern.find('/') != std::string::npos)
+      {
+        return fnmatch(pattern.c_str(), file, 0) == 0;
+      }
+      const char *base = GetFileBasename(file);
+      const char *dot = strrchr(base, '.');
+      std::string module(base, dot != nullptr ? dot - base : strlen(base));
+      return fnmatch(pattern.c_str(), module.c_str(), 0) == 0;
+    }
+
+    // Resolves a missing tag the way LogLine does, if there are tag overrides
+    // to match it against.
+    static std::string ResolveTagForLogSeverity(const char *tag)
     {
-      std::lock_guard<std::recursive_mutex> lock(TagLock());
-      if (gDefaultTag != nullptr)
+      if (tag != nullptr)
       {
-        delete gDefaultTag;
-        gDefaultTag = nullptr;
+        return tag;
       }
-      if (!tag.empty())
+      if (!gHaveLogSeverityOverrides.load(std::memory_order_relaxed))
       {
-        gDefaultTag = new std::string(tag);
+        return std::string();
       }
+      return DefaultTag();
     }
 
-    static bool gInitialized = false;
-    static LogSeverity gMinimumLogSeverity = INFO;
+    // Must be called with LogSeverityLock held.
+    static LogSeverity MinimumLogSeverityLocked(const char *file, const std::string &tag)
+    {
+      const LogSeverityOverrides &overrides = GetLogSeverityOverrides();
+      for (const auto &pattern : overrides.files)
+      {
+        if (MatchesFilePattern(pattern.first, file))
+        {
+          return pattern.second;
+        }
+      }
+      if (!overrides.tags.empty())
+      {
+        auto it = overrides.tags.find(tag);
+        if (it != overrides.tags.end())
+        {
+          return it->second;
+        }
+      }
+      return gMinimumLogSeverity.load(std::memory_order_relaxed);
+    }
+
+    uint32_t LogSite::Refresh(const char *file, const char *tag)
+    {
+      uint64_t generation = gLogSeverityGeneration.load(std::memory_order_acquire);
+      std::string resolved_tag = ResolveTagForLogSeverity(tag);
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      LogSeverity logged = MinimumLogSeverityLocked(file, resolved_tag);
+      LogSeverity severity = logged;
+      const FlightRecorder *recorder = gFlightRecorder.load(std::memory_order_acquire);
+      if (recorder != nullptr)
+      {
+        severity = std::min(severity, recorder->min_severity);
+      }
+      const int sinks = gLowestLogSinkSeverity.load(std::memory_order_relaxed);
+      if (sinks < severity)
+      {
+        severity = static_cast<LogSeverity>(sinks);
+      }
+      uint32_t severities = static_cast<uint32_t>(severity) | (static_cast<uint32_t>(logged) << 8);
+      state_.store((generation << 32) | severities, std::memory_order_relaxed);
+      return severities;
+    }
+
+    // The severities that LogSite::WantsMessage last handed off on this thread,
+    // marked with kLogSeveritiesHandedOff until a LogMessage takes them.
+    static constexpr uint32_t kLogSeveritiesHandedOff = 1u << 16;
+    static thread_local uint32_t gHandedOffLogSeverities = 0;
+
+    void LogSite::HandOff(uint32_t severities)
+    {
+      gHandedOffLogSeverities = severities | kLogSeveritiesHandedOff;
+    }
+
+    // Returns the minimum severity for the logger that LOG's LogSite handed
+    // off, or -1 if there is none.
+    static int TakeHandedOffLoggedSeverity()
+    {
+      const uint32_t severities = gHandedOffLogSeverities;
+      gHandedOffLogSeverities = 0;
+      if ((severities & kLogSeveritiesHandedOff) == 0)
+      {
+        return -1;
+      }
+      return (severities >> 8) & 0xff;
+    }
+
+    static bool WouldLog(LogSeverity severity, const char *file, const char *tag)
+    {
+      if (!gHaveLogSeverityOverrides.load(std::memory_order_relaxed))
+      {
+        return severity >= gMinimumLogSeverity.load(std::memory_order_relaxed);
+      }
+      std::string resolved_tag = ResolveTagForLogSeverity(tag);
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      return severity >= MinimumLogSeverityLocked(file, resolved_tag);
+    }
+
+    ScopedLogSeverity::ScopedLogSeverity(LogSeverity new_severity)
+    {
+      old_ = SetMinimumLogSeverity(new_severity);
+    }
+
+    ScopedLogSeverity::~ScopedLogSeverity()
+    {
+      SetMinimumLogSeverity(old_);
+    }
+
+    // Details of a message that were captured on the thread that logged it.
+    // The async drain thread publishes these while it calls the logger, so
+    // that loggers report the original thread and time rather than its own.
+    struct LogLineTime
+    {
+      LogTimestampFormat format;
+      int64_t seconds;
+      long nanoseconds;
+    };
+
+    struct LogLineContext
+    {
+      uint64_t tid;
+      LogLineTime time;
+      // The fields that LogStream::With attached to the message, if any, and
+      // how much of `msg` comes before they were appended to it.
+      const char *fields;
+      size_t fields_size;
+      const char *msg;
+      size_t text_size;
+    };
+    static thread_local const LogLineContext *gLogLineContext = nullptr;
+
+    static std::atomic<LogTimestampFormat> gLogTimestampFormat(LogTimestampFormat::kWallClock);
+
+    void SetLogTimestampFormat(LogTimestampFormat format)
+    {
+      gLogTimestampFormat.store(format, std::memory_order_relaxed);
+    }
+
+    LogTimestampFormat GetLogTimestampFormat()
+    {
+      return gLogTimestampFormat.load(std::memory_order_relaxed);
+    }
+
+    int64_t LogSamplerNow()
+    {
+      return coarse_clock::now().time_since_epoch().count();
+    }
+
+    // Reads only the clock that the current timestamp format needs.
+    static LogLineTime NowForLogLine()
+    {
+      LogLineTime now;
+      now.format = GetLogTimestampFormat();
+      if (now.format == LogTimestampFormat::kMonotonic)
+      {
+        int64_t ns = boot_clock::now().time_since_epoch().count();
+        now.seconds = ns / 1000000000;
+        now.nanoseconds = ns % 1000000000;
+        return now;
+      }
+#if defined(_WIN32)
+      now.seconds = time(nullptr);
+      now.nanoseconds = 0;
+#else
+      timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      now.seconds = ts.tv_sec;
+      now.nanoseconds = ts.tv_nsec;
+#endif
+      return now;
+    }
+
+    static uint64_t GetLogLineThreadId()
+    {
+      return (gLogLineContext != nullptr) ? gLogLineContext->tid : GetThreadId();
+    }
+
+    static LogLineTime GetLogLineTime()
+    {
+      return (gLogLineContext != nullptr) ? gLogLineContext->time : NowForLogLine();
+    }
+
+    // Returns `context` with the calling thread and the current time, for a
+    // message that is logged later or while gLogLineContext points at it.
+    static LogLineContext StampLogLineContext(const LogLineContext &context)
+    {
+      LogLineContext stamped = context;
+      stamped.tid = GetThreadId();
+      stamped.time = NowForLogLine();
+      return stamped;
+    }
+
+    // localtime_r may take the libc timezone lock and strftime is not cheap
+    // either, so each thread formats the date and time of day only when the
+    // second changes. Being per thread, the cache needs no synchronization.
+    struct LogTimestampCache
+    {
+      int64_t seconds = -1;
+      size_t size = 0;
+      char text[32];
+    };
+    static thread_local LogTimestampCache gLogTimestampCache;
+
+    static size_t AppendFraction(char *out, long value, int digits)
+    {
+      out[0] = '.';
+      for (int i = digits; i > 0; --i)
+      {
+        out[i] = '0' + value % 10;
+        value /= 10;
+      }
+      return digits + 1;
+    }
+
+    // Writes the timestamp for `t` to `out`, which must hold 32 bytes.
+    static void FormatLogLineTime(const LogLineTime &t, char *out)
+    {
+      if (t.format == LogTimestampFormat::kMonotonic)
+      {
+        snprintf(out, 32, "%5" PRId64 ".%06ld", t.seconds, t.nanoseconds / 1000);
+        return;
+      }
+
+      LogTimestampCache &cache = gLogTimestampCache;
+      if (cache.seconds != t.seconds)
+      {
+        struct tm now;
+        time_t seconds = t.seconds;
+#if defined(_WIN32)
+        localtime_s(&now, &seconds);
+#else
+        localtime_r(&seconds, &now);
+#endif
+        cache.size = strftime(cache.text, sizeof(cache.text), "%m-%d %H:%M:%S", &now);
+        cache.seconds = t.seconds;
+      }
+      memcpy(out, cache.text, cache.size);
+      size_t size = cache.size;
+      if (t.format == LogTimestampFormat::kWallClockMillis)
+      {
+        size += AppendFraction(out + size, t.nanoseconds / 1000000, 3);
+      }
+      else if (t.format == LogTimestampFormat::kWallClockMicros)
+      {
+        size += AppendFraction(out + size, t.nanoseconds / 1000, 6);
+      }
+      out[size] = '\0';
+    }
 
 #if defined(__linux__)
     void KernelLogger(cpputils::base::LogId, cpputils::base::LogSeverity severity,
@@ -273,27 +729,72 @@ namespace cpputils
       static_assert(arraysize(kLogSeverityToKernelLogLevel) == cpputils::base::FATAL + 1,
                     "Mismatch in size of kLogSeverityToKernelLogLevel and values in LogSeverity");
 
-      static int klog_fd = OpenKmsg();
-      if (klog_fd == -1)
+      if (GetKmsgFd() == -1)
         return;
 
       int level = kLogSeverityToKernelLogLevel[severity];
 
-      // The kernel's printk buffer is only 1024 bytes.
-      // TODO: should we automatically break up long lines into multiple lines?
-      // Or we could log but with something like "..." at the end?
-      char buf[1024];
-      size_t size = snprintf(buf, sizeof(buf), "<%d>%s: %s\n", level, tag, msg);
-      if (size > sizeof(buf))
+      uint64_t dropped = gKernelLoggerDropped.exchange(0, std::memory_order_relaxed);
+      if (dropped != 0)
       {
-        size = snprintf(buf, sizeof(buf), "<%d>%s: %zu-byte message too long for printk\n",
-                        level, tag, size);
+        char notice[128];
+        int size = snprintf(notice, sizeof(notice),
+                            "<4>%s: %" PRIu64 " log messages dropped: kernel log busy\n", tag,
+                            dropped);
+        iovec iov[1] = {{notice, std::min(static_cast<size_t>(size), sizeof(notice) - 1)}};
+        if (!WriteKmsgRecord(iov, 1))
+        {
+          gKernelLoggerDropped.fetch_add(dropped, std::memory_order_relaxed);
+        }
       }
 
-      iovec iov[1];
-      iov[0].iov_base = buf;
-      iov[0].iov_len = size;
-      TEMP_FAILURE_RETRY(writev(klog_fd, iov, 1));
+      // Very long tags are truncated rather than leaving no room for the text.
+      char prefix[128];
+      size_t prefix_size = snprintf(prefix, sizeof(prefix), "<%d>%s: ", level, tag);
+      prefix_size = std::min(prefix_size, sizeof(prefix) - 1);
+
+      // Each write is one record, and the kernel rejects records longer than
+      // 1024 bytes minus its own 32-byte header, so long messages are split
+      // into several records, preferably not in the middle of a UTF-8
+      // sequence.
+      static constexpr size_t kMaxRecordSize = 1024 - 32;
+      static char newline[] = "\n";
+      const size_t max_chunk = kMaxRecordSize - prefix_size - 1;
+      const size_t size = strlen(msg);
+      size_t i = 0;
+      do
+      {
+        size_t n = std::min(size - i, max_chunk);
+        if (i + n < size)
+        {
+          size_t end = i + n;
+          while (end > i && (msg[end] & 0xc0) == 0x80)
+          {
+            --end;
+          }
+          if (end > i)
+          {
+            n = end - i;
+          }
+        }
+        iovec iov[3] = {{prefix, prefix_size}, {const_cast<char *>(msg + i), n}, {newline, 1}};
+        if (!WriteKmsgRecord(iov, 3))
+        {
+          gKernelLoggerDropped.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        i += n;
+      } while (i < size);
+    }
+
+    void SetKernelLoggerNonBlocking(bool non_blocking)
+    {
+      gKernelLoggerNonBlocking.store(non_blocking, std::memory_order_relaxed);
+      int fd = gKmsgFd.load(std::memory_order_acquire);
+      if (fd != -1)
+      {
+        SetNonBlocking(fd, non_blocking);
+      }
     }
 #endif
 
@@ -337,204 +838,1845 @@ namespace cpputils
 #endif
     }
 
-    void StderrLogger(LogId, LogSeverity severity, const char *tag, const char *file, unsigned int line,
-                      const char *message)
+    // The "tag S timestamp pid tid file:line] " that StderrLogger and
+    // FileLogger put in front of every line. It only needs the heap for very
+    // long tags or file names.
+    class LogLinePrefix
     {
-      struct tm now;
-      time_t t = time(nullptr);
+    public:
+      LogLinePrefix(LogSeverity severity, const char *tag, const char *file, unsigned int line)
+      {
+        static const char log_characters[] = "VDIWEFF";
+        static_assert(arraysize(log_characters) - 1 == FATAL + 1,
+                      "Mismatch in size of log_characters and values in LogSeverity");
+        char timestamp[32];
+        FormatLogLineTime(GetLogLineTime(), timestamp);
+        const char *format = "%s %c %s %5d %5" PRIu64 " %s:%u] ";
+        tag = tag ? tag : "nullptr";
+        pid_t pid = getpid();
+        uint64_t tid = GetLogLineThreadId();
+        size_ = snprintf(inline_, sizeof(inline_), format, tag, log_characters[severity],
+                         timestamp, pid, tid, file, line);
+        data_ = inline_;
+        if (size_ >= sizeof(inline_))
+        {
+          heap_.resize(size_ + 1);
+          snprintf(&heap_[0], heap_.size(), format, tag, log_characters[severity], timestamp,
+                   pid, tid, file, line);
+          data_ = heap_.data();
+        }
+      }
 
-#if defined(_WIN32)
-      localtime_s(&now, &t);
-#else
-      localtime_r(&t, &now);
-#endif
+      const char *c_str() const { return data_; }
+      size_t size() const { return size_; }
 
-      char timestamp[32];
-      strftime(timestamp, sizeof(timestamp), "%m-%d %H:%M:%S", &now);
+    private:
+      char inline_[256];
+      std::string heap_;
+      const char *data_;
+      size_t size_;
 
-      static const char log_characters[] = "VDIWEFF";
-      static_assert(arraysize(log_characters) - 1 == FATAL + 1,
-                    "Mismatch in size of log_characters and values in LogSeverity");
-      char severity_char = log_characters[severity];
+      DISALLOW_COPY_AND_ASSIGN(LogLinePrefix);
+    };
 
+    void StderrLogger(LogId, LogSeverity severity, const char *tag, const char *file, unsigned int line,
+                      const char *message)
+    {
+      LogLinePrefix prefix(severity, tag, file, line);
       FILE *outfile = (FILE *)GetLogFile();
       outfile = (outfile) ? outfile : stderr;
-      fprintf(outfile, "%s %c %s %5d %5" PRIu64 " %s:%u] %s\n", tag ? tag : "nullptr", severity_char,
-              timestamp, getpid(), GetThreadId(), file, line, message);
+      fprintf(outfile, "%s%s\n", prefix.c_str(), message);
       fflush(outfile);
     }
 
-    void StdioLogger(LogId, LogSeverity severity, const char * /*tag*/, const char * /*file*/,
-                     unsigned int /*line*/, const char *message)
+    // Writes `count` buffers, retrying after short writes.
+    static bool WritevFully(int fd, iovec *iov, int count)
     {
-      FILE *outfile = (FILE *)GetLogFile();
-      if (severity >= WARNING)
+      while (count > 0)
       {
-        //fflush((outfile) ? outfile : stdout);
-        fprintf((outfile) ? outfile : stderr, "%s: %s\n", GetFileBasename(getprogname()), message);
-        fflush((outfile) ? outfile : stderr);
-      }
-      else
-      {
-        fprintf((outfile) ? outfile : stdout, "%s\n", message);
-        fflush((outfile) ? outfile : stdout);
+        ssize_t n = TEMP_FAILURE_RETRY(writev(fd, iov, count));
+        if (n <= 0)
+        {
+          return false;
+        }
+        size_t written = n;
+        while (count > 0 && written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          ++iov;
+          --count;
+        }
+        if (count > 0)
+        {
+          iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+          iov->iov_len -= written;
+        }
       }
+      return true;
     }
 
-    void DefaultAborter(const char *abort_message)
+    // Formats the lines of one or more messages exactly as StderrLogger would,
+    // then writes them all with a single writev rather than an fprintf and an
+    // fflush per line, so that stack traces and async batches cost one system
+    // call. Message text is not copied and must stay alive until Write().
+    // Only used with LoggingLock() held, which also keeps the storage reused.
+    class StderrLogBatch
     {
-#ifdef __ANDROID__
-      android_set_abort_message(abort_message);
-#else
-      UNUSED(abort_message);
-#endif
-      abort();
-    }
+    public:
+      // Adds every line of `msg`, split the way LogMessageLines does.
+      void AddMessage(const char *file, unsigned int line, LogSeverity severity, const char *tag,
+                      const char *msg, size_t size)
+      {
+        if (tag == nullptr)
+        {
+          tag = DefaultTag();
+        }
+        size_t i = 0;
+        do
+        {
+          const char *nl = static_cast<const char *>(memchr(msg + i, '\n', size - i));
+          size_t end = (nl != nullptr) ? nl - msg : size;
+          LogLinePrefix prefix(severity, tag, file, line);
+          lines_.push_back(Line{prefixes_.size(), prefix.size(), msg + i, end - i});
+          prefixes_.append(prefix.c_str(), prefix.size());
+          i = end + 1;
+        } while (i < size);
+      }
 
-#ifdef __ANDROID__
-    LogdLogger::LogdLogger(LogId default_log_id) : default_log_id_(default_log_id)
-    {
-    }
+      void Write()
+      {
+        FILE *outfile = (FILE *)GetLogFile();
+        outfile = (outfile) ? outfile : stderr;
+        // Anything written through stdio must come out first.
+        fflush(outfile);
+        int fd = fileno(outfile);
+
+        static char newline[] = "\n";
+        iov_.clear();
+        for (const Line &line : lines_)
+        {
+          if (iov_.size() + 3 > kMaxIov)
+          {
+            WritevFully(fd, iov_.data(), iov_.size());
+            iov_.clear();
+          }
+          iov_.push_back(iovec{&prefixes_[line.prefix_offset], line.prefix_size});
+          iov_.push_back(iovec{const_cast<char *>(line.text), line.text_size});
+          iov_.push_back(iovec{newline, 1});
+        }
+        if (!iov_.empty())
+        {
+          WritevFully(fd, iov_.data(), iov_.size());
+        }
+        lines_.clear();
+        prefixes_.clear();
+      }
 
-    void LogdLogger::operator()(LogId id, LogSeverity severity, const char *tag,
-                                const char *file, unsigned int line,
-                                const char *message)
+    private:
+      // IOV_MAX is 1024 on Linux; POSIX only guarantees 16.
+      static constexpr size_t kMaxIov = 1024;
+
+      struct Line
+      {
+        // An offset rather than a pointer, since `prefixes_` may grow.
+        size_t prefix_offset;
+        size_t prefix_size;
+        const char *text;
+        size_t text_size;
+      };
+
+      std::vector<Line> lines_;
+      std::string prefixes_;
+      std::vector<iovec> iov_;
+    };
+
+    static StderrLogBatch &GetStderrLogBatch()
     {
-      static constexpr android_LogPriority kLogSeverityToAndroidLogPriority[] = {
-          ANDROID_LOG_VERBOSE,
-          ANDROID_LOG_DEBUG,
-          ANDROID_LOG_INFO,
-          ANDROID_LOG_WARN,
-          ANDROID_LOG_ERROR,
-          ANDROID_LOG_FATAL,
-          ANDROID_LOG_FATAL,
+      static auto &batch = *new StderrLogBatch();
+      return batch;
+    }
+
+    // Lines are appended to `active_` under `buffer_mutex_`, which is all a
+    // logging thread normally does. Flush() swaps `active_` with `writing_`
+    // and writes it out under `io_mutex_` only, so logging threads are not
+    // held up by the write or by rotation. The two buffers keep their
+    // capacity, so steady-state logging does not allocate.
+    class FileLogger::Impl
+    {
+    public:
+      explicit Impl(const FileLoggerOptions &options)
+          : options_(options)
+      {
+        if (options_.buffer_size == 0)
+        {
+          options_.buffer_size = 1;
+        }
+        active_.reserve(options_.buffer_size);
+        writing_.reserve(options_.buffer_size);
+        {
+          std::lock_guard<std::mutex> lock(io_mutex_);
+          OpenLocked();
+        }
+        {
+          std::lock_guard<std::mutex> lock(InstancesLock());
+          static bool flush_at_exit_registered = false;
+          if (!flush_at_exit_registered)
+          {
+            atexit(FlushAll);
+            flush_at_exit_registered = true;
+          }
+          Instances().push_back(this);
+        }
+        thread_ = std::thread(&Impl::Run, this);
+      }
+
+      ~Impl()
+      {
+        {
+          std::lock_guard<std::mutex> lock(InstancesLock());
+          std::vector<Impl *> &instances = Instances();
+          instances.erase(std::find(instances.begin(), instances.end(), this));
+        }
+        {
+          std::lock_guard<std::mutex> lock(buffer_mutex_);
+          stopping_ = true;
+        }
+        buffer_cv_.notify_one();
+        thread_.join();
+        Flush();
+        if (fd_ != -1)
+        {
+          close(fd_);
+        }
+      }
+
+      void Log(LogSeverity severity, const char *tag, const char *file, unsigned int line,
+               const char *message)
+      {
+        LogLinePrefix prefix(severity, tag, file, line);
+        size_t message_size = strlen(message);
+        size_t size = prefix.size() + message_size + 1;
+
+        std::unique_lock<std::mutex> lock(buffer_mutex_);
+        if (!active_.empty() && active_.size() + size > options_.buffer_size)
+        {
+          // The background thread has fallen behind; write out on this one.
+          lock.unlock();
+          Flush();
+          lock.lock();
+        }
+        active_.append(prefix.c_str(), prefix.size());
+        active_.append(message, message_size);
+        active_.push_back('\n');
+        bool flush_now = severity >= options_.flush_severity || severity == FATAL;
+        bool wake = !flush_now && active_.size() >= options_.buffer_size / 2;
+        lock.unlock();
+
+        if (flush_now)
+        {
+          Flush();
+        }
+        else if (wake)
+        {
+          buffer_cv_.notify_one();
+        }
+      }
+
+      void Flush()
+      {
+        std::lock_guard<std::mutex> io_lock(io_mutex_);
+        {
+          std::lock_guard<std::mutex> lock(buffer_mutex_);
+          active_.swap(writing_);
+        }
+        if (writing_.empty())
+        {
+          return;
+        }
+        if (options_.max_file_size > 0 && file_size_ > 0 &&
+            file_size_ + writing_.size() > options_.max_file_size)
+        {
+          RotateLocked();
+        }
+        if (fd_ == -1)
+        {
+          OpenLocked();
+        }
+        if (fd_ != -1 && WriteFully(fd_, writing_.data(), writing_.size()))
+        {
+          file_size_ += writing_.size();
+        }
+        writing_.clear();
+      }
+
+    private:
+      static std::mutex &InstancesLock()
+      {
+        static auto &lock = *new std::mutex();
+        return lock;
+      }
+
+      static std::vector<Impl *> &Instances()
+      {
+        static auto &instances = *new std::vector<Impl *>();
+        return instances;
+      }
+
+      static void FlushAll()
+      {
+        std::lock_guard<std::mutex> lock(InstancesLock());
+        for (Impl *impl : Instances())
+        {
+          impl->Flush();
+        }
+      }
+
+      void Run()
+      {
+        std::unique_lock<std::mutex> lock(buffer_mutex_);
+        while (!stopping_)
+        {
+          if (options_.flush_interval.count() > 0)
+          {
+            buffer_cv_.wait_for(lock, options_.flush_interval);
+          }
+          else
+          {
+            buffer_cv_.wait(lock);
+          }
+          lock.unlock();
+          Flush();
+          lock.lock();
+        }
+      }
+
+      // Must be called with io_mutex_ held.
+      void OpenLocked()
+      {
+        const char *path = options_.path.c_str();
+        fd_ = TEMP_FAILURE_RETRY(
+            open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_BINARY, 0644));
+        if (fd_ == -1 && errno == ENOENT)
+        {
+          std::string dir = Dirname(options_.path);
+          if (CreateDirPath(dir.c_str(), 0777) == 0)
+          {
+            fd_ = TEMP_FAILURE_RETRY(
+                open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_BINARY, 0644));
+          }
+        }
+        struct stat sb;
+        file_size_ = (fd_ != -1 && fstat(fd_, &sb) == 0) ? sb.st_size : 0;
+      }
+
+      // Must be called with io_mutex_ held.
+      void RotateLocked()
+      {
+        if (fd_ != -1)
+        {
+          close(fd_);
+          fd_ = -1;
+        }
+        const std::string &path = options_.path;
+        if (options_.max_rotated_files == 0)
+        {
+          unlink(path.c_str());
+        }
+        else
+        {
+          for (size_t i = options_.max_rotated_files; i > 1; --i)
+          {
+            rename((path + "." + std::to_string(i - 1)).c_str(),
+                   (path + "." + std::to_string(i)).c_str());
+          }
+          rename(path.c_str(), (path + ".1").c_str());
+        }
+        OpenLocked();
+      }
+
+      FileLoggerOptions options_;
+
+      std::mutex buffer_mutex_;
+      std::condition_variable buffer_cv_;
+      std::string active_;
+      bool stopping_ = false;
+
+      std::mutex io_mutex_;
+      std::string writing_;
+      int fd_ = -1;
+      uint64_t file_size_ = 0;
+
+      std::thread thread_;
+
+      DISALLOW_COPY_AND_ASSIGN(Impl);
+    };
+
+    FileLogger::FileLogger(const FileLoggerOptions &options)
+        : impl_(std::make_shared<Impl>(options))
+    {
+    }
+
+    void FileLogger::operator()(LogId, LogSeverity severity, const char *tag, const char *file,
+                                unsigned int line, const char *message)
+    {
+      impl_->Log(severity, tag, file, line, message);
+    }
+
+    void FileLogger::Flush()
+    {
+      impl_->Flush();
+    }
+
+    // The socket is unconnected, so a collector that restarts and binds the
+    // path again is picked up by the next datagram.
+    class SocketLogger::Impl
+    {
+    public:
+      explicit Impl(const std::string &path)
+          : fd_(socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0))
+      {
+        memset(&addr_, 0, sizeof(addr_));
+        addr_.sun_family = AF_UNIX;
+        if (path.size() < sizeof(addr_.sun_path))
+        {
+          memcpy(addr_.sun_path, path.c_str(), path.size() + 1);
+          addr_size_ = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+        }
+        else
+        {
+          addr_size_ = 0;
+        }
+      }
+
+      ~Impl()
+      {
+        if (fd_ != -1)
+        {
+          close(fd_);
+        }
+      }
+
+      void Log(LogSeverity severity, const char *tag, const char *file, unsigned int line,
+               const char *message)
+      {
+        if (fd_ == -1 || addr_size_ == 0)
+        {
+          return;
+        }
+        LogLinePrefix prefix(severity, tag, file, line);
+        static char newline[] = "\n";
+        iovec iov[3] = {{const_cast<char *>(prefix.c_str()), prefix.size()},
+                        {const_cast<char *>(message), strlen(message)},
+                        {newline, 1}};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr_;
+        msg.msg_namelen = addr_size_;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = arraysize(iov);
+        // Errors mean that the collector is gone or behind; either way the
+        // line is dropped.
+        TEMP_FAILURE_RETRY(sendmsg(fd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL));
+      }
+
+    private:
+      const int fd_;
+      sockaddr_un addr_;
+      socklen_t addr_size_;
+
+      DISALLOW_COPY_AND_ASSIGN(Impl);
+    };
+
+    SocketLogger::SocketLogger(const std::string &path) : impl_(std::make_shared<Impl>(path))
+    {
+    }
+
+    void SocketLogger::operator()(LogId, LogSeverity severity, const char *tag, const char *file,
+                                  unsigned int line, const char *message)
+    {
+      impl_->Log(severity, tag, file, line, message);
+    }
+
+    // How each byte of a string is escaped in JSON and in quoted logfmt
+    // values: 0 if it is copied as is, 'u' for \u00XX, otherwise the
+    // character that follows the backslash. Bytes from 0x80 up are copied,
+    // so UTF-8 passes through.
+    struct LogEscapeTable
+    {
+      char escapes[256];
+      // Whether a logfmt value containing the byte needs quotes.
+      bool quote[256];
+
+      constexpr LogEscapeTable() : escapes(), quote()
+      {
+        for (int c = 0; c < 0x20; ++c)
+        {
+          escapes[c] = 'u';
+          quote[c] = true;
+        }
+        escapes['\b'] = 'b';
+        escapes['\f'] = 'f';
+        escapes['\n'] = 'n';
+        escapes['\r'] = 'r';
+        escapes['\t'] = 't';
+        escapes['"'] = '"';
+        escapes['\\'] = '\\';
+        escapes[0x7f] = 'u';
+        quote[' '] = true;
+        quote['='] = true;
+        quote['"'] = true;
+        quote['\\'] = true;
+        quote[0x7f] = true;
+      }
+    };
+    static constexpr LogEscapeTable kLogEscapes;
+
+    // Appends `data` to `out` with the bytes that need it escaped. Runs of
+    // plain bytes are appended in one go. `Out` is anything with
+    // append(const char*, size_t), such as std::string.
+    template <typename Out>
+    static void AppendEscaped(const char *data, size_t size, Out &out)
+    {
+      static const char kHex[] = "0123456789abcdef";
+      const char *run = data;
+      const char *end = data + size;
+      for (const char *p = data; p != end; ++p)
+      {
+        const unsigned char c = *p;
+        const char escape = kLogEscapes.escapes[c];
+        if (LIKELY(escape == 0))
+        {
+          continue;
+        }
+        out.append(run, p - run);
+        if (escape == 'u')
+        {
+          const char code[] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+          out.append(code, sizeof(code));
+        }
+        else
+        {
+          const char code[] = {'\\', escape};
+          out.append(code, sizeof(code));
+        }
+        run = p + 1;
+      }
+      out.append(run, end - run);
+    }
+
+    template <typename Out>
+    static void AppendJsonString(const char *data, size_t size, Out &out)
+    {
+      out.append("\"", 1);
+      AppendEscaped(data, size, out);
+      out.append("\"", 1);
+    }
+
+    // Quotes the value only if it is empty or would otherwise be misread.
+    template <typename Out>
+    static void AppendLogfmtValue(const char *data, size_t size, Out &out)
+    {
+      bool quote = (size == 0);
+      for (size_t i = 0; i < size && !quote; ++i)
+      {
+        quote = kLogEscapes.quote[static_cast<unsigned char>(data[i])];
+      }
+      if (quote)
+      {
+        AppendJsonString(data, size, out);
+      }
+      else
+      {
+        out.append(data, size);
+      }
+    }
+
+    // Whether a kNumber field is also a JSON number; "nan" and "inf" are not.
+    static bool IsJsonNumber(const char *value, size_t size)
+    {
+      bool digits = false;
+      for (size_t i = 0; i < size; ++i)
+      {
+        const char c = value[i];
+        if (c >= '0' && c <= '9')
+        {
+          digits = true;
+        }
+        else if (c != '-' && c != '+' && c != '.' && c != 'e' && c != 'E')
+        {
+          return false;
+        }
+      }
+      return digits;
+    }
+
+    // Calls fn(kind, key, key_size, value, value_size) for each field that
+    // LogStream::With encoded into `fields`.
+    template <typename F>
+    static void ForEachLogField(const char *fields, size_t size, F fn)
+    {
+      const char *end = fields + size;
+      while (fields < end)
+      {
+        const char kind = *fields++;
+        const char *key = fields;
+        const char *key_end = static_cast<const char *>(memchr(key, '\0', end - key));
+        if (key_end == nullptr)
+        {
+          return;
+        }
+        const char *value = key_end + 1;
+        const char *value_end = static_cast<const char *>(memchr(value, '\0', end - value));
+        if (value_end == nullptr)
+        {
+          return;
+        }
+        fn(static_cast<LogStream::FieldKind>(kind), key, key_end - key, value, value_end - value);
+        fields = value_end + 1;
+      }
+    }
+
+    // Appends " key=value" for each field, as loggers that do not encode the
+    // fields get them.
+    template <typename Out>
+    static void AppendLogfmtFields(const char *fields, size_t size, Out &out)
+    {
+      ForEachLogField(fields, size, [&](LogStream::FieldKind, const char *key, size_t key_size,
+                                        const char *value, size_t value_size) {
+        out.append(" ", 1);
+        out.append(key, key_size);
+        out.append("=", 1);
+        AppendLogfmtValue(value, value_size, out);
+      });
+    }
+
+    void EncodeLogLine(LogEncoding encoding, LogSeverity severity, const char *tag,
+                       const char *file, unsigned int line, const char *message, std::string *out)
+    {
+      static const char *const kLevels[] = {"verbose", "debug", "info", "warning",
+                                            "error", "fatal", "fatal"};
+      static_assert(arraysize(kLevels) == FATAL + 1,
+                    "Mismatch in size of kLevels and values in LogSeverity");
+      const bool json = (encoding == LogEncoding::kJson);
+      const LogLineContext *context = gLogLineContext;
+      size_t message_size = strlen(message);
+      if (context != nullptr && context->fields_size != 0 && message >= context->msg &&
+          message + message_size > context->msg + context->text_size)
+      {
+        // The last line carries the logfmt rendering of the fields; they are
+        // encoded from the fields themselves instead.
+        message_size = std::max(context->msg + context->text_size, message) - message;
+      }
+
+      auto append_string = [&](const char *data, size_t size) {
+        if (json)
+        {
+          AppendJsonString(data, size, *out);
+        }
+        else
+        {
+          AppendLogfmtValue(data, size, *out);
+        }
       };
-      static_assert(arraysize(kLogSeverityToAndroidLogPriority) == FATAL + 1,
-                    "Mismatch in size of kLogSeverityToAndroidLogPriority and values in LogSeverity");
 
-      int priority = kLogSeverityToAndroidLogPriority[severity];
-      if (id == DEFAULT)
+      const LogLineTime time = GetLogLineTime();
+      char number[64];
+      int n = snprintf(number, sizeof(number), "%" PRId64 ".%06ld", time.seconds,
+                       time.nanoseconds / 1000);
+      out->append(json ? "{\"ts\":" : "ts=");
+      out->append(number, n);
+      out->append(json ? ",\"level\":\"" : " level=");
+      out->append(kLevels[severity]);
+      out->append(json ? "\",\"tag\":" : " tag=");
+      tag = (tag != nullptr) ? tag : DefaultTag();
+      append_string(tag, strlen(tag));
+      n = snprintf(number, sizeof(number), json ? ",\"pid\":%d,\"tid\":%" PRIu64 ",\"file\":"
+                                                : " pid=%d tid=%" PRIu64 " file=",
+                   getpid(), GetLogLineThreadId());
+      out->append(number, n);
+      append_string(file, strlen(file));
+      n = snprintf(number, sizeof(number), json ? ",\"line\":%u,\"msg\":" : " line=%u msg=", line);
+      out->append(number, n);
+      append_string(message, message_size);
+
+      if (context == nullptr || context->fields_size == 0)
+      {
+        if (json)
+        {
+          out->append("}", 1);
+        }
+        return;
+      }
+      if (!json)
+      {
+        AppendLogfmtFields(context->fields, context->fields_size, *out);
+        return;
+      }
+      ForEachLogField(context->fields, context->fields_size,
+                      [&](LogStream::FieldKind kind, const char *key, size_t key_size,
+                          const char *value, size_t value_size) {
+                        out->append(",", 1);
+                        AppendJsonString(key, key_size, *out);
+                        out->append(":", 1);
+                        if (kind == LogStream::kLiteral ||
+                            (kind == LogStream::kNumber && IsJsonNumber(value, value_size)))
+                        {
+                          out->append(value, value_size);
+                        }
+                        else
+                        {
+                          AppendJsonString(value, value_size, *out);
+                        }
+                      });
+      out->append("}", 1);
+    }
+
+    StructuredLogger::StructuredLogger(int fd, LogEncoding encoding) : fd_(fd), encoding_(encoding)
+    {
+    }
+
+    void StructuredLogger::operator()(LogId, LogSeverity severity, const char *tag,
+                                      const char *file, unsigned int line, const char *message)
+    {
+      static thread_local std::string buffer;
+      buffer.clear();
+      EncodeLogLine(encoding_, severity, tag, file, line, message, &buffer);
+      buffer.push_back('\n');
+      WriteFully(fd_, buffer.data(), buffer.size());
+      // Don't let one huge line pin its memory for the life of the thread.
+      if (buffer.capacity() > 64 * 1024)
+      {
+        std::string().swap(buffer);
+      }
+    }
+
+    void StdioLogger(LogId, LogSeverity severity, const char * /*tag*/, const char * /*file*/,
+                     unsigned int /*line*/, const char *message)
+    {
+      FILE *outfile = (FILE *)GetLogFile();
+      if (severity >= WARNING)
+      {
+        //fflush((outfile) ? outfile : stdout);
+        fprintf((outfile) ? outfile : stderr, "%s: %s\n", GetFileBasename(getprogname()), message);
+        fflush((outfile) ? outfile : stderr);
+      }
+      else
+      {
+        fprintf((outfile) ? outfile : stdout, "%s\n", message);
+        fflush((outfile) ? outfile : stdout);
+      }
+    }
+
+    void DefaultAborter(const char *abort_message)
+    {
+#ifdef __ANDROID__
+      android_set_abort_message(abort_message);
+#else
+      UNUSED(abort_message);
+#endif
+      DumpFlightRecorderForCrash();
+      abort();
+    }
+
+#ifdef __ANDROID__
+    LogdLogger::LogdLogger(LogId default_log_id) : default_log_id_(default_log_id)
+    {
+    }
+
+    void LogdLogger::operator()(LogId id, LogSeverity severity, const char *tag,
+                                const char *file, unsigned int line,
+                                const char *message)
+    {
+      static constexpr android_LogPriority kLogSeverityToAndroidLogPriority[] = {
+          ANDROID_LOG_VERBOSE,
+          ANDROID_LOG_DEBUG,
+          ANDROID_LOG_INFO,
+          ANDROID_LOG_WARN,
+          ANDROID_LOG_ERROR,
+          ANDROID_LOG_FATAL,
+          ANDROID_LOG_FATAL,
+      };
+      static_assert(arraysize(kLogSeverityToAndroidLogPriority) == FATAL + 1,
+                    "Mismatch in size of kLogSeverityToAndroidLogPriority and values in LogSeverity");
+
+      int priority = kLogSeverityToAndroidLogPriority[severity];
+      if (id == DEFAULT)
+      {
+        id = default_log_id_;
+      }
+
+      static constexpr log_id kLogIdToAndroidLogId[] = {
+          LOG_ID_MAX,
+          LOG_ID_MAIN,
+          LOG_ID_SYSTEM,
+      };
+      static_assert(arraysize(kLogIdToAndroidLogId) == SYSTEM + 1,
+                    "Mismatch in size of kLogIdToAndroidLogId and values in LogId");
+      log_id lg_id = kLogIdToAndroidLogId[id];
+
+      if (priority == ANDROID_LOG_FATAL)
+      {
+        __android_log_buf_print(lg_id, priority, tag, "%s:%u] %s", file, line,
+                                message);
+      }
+      else
+      {
+        __android_log_buf_print(lg_id, priority, tag, "%s", message);
+      }
+    }
+#endif
+
+    void InitLogging(char *argv[], LogFunction &&logger, AbortFunction &&aborter)
+    {
+      SetLogger(std::forward<LogFunction>(logger));
+      SetAborter(std::forward<AbortFunction>(aborter));
+
+      if (gInitialized)
+      {
+        return;
+      }
+
+      gInitialized = true;
+
+      // Stash the command line for later use. We can use /proc/self/cmdline on
+      // Linux to recover this, but we don't have that luxury on the Mac/Windows,
+      // and there are a couple of argv[0] variants that are commonly used.
+      if (argv != nullptr)
+      {
+        SetDefaultTag(basename(argv[0]));
+      }
+
+      const char *tags = getenv("ANDROID_LOG_TAGS");
+      if (tags == nullptr)
+      {
+        return;
+      }
+
+      std::vector<std::string> specs = Split(tags, " ");
+      for (size_t i = 0; i < specs.size(); ++i)
+      {
+        // "tag-pattern:[vdiwefs]"
+        std::string spec(specs[i]);
+        if (spec.size() >= 3 && spec[spec.size() - 2] == ':')
+        {
+          LogSeverity severity;
+          switch (spec.back())
+          {
+          case 'v':
+            severity = VERBOSE;
+            break;
+          case 'd':
+            severity = DEBUG;
+            break;
+          case 'i':
+            severity = INFO;
+            break;
+          case 'w':
+            severity = WARNING;
+            break;
+          case 'e':
+            severity = ERROR;
+            break;
+          case 'f':
+            severity = FATAL_WITHOUT_ABORT;
+            break;
+          // liblog will even suppress FATAL if you say 's' for silent, but that's
+          // crazy!
+          case 's':
+            severity = FATAL_WITHOUT_ABORT;
+            break;
+          default:
+            LOG(FATAL) << "unsupported '" << spec << "' in ANDROID_LOG_TAGS (" << tags
+                       << ")";
+            continue;
+          }
+          std::string tag = spec.substr(0, spec.size() - 2);
+          if (tag == "*")
+          {
+            SetMinimumLogSeverity(severity);
+          }
+          else
+          {
+            SetTagLogSeverity(tag, severity);
+          }
+          continue;
+        }
+        LOG(FATAL) << "unsupported '" << spec << "' in ANDROID_LOG_TAGS (" << tags
+                   << ")";
+      }
+    }
+
+    void SetLogger(LogFunction &&logger)
+    {
+      std::lock_guard<std::mutex> lock(LoggingLock());
+      Logger() = std::move(logger);
+      using LoggerPointer = void (*)(LogId, LogSeverity, const char *, const char *, unsigned int,
+                                     const char *);
+      const LoggerPointer *target = Logger().target<LoggerPointer>();
+      gLoggerIsStderrLogger = (target != nullptr && *target == &StderrLogger);
+    }
+
+    void SetAborter(AbortFunction &&aborter)
+    {
+      std::lock_guard<std::mutex> lock(LoggingLock());
+      Aborter() = std::move(aborter);
+    }
+
+    // Calls `fn` with every line of `msg`. `msg` must be NUL-terminated; it is
+    // modified while the lines are handed out but restored before returning. A
+    // trailing newline ends the last line rather than starting an empty one.
+    template <typename F>
+    static void ForEachLogMessageLine(char *msg, size_t size, F fn)
+    {
+      size_t i = 0;
+      do
+      {
+        char *nl = static_cast<char *>(memchr(msg + i, '\n', size - i));
+        if (nl == nullptr)
+        {
+          fn(msg + i);
+          break;
+        }
+        *nl = '\0';
+        fn(msg + i);
+        *nl = '\n';
+        i = nl - msg + 1;
+      } while (i < size);
+    }
+
+    // Hands every line of `msg` to the logger. Must be called with LoggingLock()
+    // held. See ForEachLogMessageLine for what happens to `msg`.
+    static void LogMessageLines(const char *file, unsigned int line, LogId id, LogSeverity severity,
+                                const char *tag, char *msg, size_t size)
+    {
+      if (gLoggerIsStderrLogger)
+      {
+        StderrLogBatch &batch = GetStderrLogBatch();
+        batch.AddMessage(file, line, severity, tag, msg, size);
+        batch.Write();
+        return;
+      }
+
+      ForEachLogMessageLine(msg, size, [&](const char *text) {
+        LogMessage::LogLine(file, line, id, severity, tag, text);
+      });
+    }
+
+    // The start of a flight recorder's memory, followed by the ring itself
+    // at kFlightRecorderHeaderSize. It is all that DumpFlightRecorderFile
+    // needs to read a recorder file that a process left behind.
+    struct FlightRecorderHeader
+    {
+      char magic[8];
+      uint32_t version;
+      uint32_t header_size;
+      uint64_t capacity;
+      // Bytes ever reserved in the ring; the next line goes at head % capacity.
+      std::atomic<uint64_t> head;
+    };
+
+    static const char kFlightRecorderMagic[8] = {'C', 'P', 'U', 'F', 'L', 'R', 'E', 'C'};
+    static constexpr uint32_t kFlightRecorderVersion = 1;
+    static constexpr size_t kFlightRecorderHeaderSize = 64;
+    static_assert(sizeof(FlightRecorderHeader) <= kFlightRecorderHeaderSize,
+                  "FlightRecorderHeader does not fit in front of the ring");
+
+    // Set once the flight recorder was dumped for a crash.
+    static std::atomic<bool> gFlightRecorderDumped(false);
+
+    static void CopyToFlightRecorder(FlightRecorder *recorder, uint64_t pos, const char *data,
+                                     size_t size)
+    {
+      size_t offset = pos & (recorder->capacity - 1);
+      size_t first = std::min<size_t>(size, recorder->capacity - offset);
+      memcpy(recorder->data + offset, data, first);
+      memcpy(recorder->data, data + first, size - first);
+    }
+
+    // Appends every line of `msg` to the ring in the StderrLogger format.
+    // Writers only contend on the fetch_add that reserves their bytes. Lines
+    // longer than a quarter of the ring are cut short. See
+    // ForEachLogMessageLine for what happens to `msg`.
+    static void RecordInFlightRecorder(FlightRecorder *recorder, const char *file,
+                                       unsigned int line, LogSeverity severity, const char *tag,
+                                       char *msg, size_t size)
+    {
+      LogLinePrefix prefix(severity, (tag != nullptr) ? tag : DefaultTag(), file, line);
+      const size_t max_size = recorder->capacity / 4;
+      const size_t prefix_size = std::min(prefix.size(), max_size);
+      ForEachLogMessageLine(msg, size, [&](const char *text) {
+        size_t text_size = std::min(strlen(text), max_size);
+        uint64_t pos = recorder->header->head.fetch_add(prefix_size + text_size + 1,
+                                                         std::memory_order_relaxed);
+        CopyToFlightRecorder(recorder, pos, prefix.c_str(), prefix_size);
+        CopyToFlightRecorder(recorder, pos + prefix_size, text, text_size);
+        CopyToFlightRecorder(recorder, pos + prefix_size + text_size, "\n", 1);
+      });
+    }
+
+    // Writes part of the ring to `fd`, leaving out the zero bytes of lines
+    // that were reserved but never written. Async-signal-safe.
+    static void WriteFlightRecorderRange(int fd, const char *data, size_t size)
+    {
+      while (size > 0)
+      {
+        const char *nul = static_cast<const char *>(memchr(data, '\0', size));
+        size_t n = (nul != nullptr) ? nul - data : size;
+        WriteFully(fd, data, n);
+        while (n < size && data[n] == '\0')
+        {
+          ++n;
+        }
+        data += n;
+        size -= n;
+      }
+    }
+
+    // Writes the lines in the ring to `fd`, oldest first. Async-signal-safe.
+    static void DumpFlightRecorderRing(const FlightRecorder &recorder, int fd)
+    {
+      static const char kBegin[] = "--- flight recorder: most recent log lines ---\n";
+      static const char kEnd[] = "--- end of flight recorder ---\n";
+      const uint64_t end = recorder.header->head.load(std::memory_order_acquire);
+      const uint64_t begin = (end > recorder.capacity) ? end - recorder.capacity : 0;
+      const size_t offset = begin & (recorder.capacity - 1);
+      const char *first = recorder.data + offset;
+      size_t first_size = std::min<uint64_t>(end - begin, recorder.capacity - offset);
+      const char *second = recorder.data;
+      size_t second_size = end - begin - first_size;
+      if (begin > 0)
+      {
+        // The oldest line has been partly overwritten; start after it.
+        const char *nl = static_cast<const char *>(memchr(first, '\n', first_size));
+        if (nl != nullptr)
+        {
+          first_size -= nl + 1 - first;
+          first = nl + 1;
+        }
+        else
+        {
+          first_size = 0;
+          nl = static_cast<const char *>(memchr(second, '\n', second_size));
+          second_size = (nl != nullptr) ? second_size - (nl + 1 - second) : 0;
+          second = (nl != nullptr) ? nl + 1 : second;
+        }
+      }
+      WriteFully(fd, kBegin, sizeof(kBegin) - 1);
+      WriteFlightRecorderRange(fd, first, first_size);
+      WriteFlightRecorderRange(fd, second, second_size);
+      WriteFully(fd, kEnd, sizeof(kEnd) - 1);
+    }
+
+    bool EnableFlightRecorder(const FlightRecorderOptions &options)
+    {
+      uint64_t capacity = 4096;
+      while (capacity < options.capacity)
+      {
+        capacity *= 2;
+      }
+      const size_t size = kFlightRecorderHeaderSize + capacity;
+      void *memory;
+      if (options.path.empty())
+      {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      }
+      else
+      {
+        int fd = TEMP_FAILURE_RETRY(
+            open(options.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        if (fd == -1)
+        {
+          return false;
+        }
+        memory = (ftruncate(fd, size) == 0)
+                     ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                     : MAP_FAILED;
+        ErrnoRestorer errno_restorer;
+        close(fd);
+      }
+      if (memory == MAP_FAILED)
+      {
+        return false;
+      }
+
+      // The memory starts out zeroed, so the ring is empty.
+      FlightRecorderHeader *header = new (memory) FlightRecorderHeader();
+      memcpy(header->magic, kFlightRecorderMagic, sizeof(header->magic));
+      header->version = kFlightRecorderVersion;
+      header->header_size = kFlightRecorderHeaderSize;
+      header->capacity = capacity;
+      char *data = static_cast<char *>(memory) + kFlightRecorderHeaderSize;
+      gFlightRecorder.store(new FlightRecorder{header, data, capacity, options.min_severity},
+                            std::memory_order_release);
+      BumpLogSeverityGeneration();
+      return true;
+    }
+
+    void DisableFlightRecorder()
+    {
+      gFlightRecorder.store(nullptr, std::memory_order_release);
+      BumpLogSeverityGeneration();
+    }
+
+    void DumpFlightRecorder(int fd)
+    {
+      const FlightRecorder *recorder = gFlightRecorder.load(std::memory_order_acquire);
+      if (recorder != nullptr)
+      {
+        DumpFlightRecorderRing(*recorder, fd);
+      }
+    }
+
+    // Dumps the flight recorder to stderr, unless an earlier crash already did.
+    static void DumpFlightRecorderForCrash()
+    {
+      if (!gFlightRecorderDumped.exchange(true))
+      {
+        DumpFlightRecorder(STDERR_FILENO);
+      }
+    }
+
+    static const int kFlightRecorderSignals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    static struct sigaction gPreviousSignalActions[arraysize(kFlightRecorderSignals)];
+
+    static void FlightRecorderSignalHandler(int signal_number, siginfo_t *info, void *)
+    {
+      DumpFlightRecorderForCrash();
+      for (size_t i = 0; i < arraysize(kFlightRecorderSignals); ++i)
+      {
+        if (kFlightRecorderSignals[i] == signal_number)
+        {
+          sigaction(signal_number, &gPreviousSignalActions[i], nullptr);
+        }
+      }
+      // A fault happens again when the faulting instruction is retried, and
+      // goes to the previous handler with its original details. A signal that
+      // was sent has to be sent again; it stays blocked until we return.
+      if (info->si_code <= 0)
+      {
+        raise(signal_number);
+      }
+    }
+
+    void InstallFlightRecorderSignalHandlers()
+    {
+      // Installing twice would make our handler its own previous handler.
+      static std::atomic<bool> installed(false);
+      if (installed.exchange(true))
+      {
+        return;
+      }
+      struct sigaction action;
+      memset(&action, 0, sizeof(action));
+      action.sa_sigaction = FlightRecorderSignalHandler;
+      sigemptyset(&action.sa_mask);
+      action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      for (size_t i = 0; i < arraysize(kFlightRecorderSignals); ++i)
+      {
+        sigaction(kFlightRecorderSignals[i], &action, &gPreviousSignalActions[i]);
+      }
+    }
+
+    bool DumpFlightRecorderFile(const std::string &path, int out_fd)
+    {
+      int fd = TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+      if (fd == -1)
+      {
+        return false;
+      }
+      struct stat sb;
+      void *memory = MAP_FAILED;
+      if (fstat(fd, &sb) == 0)
+      {
+        if (static_cast<uint64_t>(sb.st_size) <= kFlightRecorderHeaderSize)
+        {
+          errno = EINVAL;
+        }
+        else
+        {
+          memory = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+      }
+      {
+        ErrnoRestorer errno_restorer;
+        close(fd);
+      }
+      if (memory == MAP_FAILED)
+      {
+        return false;
+      }
+
+      const FlightRecorderHeader *header = static_cast<const FlightRecorderHeader *>(memory);
+      const uint64_t capacity = header->capacity;
+      bool valid = memcmp(header->magic, kFlightRecorderMagic, sizeof(header->magic)) == 0 &&
+                   header->version == kFlightRecorderVersion &&
+                   header->header_size == kFlightRecorderHeaderSize && capacity != 0 &&
+                   (capacity & (capacity - 1)) == 0 &&
+                   static_cast<uint64_t>(sb.st_size) == kFlightRecorderHeaderSize + capacity;
+      if (valid)
+      {
+        const FlightRecorder recorder = {const_cast<FlightRecorderHeader *>(header),
+                                         static_cast<char *>(memory) + kFlightRecorderHeaderSize,
+                                         capacity, VERBOSE};
+        DumpFlightRecorderRing(recorder, out_fd);
+      }
+      munmap(memory, sb.st_size);
+      if (!valid)
+      {
+        errno = EINVAL;
+      }
+      return valid;
+    }
+
+    struct AsyncLogRecord
+    {
+      const char *file;
+      unsigned int line;
+      LogId id;
+      LogSeverity severity;
+      const char *tag;
+      LogLineContext context;
+      std::string msg;
+      std::string fields;
+
+      // The context, pointed at this record's copies of the message and fields.
+      const LogLineContext *Context()
+      {
+        context.msg = msg.data();
+        context.fields = fields.data();
+        return &context;
+      }
+    };
+
+    static thread_local bool gIsLogDrainThread = false;
+
+    // Queues finished messages and hands them to the logger from a background
+    // thread. Producers only touch the lock-free queue unless it is full (with
+    // LogOverflowPolicy::kBlock) or the drain thread is asleep. With a `sink`,
+    // messages go to the sink instead, without taking LoggingLock(): only the
+    // drain thread calls it. A stopped logger stays alive for producers that
+    // still hold a pointer to it; they log what they push themselves.
+    class AsyncLogger
+    {
+    public:
+      explicit AsyncLogger(const AsyncLoggingOptions &options, LogFunction sink = LogFunction())
+          : options_(options),
+            has_sink_(static_cast<bool>(sink)),
+            sink_(std::move(sink)),
+            queue_(options.queue_capacity),
+            draining_(false),
+            sleeping_(false),
+            stopping_(false),
+            dropped_(0)
+      {
+        if (options_.max_batch == 0)
+        {
+          options_.max_batch = 1;
+        }
+        thread_ = std::thread(&AsyncLogger::Run, this);
+      }
+
+      void Push(const LogLineContext &context, const char *file, unsigned int line, LogId id,
+                LogSeverity severity, const char *tag, const char *msg, size_t msg_size)
+      {
+        auto fill = [&](AsyncLogRecord &record) {
+          record.file = file;
+          record.line = line;
+          record.id = id;
+          record.severity = severity;
+          record.tag = tag;
+          record.context = context;
+          // Reuses the capacity left behind by earlier messages.
+          record.msg.assign(msg, msg_size);
+          record.fields.assign(context.fields, context.fields_size);
+        };
+
+        while (!queue_.TryPush(fill))
+        {
+          switch (options_.overflow_policy)
+          {
+          case LogOverflowPolicy::kDropNewest:
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+          case LogOverflowPolicy::kDropOldest:
+            if (queue_.TryPop([](AsyncLogRecord &) {}))
+            {
+              dropped_.fetch_add(1, std::memory_order_relaxed);
+            }
+            break;
+          case LogOverflowPolicy::kBlock:
+            if (!WaitForSpace())
+            {
+              // Stopped, so nobody will make room any more.
+              dropped_.fetch_add(1, std::memory_order_relaxed);
+              return;
+            }
+            break;
+          }
+        }
+
+        // Pairs with the fences in Run(): either we see that the drain thread is
+        // going to sleep or stop, or it sees our message.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (stopping_.load(std::memory_order_relaxed))
+        {
+          LogLeftovers();
+          return;
+        }
+        if (sleeping_.load(std::memory_order_relaxed))
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          drain_cv_.notify_one();
+        }
+      }
+
+      void Flush()
+      {
+        if (gIsLogDrainThread)
+        {
+          return;
+        }
+
+        const size_t target = queue_.EnqueuePosition();
+        std::unique_lock<std::mutex> lock(mutex_);
+        drain_cv_.notify_one();
+        // `draining_` is raised before a batch is popped and lowered once it
+        // has been logged, so together with the dequeue position it tells us
+        // that everything up to `target` has reached the logger. Once stopped,
+        // producers log their messages themselves and nothing is left to wait
+        // for.
+        while (!stopping_.load() && (queue_.DequeuePosition() < target || draining_.load()))
+        {
+          space_cv_.wait_for(lock, std::chrono::milliseconds(10));
+        }
+      }
+
+      void Stop()
+      {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stopping_ = true;
+          drain_cv_.notify_one();
+        }
+        thread_.join();
+        // Threads that still push into the queue never call the sink, so it
+        // can go now.
+        sink_ = LogFunction();
+      }
+
+    private:
+      static void TakeRecord(AsyncLogRecord &out, AsyncLogRecord &record)
+      {
+        out.file = record.file;
+        out.line = record.line;
+        out.id = record.id;
+        out.severity = record.severity;
+        out.tag = record.tag;
+        out.context = record.context;
+        std::swap(out.msg, record.msg);
+        std::swap(out.fields, record.fields);
+      }
+
+      // Called by producers that pushed after Stop(), when the drain thread
+      // may have looked at the queue for the last time. What is left goes to
+      // the logger right away, or, as the sink is going away, counts as
+      // dropped. A cell that another producer has yet to fill stops us, but
+      // that producer will find the logger stopped too and carry on.
+      void LogLeftovers()
+      {
+        AsyncLogRecord record;
+        while (queue_.TryPop([&](AsyncLogRecord &queued) { TakeRecord(record, queued); }))
+        {
+          if (has_sink_)
+          {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+          }
+          std::lock_guard<std::mutex> lock(LoggingLock());
+          gLogLineContext = record.Context();
+          LogMessageLines(record.file, record.line, record.id, record.severity, record.tag,
+                          &record.msg[0], record.msg.size());
+          gLogLineContext = nullptr;
+        }
+      }
+
+      // Returns false once the logger has been stopped.
+      bool WaitForSpace()
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopping_)
+        {
+          return false;
+        }
+        drain_cv_.notify_one();
+        space_cv_.wait_for(lock, std::chrono::milliseconds(10));
+        return true;
+      }
+
+      bool QueueLooksEmpty() const
+      {
+        return queue_.DequeuePosition() == queue_.EnqueuePosition();
+      }
+
+      void Run()
+      {
+        gIsLogDrainThread = true;
+        std::vector<AsyncLogRecord> batch(options_.max_batch);
+
+        while (true)
+        {
+          draining_.store(true);
+          size_t n = 0;
+          while (n < batch.size() &&
+                 queue_.TryPop([&](AsyncLogRecord &record) { TakeRecord(batch[n], record); }))
+          {
+            ++n;
+          }
+
+          if (n > 0 && sink_)
+          {
+            LogToSink(batch, n);
+          }
+          else if (n > 0)
+          {
+            std::lock_guard<std::mutex> lock(LoggingLock());
+            // StderrLogger gets the whole batch in one write.
+            const bool write_batch = gLoggerIsStderrLogger;
+            for (size_t i = 0; i < n; ++i)
+            {
+              AsyncLogRecord &record = batch[i];
+              gLogLineContext = record.Context();
+              if (write_batch)
+              {
+                GetStderrLogBatch().AddMessage(record.file, record.line, record.severity,
+                                               record.tag, record.msg.data(), record.msg.size());
+              }
+              else
+              {
+                LogMessageLines(record.file, record.line, record.id, record.severity, record.tag,
+                                &record.msg[0], record.msg.size());
+              }
+            }
+            gLogLineContext = nullptr;
+            if (write_batch)
+            {
+              GetStderrLogBatch().Write();
+            }
+            ReportDroppedLocked();
+          }
+          draining_.store(false);
+
+          std::unique_lock<std::mutex> lock(mutex_);
+          if (n > 0)
+          {
+            space_cv_.notify_all();
+            continue;
+          }
+          // Read before looking at the queue. Pairs with the fence in Push():
+          // a producer that did not see us stopping has its message seen here.
+          const bool stopping = stopping_.load();
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (!QueueLooksEmpty())
+          {
+            // A producer has claimed a cell but not filled it yet.
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+          }
+          if (stopping)
+          {
+            break;
+          }
+
+          sleeping_.store(true, std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_seq_cst);
+          if (QueueLooksEmpty())
+          {
+            drain_cv_.wait_for(lock, std::chrono::milliseconds(100));
+          }
+          sleeping_.store(false, std::memory_order_relaxed);
+        }
+
+        if (sink_)
+        {
+          LogToSink(batch, 0);
+        }
+        else
+        {
+          std::lock_guard<std::mutex> lock(LoggingLock());
+          ReportDroppedLocked();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        space_cv_.notify_all();
+      }
+
+      // Must be called with LoggingLock() held.
+      void ReportDroppedLocked()
+      {
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped != 0)
+        {
+          std::string msg = std::to_string(dropped) + " log messages dropped: async log queue full";
+          LogMessage::LogLine(GetFileBasename(__FILE__), __LINE__, DEFAULT, WARNING, nullptr,
+                              msg.c_str());
+        }
+      }
+
+      // Hands the first `n` records of `batch` to the sink, followed by a
+      // report of any dropped messages.
+      void LogToSink(std::vector<AsyncLogRecord> &batch, size_t n)
       {
-        id = default_log_id_;
+        for (size_t i = 0; i < n; ++i)
+        {
+          AsyncLogRecord &record = batch[i];
+          const char *tag = (record.tag != nullptr) ? record.tag : DefaultTag();
+          gLogLineContext = record.Context();
+          ForEachLogMessageLine(&record.msg[0], record.msg.size(), [&](const char *text) {
+            sink_(record.id, record.severity, tag, record.file, record.line, text);
+          });
+        }
+        gLogLineContext = nullptr;
+
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped != 0)
+        {
+          std::string msg = std::to_string(dropped) + " log messages dropped: log sink queue full";
+          sink_(DEFAULT, WARNING, DefaultTag(), GetFileBasename(__FILE__), __LINE__, msg.c_str());
+        }
       }
 
-      static constexpr log_id kLogIdToAndroidLogId[] = {
-          LOG_ID_MAX,
-          LOG_ID_MAIN,
-          LOG_ID_SYSTEM,
-      };
-      static_assert(arraysize(kLogIdToAndroidLogId) == SYSTEM + 1,
-                    "Mismatch in size of kLogIdToAndroidLogId and values in LogId");
-      log_id lg_id = kLogIdToAndroidLogId[id];
+      AsyncLoggingOptions options_;
+      const bool has_sink_;
+      LogFunction sink_;
+      BoundedQueue<AsyncLogRecord> queue_;
+      std::atomic<bool> draining_;
+      std::atomic<bool> sleeping_;
+      // Only set under `mutex_`.
+      std::atomic<bool> stopping_;
+      std::atomic<uint64_t> dropped_;
+      std::mutex mutex_;
+      std::condition_variable drain_cv_;
+      std::condition_variable space_cv_;
+      std::thread thread_;
+
+      DISALLOW_COPY_AND_ASSIGN(AsyncLogger);
+    };
 
-      if (priority == ANDROID_LOG_FATAL)
+    static std::atomic<AsyncLogger *> gAsyncLogger(nullptr);
+
+    static std::mutex &AsyncLoggingLock()
+    {
+      static auto &async_lock = *new std::mutex();
+      return async_lock;
+    }
+
+    void EnableAsyncLogging(const AsyncLoggingOptions &options)
+    {
+      std::lock_guard<std::mutex> lock(AsyncLoggingLock());
+      if (gAsyncLogger.load() != nullptr)
       {
-        __android_log_buf_print(lg_id, priority, tag, "%s:%u] %s", file, line,
-                                message);
+        return;
       }
-      else
+
+      static bool flush_at_exit = false;
+      if (!flush_at_exit)
       {
-        __android_log_buf_print(lg_id, priority, tag, "%s", message);
+        atexit([]() { FlushLogs(); });
+        flush_at_exit = true;
       }
+      gAsyncLogger.store(new AsyncLogger(options));
     }
-#endif
 
-    void InitLogging(char *argv[], LogFunction &&logger, AbortFunction &&aborter)
+    void DisableAsyncLogging()
     {
-      SetLogger(std::forward<LogFunction>(logger));
-      SetAborter(std::forward<AbortFunction>(aborter));
+      std::lock_guard<std::mutex> lock(AsyncLoggingLock());
+      AsyncLogger *async_logger = gAsyncLogger.exchange(nullptr);
+      if (async_logger != nullptr)
+      {
+        // The logger is deliberately leaked: a thread that loaded the pointer
+        // just before the exchange may still be pushing into its queue, and
+        // then logs its message itself.
+        async_logger->Stop();
+      }
+    }
 
-      if (gInitialized)
+    // A sink added with AddLogSink.
+    struct LogSink
+    {
+      uint64_t id;
+      LogSeverity min_severity;
+      AsyncLogger *logger;
+    };
+
+    // The current sinks, or nullptr if there are none. A list is never
+    // changed once published, and like the loggers of removed sinks it is
+    // deliberately leaked, as a logging thread may still be reading it.
+    // Replaced under LogSinksLock().
+    using LogSinkList = std::vector<LogSink>;
+    static std::atomic<const LogSinkList *> gLogSinks(nullptr);
+
+    static std::mutex &LogSinksLock()
+    {
+      static auto &sinks_lock = *new std::mutex();
+      return sinks_lock;
+    }
+
+    // Must be called with LogSinksLock() held, after publishing `sinks`.
+    static void UpdateLowestLogSinkSeverityLocked(const LogSinkList *sinks)
+    {
+      int lowest = FATAL + 1;
+      if (sinks != nullptr)
       {
-        return;
+        for (const LogSink &sink : *sinks)
+        {
+          lowest = std::min(lowest, static_cast<int>(sink.min_severity));
+        }
       }
+      gLowestLogSinkSeverity.store(lowest, std::memory_order_relaxed);
+      // Call sites fold the sinks' severity into their cached minimum.
+      BumpLogSeverityGeneration();
+    }
 
-      gInitialized = true;
+    uint64_t AddLogSink(LogFunction &&sink, const LogSinkOptions &options)
+    {
+      std::lock_guard<std::mutex> lock(LogSinksLock());
+      static uint64_t next_id = 1;
+      static bool flush_at_exit = false;
+      if (!flush_at_exit)
+      {
+        atexit([]() { FlushLogs(); });
+        flush_at_exit = true;
+      }
 
-      // Stash the command line for later use. We can use /proc/self/cmdline on
-      // Linux to recover this, but we don't have that luxury on the Mac/Windows,
-      // and there are a couple of argv[0] variants that are commonly used.
-      if (argv != nullptr)
+      const LogSinkList *sinks = gLogSinks.load(std::memory_order_relaxed);
+      auto *new_sinks = (sinks != nullptr) ? new LogSinkList(*sinks) : new LogSinkList();
+      uint64_t id = next_id++;
+      new_sinks->push_back(LogSink{id, options.min_severity,
+                                   new AsyncLogger(options.queue, std::move(sink))});
+      gLogSinks.store(new_sinks, std::memory_order_release);
+      UpdateLowestLogSinkSeverityLocked(new_sinks);
+      return id;
+    }
+
+    bool RemoveLogSink(uint64_t id)
+    {
+      std::lock_guard<std::mutex> lock(LogSinksLock());
+      const LogSinkList *sinks = gLogSinks.load(std::memory_order_relaxed);
+      if (sinks == nullptr)
       {
-        SetDefaultTag(basename(argv[0]));
+        return false;
+      }
+      auto it = std::find_if(sinks->begin(), sinks->end(),
+                             [id](const LogSink &sink) { return sink.id == id; });
+      if (it == sinks->end())
+      {
+        return false;
+      }
+      AsyncLogger *logger = it->logger;
+      LogSinkList *new_sinks = nullptr;
+      if (sinks->size() > 1)
+      {
+        new_sinks = new LogSinkList(*sinks);
+        new_sinks->erase(new_sinks->begin() + (it - sinks->begin()));
       }
+      gLogSinks.store(new_sinks, std::memory_order_release);
+      UpdateLowestLogSinkSeverityLocked(new_sinks);
+      logger->Stop();
+      return true;
+    }
 
-      const char *tags = getenv("ANDROID_LOG_TAGS");
-      if (tags == nullptr)
+    // Queues a finished message for every sink that wants it.
+    static void PushToLogSinks(const LogLineContext &fields_context, const char *file,
+                               unsigned int line, LogId id, LogSeverity severity, const char *tag,
+                               const char *msg, size_t msg_size)
+    {
+      const LogSinkList *sinks = gLogSinks.load(std::memory_order_acquire);
+      if (sinks == nullptr || gIsLogDrainThread)
       {
         return;
       }
-
-      std::vector<std::string> specs = Split(tags, " ");
-      for (size_t i = 0; i < specs.size(); ++i)
+      const LogLineContext context = StampLogLineContext(fields_context);
+      for (const LogSink &sink : *sinks)
       {
-        // "tag-pattern:[vdiwefs]"
-        std::string spec(specs[i]);
-        if (spec.size() == 3 && StartsWith(spec, "*:"))
+        if (severity >= sink.min_severity)
         {
-          switch (spec[2])
-          {
-          case 'v':
-            gMinimumLogSeverity = VERBOSE;
-            continue;
-          case 'd':
-            gMinimumLogSeverity = DEBUG;
-            continue;
-          case 'i':
-            gMinimumLogSeverity = INFO;
-            continue;
-          case 'w':
-            gMinimumLogSeverity = WARNING;
-            continue;
-          case 'e':
-            gMinimumLogSeverity = ERROR;
-            continue;
-          case 'f':
-            gMinimumLogSeverity = FATAL_WITHOUT_ABORT;
-            continue;
-          // liblog will even suppress FATAL if you say 's' for silent, but that's
-          // crazy!
-          case 's':
-            gMinimumLogSeverity = FATAL_WITHOUT_ABORT;
-            continue;
-          }
+          sink.logger->Push(context, file, line, id, severity, tag, msg, msg_size);
         }
-        LOG(FATAL) << "unsupported '" << spec << "' in ANDROID_LOG_TAGS (" << tags
-                   << ")";
       }
     }
 
-    void SetLogger(LogFunction &&logger)
+    void FlushLogs()
     {
-      std::lock_guard<std::mutex> lock(LoggingLock());
-      Logger() = std::move(logger);
+      AsyncLogger *async_logger = gAsyncLogger.load();
+      if (async_logger != nullptr)
+      {
+        async_logger->Flush();
+      }
+      const LogSinkList *sinks = gLogSinks.load(std::memory_order_acquire);
+      if (sinks != nullptr)
+      {
+        for (const LogSink &sink : *sinks)
+        {
+          sink.logger->Flush();
+        }
+      }
     }
 
-    void SetAborter(AbortFunction &&aborter)
+    // A streambuf that writes into a fixed-capacity inline buffer and only
+    // moves to the heap for messages that do not fit. One byte is always kept
+    // free so that the message can be NUL-terminated in place.
+    class LogStreamBuf : public std::streambuf
     {
-      std::lock_guard<std::mutex> lock(LoggingLock());
-      Aborter() = std::move(aborter);
-    }
+    public:
+      LogStreamBuf()
+      {
+        Reset();
+      }
+
+      void Reset()
+      {
+        // Keep the heap buffer of an earlier oversized message around, unless
+        // it has become unreasonably large.
+        if (heap_.capacity() > kMaxRetainedHeapSize)
+        {
+          std::string().swap(heap_);
+        }
+        setp(inline_, inline_ + sizeof(inline_) - 1);
+      }
+
+      char *data() const
+      {
+        return pbase();
+      }
+
+      size_t size() const
+      {
+        return pptr() - pbase();
+      }
+
+      // NUL-terminates the message and returns it.
+      char *c_str()
+      {
+        *pptr() = '\0';
+        return pbase();
+      }
+
+    protected:
+      int_type overflow(int_type ch) override
+      {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+          return traits_type::not_eof(ch);
+        }
+        Grow(1);
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+        return ch;
+      }
+
+      std::streamsize xsputn(const char *s, std::streamsize n) override
+      {
+        if (n > epptr() - pptr())
+        {
+          Grow(n);
+        }
+        memcpy(pptr(), s, n);
+        // pbump() takes an int; messages never get near that size.
+        pbump(static_cast<int>(n));
+        return n;
+      }
+
+    private:
+      static constexpr size_t kInlineSize = 2048;
+      static constexpr size_t kMaxRetainedHeapSize = 64 * 1024;
+
+      void Grow(size_t extra)
+      {
+        size_t used = size();
+        size_t needed = used + extra + 1;
+        size_t capacity = (pbase() == inline_) ? sizeof(inline_) * 2 : heap_.size() * 2;
+        while (capacity < needed)
+        {
+          capacity *= 2;
+        }
+        if (pbase() == inline_)
+        {
+          heap_.resize(capacity);
+          memcpy(&heap_[0], inline_, used);
+        }
+        else
+        {
+          heap_.resize(capacity);
+        }
+        setp(&heap_[0], &heap_[0] + capacity - 1);
+        pbump(static_cast<int>(used));
+      }
+
+      char inline_[kInlineSize];
+      std::string heap_;
+
+      DISALLOW_COPY_AND_ASSIGN(LogStreamBuf);
+    };
+
+    // Lets the field encoders append to a message.
+    struct LogStreamBufWriter
+    {
+      LogStreamBuf *buf;
+
+      void append(const char *data, size_t size)
+      {
+        buf->sputn(data, size);
+      }
+    };
 
     // This indirection greatly reduces the stack impact of having lots of
-    // checks/logging in a function.
+    // checks/logging in a function. Instances are recycled through a small
+    // per-thread cache, so a typical log statement does not allocate at all.
     class LogMessageData
     {
     public:
-      LogMessageData(const char *file, unsigned int line, LogId id, LogSeverity severity,
-                     const char *tag, int error)
-          : file_(GetFileBasename(file)),
-            line_number_(line),
-            id_(id),
-            severity_(severity),
-            tag_(tag),
-            error_(error) {}
+      LogMessageData() : buffer_(&buf_, &fields_buf_)
+      {
+        default_flags_ = buffer_.flags();
+      }
+
+      void Init(const char *file, unsigned int line, LogId id, LogSeverity severity,
+                const char *tag, int error, int min_logged_severity)
+      {
+        path_ = file;
+        file_ = GetFileBasename(file);
+        line_number_ = line;
+        id_ = id;
+        severity_ = severity;
+        tag_ = tag;
+        error_ = error;
+        min_logged_severity_ = min_logged_severity;
+      }
+
+      // Forgets the previous message and any formatting state that was left
+      // on the stream, so that the next user sees a fresh stream.
+      void Reset()
+      {
+        buf_.Reset();
+        fields_buf_.Reset();
+        buffer_.clear();
+        buffer_.flags(default_flags_);
+        buffer_.precision(6);
+        buffer_.width(0);
+        buffer_.fill(' ');
+      }
 
       const char *GetFile() const
       {
         return file_;
       }
 
+      // The file as given, rather than just its name.
+      const char *GetPath() const
+      {
+        return path_;
+      }
+
       unsigned int GetLineNumber() const
       {
         return line_number_;
@@ -557,36 +2699,146 @@ namespace cpputils
         return error_;
       }
 
-      std::ostream &GetBuffer()
+      // The minimum severity for the logger, or -1 if it has to be looked up.
+      int GetMinimumLoggedSeverity() const
+      {
+        return min_logged_severity_;
+      }
+
+      LogStream &GetBuffer()
       {
         return buffer_;
       }
 
-      std::string ToString() const
+      LogStreamBuf &GetStreamBuf()
+      {
+        return buf_;
+      }
+
+      LogStreamBuf &GetFieldsStreamBuf()
       {
-        return buffer_.str();
+        return fields_buf_;
       }
 
     private:
-      std::ostringstream buffer_;
-      const char *const file_;
-      const unsigned int line_number_;
-      const LogId id_;
-      const LogSeverity severity_;
-      const char *const tag_;
-      const int error_;
+      LogStreamBuf buf_;
+      LogStreamBuf fields_buf_;
+      LogStream buffer_;
+      std::ios_base::fmtflags default_flags_;
+      const char *path_;
+      const char *file_;
+      unsigned int line_number_;
+      LogId id_;
+      LogSeverity severity_;
+      const char *tag_;
+      int error_;
+      int min_logged_severity_;
 
       DISALLOW_COPY_AND_ASSIGN(LogMessageData);
     };
 
+    void LogStream::BeginField(const char *key, FieldKind kind)
+    {
+      fields_->sputc(kind);
+      fields_->sputn(key, strlen(key) + 1);
+      rdbuf(fields_);
+    }
+
+    void LogStream::EndField()
+    {
+      fields_->sputc('\0');
+      rdbuf(text_);
+    }
+
+    // A handful of LogMessageData per thread covers LOG statements nested in
+    // operator<< implementations. The cache pointer is trivially destructible
+    // so that logging from late destructors still works: once the owner below
+    // has been destroyed, messages simply fall back to new/delete.
+    struct LogMessageDataCache
+    {
+      static constexpr size_t kSize = 4;
+      LogMessageData *entries[kSize];
+      size_t count = 0;
+
+      ~LogMessageDataCache()
+      {
+        for (size_t i = 0; i < count; ++i)
+        {
+          delete entries[i];
+        }
+      }
+    };
+    static thread_local LogMessageDataCache *gLogMessageDataCache = nullptr;
+    static thread_local bool gLogMessageDataCacheGone = false;
+
+    struct LogMessageDataCacheOwner
+    {
+      ~LogMessageDataCacheOwner()
+      {
+        delete gLogMessageDataCache;
+        gLogMessageDataCache = nullptr;
+        gLogMessageDataCacheGone = true;
+      }
+    };
+    static thread_local LogMessageDataCacheOwner gLogMessageDataCacheOwner;
+
+    static LogMessageData *AcquireLogMessageData()
+    {
+      LogMessageDataCache *cache = gLogMessageDataCache;
+      if (cache != nullptr && cache->count > 0)
+      {
+        return cache->entries[--cache->count];
+      }
+      return new LogMessageData();
+    }
+
+    void LogMessageDataReleaser::operator()(LogMessageData *data) const
+    {
+      if (gLogMessageDataCache == nullptr && !gLogMessageDataCacheGone)
+      {
+        // Odr-use the owner so that the cache is freed when the thread exits.
+        (void)&gLogMessageDataCacheOwner;
+        gLogMessageDataCache = new LogMessageDataCache();
+      }
+      LogMessageDataCache *cache = gLogMessageDataCache;
+      if (cache != nullptr && cache->count < LogMessageDataCache::kSize)
+      {
+        data->Reset();
+        cache->entries[cache->count++] = data;
+        return;
+      }
+      delete data;
+    }
+
     LogMessage::LogMessage(const char *file, unsigned int line, LogId id, LogSeverity severity,
                            const char *tag, int error)
-        : data_(new LogMessageData(file, line, id, severity, tag, error)) {}
+        : data_(AcquireLogMessageData())
+    {
+      data_->Init(file, line, id, severity, tag, error, -1);
+    }
+
+    LogMessage::LogMessage(const char *file, unsigned int line, LogId id, LogSeverity severity,
+                           const char *tag, int error, LogSiteHandOff)
+        : data_(AcquireLogMessageData())
+    {
+      data_->Init(file, line, id, severity, tag, error, TakeHandedOffLoggedSeverity());
+    }
 
     LogMessage::~LogMessage()
     {
-      // Check severity again. This is duplicate work wrt/ LOG macros, but not LOG_STREAM.
-      if (!WOULD_LOG(data_->GetSeverity()))
+      FlightRecorder *recorder = gFlightRecorder.load(std::memory_order_acquire);
+      const bool record = recorder != nullptr && data_->GetSeverity() >= recorder->min_severity;
+      // LOG's LogSite handed off the minimum severity it cached; LOG_STREAM
+      // has to check the severity again.
+      const int min_logged_severity = data_->GetMinimumLoggedSeverity();
+      const bool would_log =
+          min_logged_severity >= 0
+              ? data_->GetSeverity() >= min_logged_severity
+              : WouldLog(data_->GetSeverity(), data_->GetPath(), data_->GetTag());
+      // Log sinks have minimum severities of their own.
+      const bool to_sinks =
+          data_->GetSeverity() >= gLowestLogSinkSeverity.load(std::memory_order_relaxed);
+      if (!would_log && !record && !to_sinks)
       {
         return;
       }
@@ -596,50 +2848,93 @@ namespace cpputils
       {
         data_->GetBuffer() << ": " << strerror(data_->GetError());
       }
-      std::string msg(data_->ToString());
+      LogStreamBuf &buf = data_->GetStreamBuf();
+      const LogStreamBuf &fields = data_->GetFieldsStreamBuf();
+      const size_t text_size = buf.size();
+      if (fields.size() != 0)
+      {
+        LogStreamBufWriter writer = {&buf};
+        AppendLogfmtFields(fields.data(), fields.size(), writer);
+      }
+      if (memchr(buf.data(), '\n', buf.size()) != nullptr)
+      {
+        // Multi-line messages are handed to the aborter with a final newline.
+        data_->GetBuffer() << '\n';
+      }
+      char *msg = buf.c_str();
+      size_t msg_size = buf.size();
+
+      if (record)
+      {
+        RecordInFlightRecorder(recorder, data_->GetFile(), data_->GetLineNumber(),
+                               data_->GetSeverity(), data_->GetTag(), msg, msg_size);
+      }
 
       if (data_->GetSeverity() == FATAL)
       {
 #ifdef __ANDROID__
         // Set the bionic abort message early to avoid liblog doing it
         // with the individual lines, so that we get the whole message.
-        android_set_abort_message(msg.c_str());
+        android_set_abort_message(msg);
 #endif
       }
 
+      // The thread and time are only filled in for loggers that need them.
+      LogLineContext context = {0, LogLineTime(), nullptr, 0, nullptr, 0};
+      if (fields.size() != 0)
+      {
+        context.fields = fields.data();
+        context.fields_size = fields.size();
+        context.msg = msg;
+        context.text_size = text_size;
+      }
+      if (to_sinks)
+      {
+        PushToLogSinks(context, data_->GetFile(), data_->GetLineNumber(), data_->GetId(),
+                       data_->GetSeverity(), data_->GetTag(), msg, msg_size);
+      }
+      if (!would_log)
+      {
+        return;
+      }
+
+      AsyncLogger *async_logger = gAsyncLogger.load(std::memory_order_acquire);
+      if (async_logger != nullptr && !gIsLogDrainThread && data_->GetSeverity() != FATAL)
+      {
+        async_logger->Push(StampLogLineContext(context), data_->GetFile(),
+                           data_->GetLineNumber(), data_->GetId(), data_->GetSeverity(),
+                           data_->GetTag(), msg, msg_size);
+        return;
+      }
+      if (data_->GetSeverity() == FATAL)
+      {
+        // Everything logged before the FATAL message must be out before we abort.
+        FlushLogs();
+      }
+
       {
         // Do the actual logging with the lock held.
         std::lock_guard<std::mutex> lock(LoggingLock());
-        if (msg.find('\n') == std::string::npos)
+        // Only loggers that encode the fields need the context here.
+        const LogLineContext *saved_context = gLogLineContext;
+        if (fields.size() != 0)
         {
-          LogLine(data_->GetFile(), data_->GetLineNumber(), data_->GetId(), data_->GetSeverity(),
-                  data_->GetTag(), msg.c_str());
-        }
-        else
-        {
-          msg += '\n';
-          size_t i = 0;
-          while (i < msg.size())
-          {
-            size_t nl = msg.find('\n', i);
-            msg[nl] = '\0';
-            LogLine(data_->GetFile(), data_->GetLineNumber(), data_->GetId(), data_->GetSeverity(),
-                    data_->GetTag(), &msg[i]);
-            // Undo the zero-termination so we can give the complete message to the aborter.
-            msg[nl] = '\n';
-            i = nl + 1;
-          }
+          context = StampLogLineContext(context);
+          gLogLineContext = &context;
         }
+        LogMessageLines(data_->GetFile(), data_->GetLineNumber(), data_->GetId(),
+                        data_->GetSeverity(), data_->GetTag(), msg, msg_size);
+        gLogLineContext = saved_context;
       }
 
       // Abort if necessary.
       if (data_->GetSeverity() == FATAL)
       {
-        Aborter()(msg.c_str());
+        Aborter()(msg);
       }
     }
 
-    std::ostream &LogMessage::stream()
+    LogStream &LogMessage::stream()
     {
       return data_->GetBuffer();
     }
@@ -647,41 +2942,57 @@ namespace cpputils
     void LogMessage::LogLine(const char *file, unsigned int line, LogId id, LogSeverity severity,
                              const char *tag, const char *message)
     {
-      if (tag == nullptr)
-      {
-        std::lock_guard<std::recursive_mutex> lock(TagLock());
-        if (gDefaultTag == nullptr)
-        {
-          gDefaultTag = new std::string(getprogname());
-        }
-        Logger()(id, severity, gDefaultTag->c_str(), file, line, message);
-      }
-      else
-      {
-        Logger()(id, severity, tag, file, line, message);
-      }
+      Logger()(id, severity, (tag != nullptr) ? tag : DefaultTag(), file, line, message);
     }
 
     LogSeverity GetMinimumLogSeverity()
     {
-      return gMinimumLogSeverity;
+      return gMinimumLogSeverity.load(std::memory_order_relaxed);
     }
 
     LogSeverity SetMinimumLogSeverity(LogSeverity new_severity)
     {
-      LogSeverity old_severity = gMinimumLogSeverity;
-      gMinimumLogSeverity = new_severity;
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      LogSeverity old_severity = gMinimumLogSeverity.exchange(new_severity, std::memory_order_relaxed);
+      BumpLogSeverityGenerationLocked();
       return old_severity;
     }
 
-    ScopedLogSeverity::ScopedLogSeverity(LogSeverity new_severity)
+    void SetTagLogSeverity(const std::string &tag, LogSeverity severity)
     {
-      old_ = SetMinimumLogSeverity(new_severity);
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      GetLogSeverityOverrides().tags[tag] = severity;
+      gHaveLogSeverityOverrides.store(true, std::memory_order_relaxed);
+      BumpLogSeverityGenerationLocked();
     }
 
-    ScopedLogSeverity::~ScopedLogSeverity()
+    void SetFileLogSeverity(const std::string &pattern, LogSeverity severity)
     {
-      SetMinimumLogSeverity(old_);
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      std::vector<std::pair<std::string, LogSeverity>> &files = GetLogSeverityOverrides().files;
+      auto it = std::find_if(files.begin(), files.end(),
+                             [&](const std::pair<std::string, LogSeverity> &file) {
+                               return file.first == pattern;
+                             });
+      if (it != files.end())
+      {
+        it->second = severity;
+      }
+      else
+      {
+        files.emplace_back(pattern, severity);
+      }
+      gHaveLogSeverityOverrides.store(true, std::memory_order_relaxed);
+      BumpLogSeverityGenerationLocked();
+    }
+
+    void ClearLogSeverityOverrides()
+    {
+      std::lock_guard<std::mutex> lock(LogSeverityLock());
+      GetLogSeverityOverrides().tags.clear();
+      GetLogSeverityOverrides().files.clear();
+      gHaveLogSeverityOverrides.store(false, std::memory_order_relaxed);
+      BumpLogSeverityGenerationLocked();
     }
 
   } // namespace base
@@ -0,0 +1,279 @@
+#include "cpputils-base/metrics.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#include "cpputils-base/file.h"
+#include "cpputils-base/logging.h"
+#include "cpputils-base/stringprintf.h"
+
+namespace cpputils {
+namespace base {
+
+namespace metrics_internal {
+
+size_t NextShardIndex() {
+  static std::atomic<size_t> next(0);
+  return next.fetch_add(1, std::memory_order_relaxed) % kShards;
+}
+
+ShardedValue::ShardedValue() {
+  for (Shard& shard : shards_) shard.value.store(0, std::memory_order_relaxed);
+}
+
+int64_t ShardedValue::Sum() const {
+  int64_t sum = 0;
+  for (const Shard& shard : shards_) sum += shard.value.load(std::memory_order_relaxed);
+  return sum;
+}
+
+}  // namespace metrics_internal
+
+constexpr int Histogram::kSubBucketBits;
+constexpr size_t Histogram::kBuckets;
+
+static constexpr size_t kSubBuckets = size_t(1) << Histogram::kSubBucketBits;
+
+void HistogramSnapshot::Merge(const HistogramSnapshot& other) {
+  if (other.count == 0) return;
+  if (count == 0) {
+    *this = other;
+    return;
+  }
+  for (size_t i = 0; i < buckets.size(); ++i) buckets[i] += other.buckets[i];
+  count += other.count;
+  sum += other.sum;
+  min = std::min(min, other.min);
+  max = std::max(max, other.max);
+}
+
+int64_t HistogramSnapshot::Percentile(double percentile) const {
+  if (count == 0) return 0;
+  if (percentile <= 0) return min;
+  if (percentile >= 100) return max;
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(percentile / 100 * count));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      // The middle of the bucket is at most half a bucket off.
+      int64_t lower = Histogram::BucketLowerBound(i);
+      int64_t value = lower + (Histogram::BucketUpperBound(i) - lower) / 2;
+      return std::min(std::max(value, min), max);
+    }
+  }
+  return max;
+}
+
+Histogram::Histogram()
+    : sum_(0),
+      min_(std::numeric_limits<int64_t>::max()),
+      max_(std::numeric_limits<int64_t>::min()) {
+  for (std::atomic<uint64_t>& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+}
+
+size_t Histogram::BucketIndex(int64_t value) {
+  if (value < static_cast<int64_t>(kSubBuckets)) return value < 0 ? 0 : value;
+  // Values in [2^e, 2^(e+1)) go into the upper half of the sub-buckets, each
+  // 2^(e - kSubBucketBits + 1) wide.
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - kSubBucketBits + 1;
+  return (static_cast<size_t>(shift) << (kSubBucketBits - 1)) + (value >> shift);
+}
+
+int64_t Histogram::BucketLowerBound(size_t bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  int shift = static_cast<int>(bucket >> (kSubBucketBits - 1)) - 1;
+  uint64_t sub_bucket = (kSubBuckets / 2) + (bucket & (kSubBuckets / 2 - 1));
+  return sub_bucket << shift;
+}
+
+int64_t Histogram::BucketUpperBound(size_t bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  int shift = static_cast<int>(bucket >> (kSubBucketBits - 1)) - 1;
+  return BucketLowerBound(bucket) + ((int64_t(1) << shift) - 1);
+}
+
+void Histogram::Record(int64_t value) {
+  if (value < 0) value = 0;
+  buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  // New extremes are rare, so these are mostly just loads.
+  int64_t min = min_.load(std::memory_order_relaxed);
+  while (value < min && !min_.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+  }
+  int64_t max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+HistogramSnapshot Histogram::Snapshot() const {
+  HistogramSnapshot snapshot;
+  snapshot.buckets.resize(kBuckets);
+  // The count is taken from the buckets, so that it always agrees with them.
+  for (size_t i = 0; i < kBuckets; ++i) {
+    snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    snapshot.count += snapshot.buckets[i];
+  }
+  if (snapshot.count == 0) return HistogramSnapshot();
+  snapshot.sum = sum_.load(std::memory_order_relaxed);
+  snapshot.min = min_.load(std::memory_order_relaxed);
+  snapshot.max = max_.load(std::memory_order_relaxed);
+  // A value being recorded is counted in its bucket before it updates the
+  // extremes, which may still be unset.
+  if (snapshot.min > snapshot.max) {
+    size_t first = 0;
+    while (snapshot.buckets[first] == 0) ++first;
+    size_t last = kBuckets - 1;
+    while (snapshot.buckets[last] == 0) --last;
+    snapshot.min = BucketLowerBound(first);
+    snapshot.max = BucketUpperBound(last);
+  }
+  return snapshot;
+}
+
+template <typename T>
+struct MetricMap {
+  std::mutex lock;
+  std::map<std::string, T*> metrics;
+
+  T& Get(const std::string& name) {
+    std::lock_guard<std::mutex> guard(lock);
+    T*& metric = metrics[name];
+    if (metric == nullptr) metric = new T();
+    return *metric;
+  }
+};
+
+// Metrics are leaked, since threads may update them until the process exits.
+template <typename T>
+static MetricMap<T>& Metrics() {
+  static auto& metrics = *new MetricMap<T>();
+  return metrics;
+}
+
+Counter& GetCounter(const std::string& name) {
+  return Metrics<Counter>().Get(name);
+}
+
+Gauge& GetGauge(const std::string& name) {
+  return Metrics<Gauge>().Get(name);
+}
+
+Histogram& GetHistogram(const std::string& name) {
+  return Metrics<Histogram>().Get(name);
+}
+
+MetricsSnapshot SnapshotMetrics() {
+  MetricsSnapshot snapshot;
+  {
+    MetricMap<Counter>& counters = Metrics<Counter>();
+    std::lock_guard<std::mutex> guard(counters.lock);
+    for (const auto& it : counters.metrics) snapshot.counters[it.first] = it.second->Value();
+  }
+  {
+    MetricMap<Gauge>& gauges = Metrics<Gauge>();
+    std::lock_guard<std::mutex> guard(gauges.lock);
+    for (const auto& it : gauges.metrics) snapshot.gauges[it.first] = it.second->Value();
+  }
+  {
+    MetricMap<Histogram>& histograms = Metrics<Histogram>();
+    std::lock_guard<std::mutex> guard(histograms.lock);
+    for (const auto& it : histograms.metrics) {
+      snapshot.histograms[it.first] = it.second->Snapshot();
+    }
+  }
+  return snapshot;
+}
+
+std::string FormatMetrics(const MetricsSnapshot& snapshot) {
+  std::string out;
+  for (const auto& it : snapshot.counters) {
+    StringAppendF(&out, "counter %s %" PRId64 "\n", it.first.c_str(), it.second);
+  }
+  for (const auto& it : snapshot.gauges) {
+    StringAppendF(&out, "gauge %s %" PRId64 "\n", it.first.c_str(), it.second);
+  }
+  for (const auto& it : snapshot.histograms) {
+    const HistogramSnapshot& h = it.second;
+    StringAppendF(&out,
+                  "histogram %s count=%" PRIu64 " sum=%" PRId64 " min=%" PRId64 " max=%" PRId64
+                  " p50=%" PRId64 " p90=%" PRId64 " p99=%" PRId64 " p99.9=%" PRId64 "\n",
+                  it.first.c_str(), h.count, h.sum, h.min, h.max, h.Percentile(50),
+                  h.Percentile(90), h.Percentile(99), h.Percentile(99.9));
+  }
+  return out;
+}
+
+bool WriteMetrics(int fd) {
+  std::string text = FormatMetrics(SnapshotMetrics());
+  return WriteFully(fd, text.data(), text.size());
+}
+
+bool WriteMetricsToFile(const std::string& path) {
+  unique_fd fd(
+      TEMP_FAILURE_RETRY(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)));
+  if (fd == -1) return false;
+  return WriteMetrics(fd.get());
+}
+
+MetricsServer::MetricsServer(unique_fd listen_fd) : listen_fd_(std::move(listen_fd)) {
+  if (!Pipe(&stop_read_fd_, &stop_write_fd_)) {
+    PLOG(ERROR) << "MetricsServer: pipe failed; not serving metrics";
+    return;
+  }
+  thread_ = std::thread(&MetricsServer::Run, this);
+}
+
+MetricsServer::~MetricsServer() {
+  if (!thread_.joinable()) return;
+  stop_write_fd_.reset();
+  thread_.join();
+}
+
+void MetricsServer::Run() {
+  pollfd fds[2] = {{listen_fd_.get(), POLLIN, 0}, {stop_read_fd_.get(), POLLIN, 0}};
+  while (true) {
+    if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1) {
+      PLOG(ERROR) << "MetricsServer: poll failed";
+      return;
+    }
+    // The write end of the pipe is closed to stop the server.
+    if (fds[1].revents != 0) return;
+    if (fds[0].revents & (POLLERR | POLLNVAL)) {
+      LOG(ERROR) << "MetricsServer: the listening socket failed";
+      return;
+    }
+    unique_fd client(TEMP_FAILURE_RETRY(accept4(listen_fd_.get(), nullptr, nullptr, SOCK_CLOEXEC)));
+    if (client == -1) {
+      PLOG(WARNING) << "MetricsServer: accept failed";
+      continue;
+    }
+    // Neither a client that stops reading nor one that hangs up may hold up
+    // the server or kill the process with SIGPIPE.
+    timeval timeout = {1, 0};
+    setsockopt(client.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string text = FormatMetrics(SnapshotMetrics());
+    for (size_t sent = 0; sent < text.size();) {
+      ssize_t n = TEMP_FAILURE_RETRY(
+          send(client.get(), text.data() + sent, text.size() - sent, MSG_NOSIGNAL));
+      if (n == -1) {
+        PLOG(WARNING) << "MetricsServer: send failed";
+        break;
+      }
+      sent += n;
+    }
+  }
+}
+
+}  // namespace base
+}  // namespace cpputils
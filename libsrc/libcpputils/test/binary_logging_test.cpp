@@ -0,0 +1,170 @@
+#include "cpputils-base/binary_logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpputils-base/file.h"
+#include "cpputils-base/strings.h"
+#include "cpputils-base/unique_fd.h"
+
+#include <gtest/gtest.h>
+
+using namespace cpputils::base;
+
+static bool Decode(const char* path, std::string* text) {
+  unique_fd fd(open(path, O_RDONLY | O_CLOEXEC));
+  TemporaryFile out;
+  bool result = DecodeBinaryLog(fd.get(), out.fd);
+  int saved_errno = errno;
+  ReadFileToString(out.path, text);
+  errno = saved_errno;
+  return result;
+}
+
+// Strips the "tag I 01-02 03:04:05  pid   tid file:line] " prefix.
+static std::vector<std::string> Messages(const std::string& text) {
+  std::vector<std::string> messages;
+  for (const std::string& line : Split(text, "\n")) {
+    if (line.empty()) continue;
+    size_t end = line.find("] ");
+    messages.push_back(end == std::string::npos ? line : line.substr(end + 2));
+  }
+  return messages;
+}
+
+enum class Color : uint8_t { kRed = 1 };
+
+TEST(binary_logging, round_trip) {
+  TemporaryFile tf;
+  ASSERT_TRUE(OpenBinaryLog(tf.path));
+  std::string name("alpha");
+  const char* no_string = nullptr;
+  BINLOG(INFO, "%d items in %.3f ms from %s", 42, 1.5, name.c_str());
+  BINLOG(WARNING, "%5u|%-4x|%llu|%lld|%c|%%", 7u, 255u, 18446744073709551615ull,
+         -9223372036854775807ll, 'z');
+  BINLOG(ERROR, "%*d|%.*s|%s|%d", 4, 3, 2, "abcdef", no_string, static_cast<int>(Color::kRed));
+  BINLOG(INFO, "first\nsecond");
+  BINLOG(INFO, "no arguments");
+  CloseBinaryLog();
+  BINLOG(INFO, "not recorded after close");
+
+  std::string text;
+  ASSERT_TRUE(Decode(tf.path, &text)) << strerror(errno);
+  std::vector<std::string> messages = Messages(text);
+  std::vector<std::string> expected = {
+      "42 items in 1.500 ms from alpha",
+      "    7|ff  |18446744073709551615|-9223372036854775807|z|%",
+      "   3|ab|(null)|1",
+      "first",
+      "second",
+      "no arguments",
+  };
+  EXPECT_EQ(expected, messages);
+  EXPECT_NE(std::string::npos, text.find(" I ")) << text;
+  EXPECT_NE(std::string::npos, text.find(" W ")) << text;
+  EXPECT_NE(std::string::npos, text.find("binary_logging_test.cpp:")) << text;
+}
+
+TEST(binary_logging, respects_minimum_severity) {
+  TemporaryFile tf;
+  ASSERT_TRUE(OpenBinaryLog(tf.path));
+  {
+    ScopedLogSeverity sls(WARNING);
+    BINLOG(INFO, "dropped %d", 1);
+    BINLOG(WARNING, "kept %d", 2);
+  }
+  CloseBinaryLog();
+
+  std::string text;
+  ASSERT_TRUE(Decode(tf.path, &text));
+  EXPECT_EQ(std::vector<std::string>{"kept 2"}, Messages(text));
+}
+
+static void LogFromSharedSite(int i) {
+  BINLOG(INFO, "shared site %d", i);
+}
+
+TEST(binary_logging, reopen_redefines_formats) {
+  TemporaryFile first;
+  ASSERT_TRUE(OpenBinaryLog(first.path));
+  LogFromSharedSite(1);
+  TemporaryFile second;
+  ASSERT_TRUE(OpenBinaryLog(second.path));
+  LogFromSharedSite(2);
+  CloseBinaryLog();
+
+  std::string text;
+  ASSERT_TRUE(Decode(first.path, &text));
+  EXPECT_EQ(std::vector<std::string>{"shared site 1"}, Messages(text));
+  ASSERT_TRUE(Decode(second.path, &text));
+  EXPECT_EQ(std::vector<std::string>{"shared site 2"}, Messages(text));
+}
+
+TEST(binary_logging, threads_and_large_records) {
+  TemporaryFile tf;
+  ASSERT_TRUE(OpenBinaryLog(tf.path));
+  constexpr int kThreads = 4;
+  constexpr int kCount = 5000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < kCount; ++i) {
+        BINLOG(INFO, "thread %d message %d", t, i);
+      }
+    });
+  }
+  std::string big(100 * 1024, 'x');
+  BINLOG(INFO, "%s", big.c_str());
+  for (std::thread& thread : threads) thread.join();
+  CloseBinaryLog();
+
+  std::string text;
+  ASSERT_TRUE(Decode(tf.path, &text));
+  std::vector<int> next(kThreads, 0);
+  bool saw_big = false;
+  for (const std::string& message : Messages(text)) {
+    int t, i;
+    if (sscanf(message.c_str(), "thread %d message %d", &t, &i) == 2) {
+      ASSERT_EQ(next[t], i);
+      ++next[t];
+    } else {
+      EXPECT_EQ(big, message);
+      saw_big = true;
+    }
+  }
+  EXPECT_TRUE(saw_big);
+  EXPECT_EQ(std::vector<int>(kThreads, kCount), next);
+}
+
+TEST(binary_logging, truncated_log) {
+  TemporaryFile tf;
+  ASSERT_TRUE(OpenBinaryLog(tf.path));
+  BINLOG(INFO, "complete");
+  BINLOG(INFO, "cut short");
+  CloseBinaryLog();
+  struct stat sb;
+  ASSERT_EQ(0, stat(tf.path, &sb));
+  ASSERT_EQ(0, truncate(tf.path, sb.st_size - 2));
+
+  std::string text;
+  errno = 0;
+  ASSERT_FALSE(Decode(tf.path, &text));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(std::vector<std::string>{"complete"}, Messages(text));
+}
+
+TEST(binary_logging, not_a_binary_log) {
+  TemporaryFile tf;
+  ASSERT_TRUE(WriteStringToFile("hello, world\n", tf.path));
+  std::string text;
+  errno = 0;
+  ASSERT_FALSE(Decode(tf.path, &text));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ("", text);
+}
@@ -16,6 +16,7 @@
 
 #include "cpputils-base/chrono_utils.h"
 
+#include <stdlib.h>
 #include <time.h>
 
 #include <chrono>
@@ -23,6 +24,8 @@
 #include <string>
 #include <thread>
 
+#include "cpputils-base/metrics.h"
+
 #include <gtest/gtest.h>
 
 namespace cpputils {
@@ -76,5 +79,120 @@ TEST(ChronoUtilsTest, TimerOstream) {
   ExpectAboutEqual(stop_timer, stop_timer_from_stream);
 }
 
+TEST(ChronoUtilsTest, TscClockAgreesWithBootClock) {
+  tsc_clock::now();  // Calibrates the counter.
+  auto boot_start = boot_clock::now();
+  auto tsc_start = tsc_clock::now();
+  std::this_thread::sleep_for(50ms);
+  auto tsc_elapsed = tsc_clock::now() - tsc_start;
+  auto boot_elapsed = boot_clock::now() - boot_start;
+  ExpectAboutEqual(boot_elapsed.count(), tsc_elapsed.count());
+}
+
+TEST(ChronoUtilsTest, TscClockIsMonotonic) {
+  auto previous = tsc_clock::now();
+  for (int i = 0; i < 100000; ++i) {
+    auto now = tsc_clock::now();
+    ASSERT_LE(previous, now);
+    previous = now;
+  }
+}
+
+TEST(ChronoUtilsTest, TscClockUsesCounterOnX86) {
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+  // The fallback to boot_clock is for x86 CPUs without an invariant counter.
+  if (!tsc_clock::uses_counter()) {
+    GTEST_LOG_(INFO) << "no invariant TSC, tsc_clock uses boot_clock";
+  }
+#else
+  EXPECT_FALSE(tsc_clock::uses_counter());
+#endif
+  EXPECT_EQ(0, tsc_clock::to_nanoseconds(0));
+}
+
+TEST(ChronoUtilsTest, MulShift32Split) {
+  using chrono_internal::MulShift32Split;
+  // What 32-bit targets use in place of a 128-bit product.
+  EXPECT_EQ(0U, MulShift32Split(0, UINT64_MAX));
+  EXPECT_EQ(12345U, MulShift32Split(12345, uint64_t(1) << 32));
+  EXPECT_EQ(UINT64_MAX, MulShift32Split(UINT64_MAX, uint64_t(1) << 32));
+  EXPECT_EQ(uint64_t(1000000000) * 41, MulShift32Split(1000000000, uint64_t(41) << 32));
+#if defined(__SIZEOF_INT128__)
+  uint64_t a = 0x9e3779b97f4a7c15;
+  uint64_t b = 0xbf58476d1ce4e5b9;
+  for (int i = 0; i < 10000; ++i) {
+    a = a * 6364136223846793005 + 1442695040888963407;
+    b = b * 6364136223846793005 + 1442695040888963407;
+    uint64_t x = a >> (i % 64);
+    uint64_t y = b >> ((i / 64) % 64);
+    ASSERT_EQ(static_cast<uint64_t>((static_cast<unsigned __int128>(x) * y) >> 32),
+              MulShift32Split(x, y))
+        << x << " " << y;
+  }
+#endif
+}
+
+TEST(ChronoUtilsTest, ScopedTimer) {
+  Counter counter;
+  Histogram histogram;
+  for (int i = 0; i < 2; ++i) {
+    ScopedTimer counter_timer(counter);
+    ScopedTimer histogram_timer(histogram);
+    std::this_thread::sleep_for(10ms);
+  }
+  EXPECT_GE(counter.Value(), 20000000);
+  EXPECT_LT(counter.Value(), 1000000000);
+  HistogramSnapshot snapshot = histogram.Snapshot();
+  EXPECT_EQ(2U, snapshot.count);
+  EXPECT_GE(snapshot.min, 10000000 * 0.99);
+}
+
+// coarse_clock is CLOCK_MONOTONIC, as is steady_clock on Linux, read at the
+// last kernel tick.
+static void ExpectCoarseClockNear(std::chrono::steady_clock::time_point precise,
+                                  coarse_clock::time_point coarse) {
+  auto precise_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      precise.time_since_epoch());
+  EXPECT_LT(std::abs((precise_ns - coarse.time_since_epoch()).count()), 50000000);
+}
+
+TEST(ChronoUtilsTest, CoarseClock) {
+  ExpectCoarseClockNear(std::chrono::steady_clock::now(), coarse_clock::now());
+  auto wall = std::chrono::system_clock::now() - coarse_clock::system_now();
+  EXPECT_LT(std::abs(std::chrono::duration_cast<std::chrono::milliseconds>(wall).count()), 50);
+
+  auto start = coarse_clock::now();
+  std::this_thread::sleep_for(50ms);
+  auto elapsed =
+      std::chrono::duration_cast<std::chrono::milliseconds>(coarse_clock::now() - start).count();
+  EXPECT_GE(elapsed, 40);
+  EXPECT_LT(elapsed, 1000);
+}
+
+TEST(ChronoUtilsTest, CoarseClockTicker) {
+  ASSERT_TRUE(coarse_clock::StartTicker(std::chrono::microseconds(200)));
+  EXPECT_FALSE(coarse_clock::StartTicker());
+  ExpectCoarseClockNear(std::chrono::steady_clock::now(), coarse_clock::now());
+  auto wall = std::chrono::system_clock::now() - coarse_clock::system_now();
+  EXPECT_LT(std::abs(std::chrono::duration_cast<std::chrono::milliseconds>(wall).count()), 50);
+
+  auto previous = coarse_clock::now();
+  auto start = previous;
+  while (coarse_clock::now() == start) std::this_thread::yield();
+  for (int i = 0; i < 1000; ++i) {
+    auto now = coarse_clock::now();
+    ASSERT_LE(previous, now);
+    previous = now;
+  }
+  coarse_clock::StopTicker();
+  coarse_clock::StopTicker();
+  // The clock never goes back, even though the coarse clock lags the ticker.
+  EXPECT_LE(previous, coarse_clock::now());
+  ExpectCoarseClockNear(std::chrono::steady_clock::now(), coarse_clock::now());
+
+  ASSERT_TRUE(coarse_clock::StartTicker());
+  coarse_clock::StopTicker();
+}
+
 }  // namespace base
 }  // namespace cpputils
@@ -15,6 +15,7 @@
  */
 
 #include "cpputils-base/file.h"
+#include "cpputils-base/unique_fd.h"
 
 #include <gtest/gtest.h>
 
@@ -22,9 +23,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #if !defined(_WIN32)
+#include <dirent.h>
 #include <pwd.h>
 #endif
 
@@ -86,6 +93,101 @@ TEST(file, WriteStringToFile2) {
 }
 #endif
 
+#if !defined(_WIN32)
+// The names of the entries in `dir`, other than "." and "..".
+static std::vector<std::string> DirEntries(const std::string& dir) {
+  std::vector<std::string> entries;
+  std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(dir.c_str()), closedir);
+  while (dirent* e = readdir(d.get())) {
+    if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) entries.push_back(e->d_name);
+  }
+  return entries;
+}
+
+TEST(file, WriteStringToFileAtomic) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/config";
+  cpputils::base::AtomicWriteOptions options;
+  options.mode = 0600;
+  ASSERT_TRUE(cpputils::base::WriteStringToFileAtomic("first", path, options)) << strerror(errno);
+  std::string s;
+  ASSERT_TRUE(cpputils::base::ReadFileToString(path, &s));
+  EXPECT_EQ("first", s);
+  struct stat sb;
+  ASSERT_EQ(0, stat(path.c_str(), &sb));
+  EXPECT_EQ(0600U, sb.st_mode & 0777);
+
+  // A file that is open keeps the old content; the new one replaces it.
+  cpputils::base::unique_fd old_fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  options.durable = false;
+  ASSERT_TRUE(cpputils::base::WriteStringToFileAtomic("second", path, options));
+  ASSERT_TRUE(cpputils::base::ReadFileToString(path, &s));
+  EXPECT_EQ("second", s);
+  ASSERT_TRUE(cpputils::base::ReadFdToString(old_fd, &s));
+  EXPECT_EQ("first", s);
+
+  // No temporary files are left behind.
+  EXPECT_EQ(std::vector<std::string>{"config"}, DirEntries(td.path));
+
+  errno = 0;
+  ASSERT_FALSE(cpputils::base::WriteStringToFileAtomic("x", std::string(td.path) + "/no/such"));
+  EXPECT_EQ(ENOENT, errno);
+  // Directories are not replaced by files.
+  ASSERT_EQ(0, mkdir((std::string(td.path) + "/dir").c_str(), 0700));
+  ASSERT_FALSE(cpputils::base::WriteStringToFileAtomic("x", std::string(td.path) + "/dir"));
+  EXPECT_EQ(EISDIR, errno);
+  EXPECT_EQ(2U, DirEntries(td.path).size());
+}
+
+TEST(file, WriteStringToFileAtomic_is_never_seen_half_written) {
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/state";
+  const std::string a(256 * 1024, 'a');
+  const std::string b(256 * 1024, 'b');
+  cpputils::base::AtomicWriteOptions options;
+  options.durable = false;
+  ASSERT_TRUE(cpputils::base::WriteStringToFileAtomic(a, path, options));
+
+  std::atomic<bool> done(false);
+  std::thread writer([&] {
+    for (int i = 0; i < 50; ++i) {
+      EXPECT_TRUE(cpputils::base::WriteStringToFileAtomic((i % 2) ? a : b, path, options));
+    }
+    done = true;
+  });
+  while (!done) {
+    std::string s;
+    ASSERT_TRUE(cpputils::base::ReadFileToString(path, &s));
+    ASSERT_TRUE(s == a || s == b);
+  }
+  writer.join();
+}
+
+TEST(file, WriteStringToFileAtomic_group_commit) {
+  TemporaryDir td;
+  cpputils::base::AtomicWriteOptions options;
+  options.group_commit = true;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&td, &options, t] {
+      std::string path = std::string(td.path) + "/file" + std::to_string(t);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_TRUE(cpputils::base::WriteStringToFileAtomic(std::to_string(i), path, options))
+            << strerror(errno);
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (int t = 0; t < 8; ++t) {
+    std::string s;
+    ASSERT_TRUE(
+        cpputils::base::ReadFileToString(std::string(td.path) + "/file" + std::to_string(t), &s));
+    EXPECT_EQ("4", s);
+  }
+  EXPECT_EQ(8U, DirEntries(td.path).size());
+}
+#endif
+
 TEST(file, WriteStringToFd) {
   TemporaryFile tf;
   ASSERT_TRUE(tf.fd != -1);
@@ -98,6 +200,64 @@ TEST(file, WriteStringToFd) {
   EXPECT_EQ("abc", s);
 }
 
+TEST(file, ReadFdToString_from_the_current_offset) {
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  ASSERT_TRUE(cpputils::base::WriteStringToFd("abcdef", tf.fd));
+  ASSERT_EQ(2, lseek(tf.fd, 2, SEEK_SET)) << strerror(errno);
+
+  std::string s;
+  ASSERT_TRUE(cpputils::base::ReadFdToString(tf.fd, &s)) << strerror(errno);
+  EXPECT_EQ("cdef", s);
+  // Only the size from the offset on was reserved, which may still fit in the
+  // small-string buffer.
+  EXPECT_LE(s.capacity(), std::max<size_t>(std::string().capacity(), 16));
+
+  // At the end of the file there's nothing left to read.
+  ASSERT_TRUE(cpputils::base::ReadFdToString(tf.fd, &s)) << strerror(errno);
+  EXPECT_EQ("", s);
+}
+
+#if !defined(_WIN32)
+TEST(file, ReadFdToString_size_hint) {
+  // Pipes have no size, so only the hint says what to expect, and it may be
+  // wrong either way.
+  const std::string content(100000, 'x');
+  for (size_t hint : {size_t(0), size_t(10), content.size(), 10 * content.size()}) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds)) << strerror(errno);
+    std::thread writer([&content, &fds] {
+      cpputils::base::WriteStringToFd(content, fds[1]);
+      close(fds[1]);
+    });
+    std::string s("old content");
+    ASSERT_TRUE(cpputils::base::ReadFdToString(fds[0], &s, hint)) << strerror(errno);
+    writer.join();
+    close(fds[0]);
+    EXPECT_EQ(content, s) << hint;
+  }
+
+  // Regular files are read to the end whatever the hint says.
+  TemporaryFile tf;
+  ASSERT_TRUE(tf.fd != -1);
+  ASSERT_TRUE(cpputils::base::WriteStringToFd(content, tf.fd));
+  ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET)) << strerror(errno);
+  std::string s;
+  ASSERT_TRUE(cpputils::base::ReadFdToString(tf.fd, &s, 10)) << strerror(errno);
+  EXPECT_EQ(content, s);
+}
+#endif
+
+#if defined(__linux__)
+TEST(file, ReadFileToString_proc) {
+  // /proc files claim to be empty.
+  std::string s;
+  ASSERT_TRUE(cpputils::base::ReadFileToString("/proc/self/maps", &s)) << strerror(errno);
+  EXPECT_NE(std::string::npos, s.find("[stack]")) << s;
+  EXPECT_EQ('\n', s.back());
+}
+#endif
+
 TEST(file, WriteFully) {
   TemporaryFile tf;
   ASSERT_TRUE(tf.fd != -1);
@@ -0,0 +1,47 @@
+// Builds LOG statements with a compile-time severity floor.
+#define CPPUTILS_MIN_LOG_SEVERITY WARNING
+
+#include "cpputils-base/logging.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace cpputils::base;
+
+static std::vector<std::string> gLines;
+
+static void CollectLine(LogId, LogSeverity, const char*, const char*, unsigned int,
+                        const char* message) {
+  gLines.push_back(message);
+}
+
+static int Evaluated(int* count) {
+  ++*count;
+  return *count;
+}
+
+TEST(logging_min_severity, statements_below_the_floor_are_compiled_out) {
+  static_assert(kMinCompiledLogSeverity == WARNING, "CPPUTILS_MIN_LOG_SEVERITY is ignored");
+  gLines.clear();
+  SetLogger(CollectLine);
+  ScopedLogSeverity sls(VERBOSE);
+
+  int count = 0;
+  LOG(INFO) << "info " << Evaluated(&count);
+  PLOG(DEBUG) << "debug " << Evaluated(&count);
+  LOG_EVERY_N(VERBOSE, 1) << "verbose " << Evaluated(&count);
+  LogSeverity runtime_severity = INFO;
+  LOG_TO(DEFAULT, runtime_severity) << "runtime info " << Evaluated(&count);
+  LOG(WARNING) << "warning";
+  LOG(ERROR) << "error";
+  EXPECT_EQ(0, count);
+  EXPECT_EQ((std::vector<std::string>{"warning", "error"}), gLines);
+
+  EXPECT_FALSE(WOULD_LOG(INFO));
+  EXPECT_TRUE(WOULD_LOG(WARNING));
+  EXPECT_TRUE(WOULD_LOG(FATAL));
+
+  SetLogger(StderrLogger);
+}
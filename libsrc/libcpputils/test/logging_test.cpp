@@ -17,16 +17,25 @@
 #include "cpputils-base/logging.h"
 
 #include <libgen.h>
-
-#if defined(_WIN32)
 #include <signal.h>
-#endif
-
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "cpputils-base/file.h"
 #include "cpputils-base/stringprintf.h"
+#include "cpputils-base/strings.h"
 #include "cpputils-base/test_utils.h"
 
 #include <gtest/gtest.h>
@@ -723,4 +732,992 @@ TEST(logging, StdioLogger)
   // Whereas ERROR logging includes the program name.
   ASSERT_EQ(cpputils::base::Basename(cpputils::base::GetExecutablePath()) + ": err\n", cap_err.str());
 }
-*/
\ No newline at end of file
+*/
+namespace
+{
+  // Collects every line handed to the logger, for tests that swap it in with
+  // SetLogger().
+  struct CollectingLogger
+  {
+    static void Log(cpputils::base::LogId, cpputils::base::LogSeverity, const char *,
+                    const char *, unsigned int, const char *message)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lines.push_back(message);
+    }
+    static void Reset()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lines.clear();
+    }
+    static std::mutex mutex;
+    static std::vector<std::string> lines;
+  };
+  std::mutex CollectingLogger::mutex;
+  std::vector<std::string> CollectingLogger::lines;
+} // namespace
+
+TEST(logging, AsyncLogging_FlushLogs_delivers_everything_in_order)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  cpputils::base::AsyncLoggingOptions options;
+  options.queue_capacity = 16;
+  cpputils::base::EnableAsyncLogging(options);
+
+  constexpr int kThreads = 4;
+  constexpr int kMessages = 500;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t)
+  {
+    threads.emplace_back([t]() {
+      for (int i = 0; i < kMessages; ++i)
+      {
+        LOG(INFO) << t << " " << i;
+      }
+    });
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  LOG(INFO) << "two\nlines";
+  cpputils::base::FlushLogs();
+  cpputils::base::DisableAsyncLogging();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  ASSERT_EQ(static_cast<size_t>(kThreads * kMessages + 2), CollectingLogger::lines.size());
+  std::vector<int> next(kThreads, 0);
+  for (size_t i = 0; i < kThreads * kMessages; ++i)
+  {
+    int t, n;
+    ASSERT_EQ(2, sscanf(CollectingLogger::lines[i].c_str(), "%d %d", &t, &n));
+    EXPECT_EQ(next[t]++, n) << "messages of one thread were reordered";
+  }
+  EXPECT_EQ("two", CollectingLogger::lines[kThreads * kMessages]);
+  EXPECT_EQ("lines", CollectingLogger::lines[kThreads * kMessages + 1]);
+}
+
+TEST(logging, AsyncLogging_Disable_while_logging_loses_nothing)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  cpputils::base::AsyncLoggingOptions options;
+  options.queue_capacity = 16;
+  constexpr int kThreads = 4;
+  constexpr int kMessages = 2000;
+  std::atomic<int> running(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t)
+  {
+    threads.emplace_back([&running]() {
+      for (int i = 0; i < kMessages; ++i)
+      {
+        LOG(INFO) << i;
+      }
+      --running;
+    });
+  }
+  // Producers race with loggers being stopped, and so do stale flushes.
+  std::thread flusher([&running]() {
+    while (running.load() > 0)
+    {
+      cpputils::base::FlushLogs();
+    }
+  });
+  while (running.load() > 0)
+  {
+    cpputils::base::EnableAsyncLogging(options);
+    std::this_thread::yield();
+    cpputils::base::DisableAsyncLogging();
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  flusher.join();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  EXPECT_EQ(static_cast<size_t>(kThreads * kMessages), CollectingLogger::lines.size());
+}
+
+TEST(logging, AsyncLogging_drop_newest)
+{
+  static std::mutex gate;
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger([](cpputils::base::LogId id, cpputils::base::LogSeverity severity,
+                               const char *tag, const char *file, unsigned int line,
+                               const char *message) {
+    std::lock_guard<std::mutex> lock(gate);
+    CollectingLogger::Log(id, severity, tag, file, line, message);
+  });
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  cpputils::base::AsyncLoggingOptions options;
+  options.queue_capacity = 4;
+  options.overflow_policy = cpputils::base::LogOverflowPolicy::kDropNewest;
+  {
+    // Stall the drain thread so that the queue overflows.
+    std::lock_guard<std::mutex> lock(gate);
+    cpputils::base::EnableAsyncLogging(options);
+    for (int i = 0; i < 100; ++i)
+    {
+      LOG(INFO) << "message " << i;
+    }
+  }
+  cpputils::base::FlushLogs();
+  cpputils::base::DisableAsyncLogging();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  // At most one batch in flight plus a full queue got through, and the rest
+  // was reported as dropped.
+  size_t reports = 0;
+  for (const auto &line : CollectingLogger::lines)
+  {
+    if (line.find("log messages dropped") != std::string::npos)
+    {
+      reports++;
+    }
+  }
+  EXPECT_EQ(1U, reports);
+  EXPECT_LE(CollectingLogger::lines.size() - reports, 4U + 4U);
+  EXPECT_EQ("message 0", CollectingLogger::lines.front());
+}
+
+TEST(logging, AsyncLogging_FATAL_flushes_before_aborting)
+{
+  static size_t lines_seen_by_aborter;
+  lines_seen_by_aborter = 0;
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::SetAborter([](const char *) {
+    std::lock_guard<std::mutex> lock(CollectingLogger::mutex);
+    lines_seen_by_aborter = CollectingLogger::lines.size();
+  });
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  cpputils::base::EnableAsyncLogging();
+  for (int i = 0; i < 100; ++i)
+  {
+    LOG(INFO) << "message " << i;
+  }
+  LOG(FATAL) << "the end";
+  cpputils::base::DisableAsyncLogging();
+  cpputils::base::SetAborter(cpputils::base::DefaultAborter);
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  EXPECT_EQ(101U, lines_seen_by_aborter);
+  EXPECT_EQ("the end", CollectingLogger::lines.back());
+}
+
+TEST(logging, LogMessage_oversized_message_is_not_truncated)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  std::string big(100000, 'x');
+  LOG(INFO) << big << "end";
+  LOG(INFO) << "small";
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  ASSERT_EQ(2U, CollectingLogger::lines.size());
+  EXPECT_EQ(big + "end", CollectingLogger::lines[0]);
+  EXPECT_EQ("small", CollectingLogger::lines[1]);
+}
+
+TEST(logging, LogMessage_stream_state_does_not_leak_between_messages)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  LOG(INFO) << std::hex << std::showbase << 255 << " " << std::setprecision(2) << 3.14159;
+  LOG(INFO) << 255 << " " << 3.14159;
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  ASSERT_EQ(2U, CollectingLogger::lines.size());
+  EXPECT_EQ("0xff 3.1", CollectingLogger::lines[0]);
+  EXPECT_EQ("255 3.14159", CollectingLogger::lines[1]);
+}
+
+namespace
+{
+  struct LogsWhileStreamed
+  {
+  };
+  std::ostream &operator<<(std::ostream &os, const LogsWhileStreamed &)
+  {
+    LOG(INFO) << "inner";
+    return os << "outer";
+  }
+} // namespace
+
+TEST(logging, LogMessage_nested_LOG_in_operator_insertion)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  LOG(INFO) << LogsWhileStreamed();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  ASSERT_EQ(2U, CollectingLogger::lines.size());
+  EXPECT_EQ("inner", CollectingLogger::lines[0]);
+  EXPECT_EQ("outer", CollectingLogger::lines[1]);
+}
+
+// Returns what StderrLogger writes while `fn` runs, wherever it goes.
+static std::string StderrLoggerOutput(const std::function<void()> &fn)
+{
+#if defined(LOG_FILE)
+  std::string before;
+  cpputils::base::ReadFileToString(LOG_FILE, &before);
+  fn();
+  std::string content;
+  cpputils::base::ReadFileToString(LOG_FILE, &content);
+  return content.substr(before.size());
+#else
+  CapturedStderr cap;
+  fn();
+  cap.Stop();
+  return cap.str();
+#endif
+}
+
+// Returns the line StderrLogger writes for `message`.
+static std::string StderrLoggerLine(const char *message)
+{
+  return StderrLoggerOutput([message]() {
+    cpputils::base::StderrLogger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag",
+                                 "file.cpp", 1, message);
+  });
+}
+
+TEST(logging, StderrLogger_timestamp_formats)
+{
+  using cpputils::base::LogTimestampFormat;
+  const LogTimestampFormat old_format = cpputils::base::GetLogTimestampFormat();
+  const std::string suffix = R"( +\d+ +\d+ file\.cpp:1\] timestamp test\n$)";
+
+  cpputils::base::SetLogTimestampFormat(LogTimestampFormat::kWallClock);
+  EXPECT_MATCH(StderrLoggerLine("timestamp test"), R"(^tag I \d\d-\d\d \d\d:\d\d:\d\d)" + suffix);
+  cpputils::base::SetLogTimestampFormat(LogTimestampFormat::kWallClockMillis);
+  EXPECT_MATCH(StderrLoggerLine("timestamp test"),
+               R"(^tag I \d\d-\d\d \d\d:\d\d:\d\d\.\d{3})" + suffix);
+  cpputils::base::SetLogTimestampFormat(LogTimestampFormat::kWallClockMicros);
+  EXPECT_MATCH(StderrLoggerLine("timestamp test"),
+               R"(^tag I \d\d-\d\d \d\d:\d\d:\d\d\.\d{6})" + suffix);
+  cpputils::base::SetLogTimestampFormat(LogTimestampFormat::kMonotonic);
+  EXPECT_MATCH(StderrLoggerLine("timestamp test"), R"(^tag I +\d+\.\d{6})" + suffix);
+
+  cpputils::base::SetLogTimestampFormat(old_format);
+}
+
+TEST(logging, StderrLogger_cached_timestamp_follows_the_clock)
+{
+  using cpputils::base::LogTimestampFormat;
+  const LogTimestampFormat old_format = cpputils::base::GetLogTimestampFormat();
+  cpputils::base::SetLogTimestampFormat(LogTimestampFormat::kWallClockMillis);
+
+  // Lines logged across a second boundary must not reuse the old second.
+  std::regex timestamp_re(R"(^tag I (\d\d-\d\d \d\d:\d\d:\d\d)\.(\d{3}))");
+  std::string previous;
+  for (int i = 0; i < 3; ++i)
+  {
+    std::smatch match;
+    std::string line = StderrLoggerLine("tick");
+    ASSERT_TRUE(std::regex_search(line, match, timestamp_re)) << line;
+    std::string current = match[1].str() + "." + match[2].str();
+    EXPECT_LT(previous, current);
+    previous = current;
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+  }
+
+  cpputils::base::SetLogTimestampFormat(old_format);
+}
+
+TEST(logging, FileLogger_writes_StderrLogger_lines)
+{
+  TemporaryDir td;
+  cpputils::base::FileLoggerOptions options;
+  options.path = std::string(td.path) + "/sub/dir/log";
+  options.flush_interval = std::chrono::milliseconds(0);
+  cpputils::base::FileLogger logger(options);
+
+  logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 12, "first");
+  std::string content;
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path, &content));
+  EXPECT_EQ("", content); // Still buffered.
+
+  logger(cpputils::base::DEFAULT, cpputils::base::ERROR, "tag", "file.cpp", 13, "second");
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path, &content));
+  EXPECT_MATCH(content, R"(^tag I [^\n]+ file\.cpp:12\] first\n)"
+                        R"(tag E [^\n]+ file\.cpp:13\] second\n$)");
+
+  logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 14, "third");
+  logger.Flush();
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path, &content));
+  EXPECT_MATCH(content, R"(file\.cpp:14\] third\n$)");
+}
+
+TEST(logging, FileLogger_flushes_in_the_background)
+{
+  TemporaryDir td;
+  cpputils::base::FileLoggerOptions options;
+  options.path = std::string(td.path) + "/log";
+  options.flush_interval = std::chrono::milliseconds(10);
+  cpputils::base::FileLogger logger(options);
+
+  logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 1, "eventually");
+  std::string content;
+  for (int i = 0; i < 500 && content.empty(); ++i)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    cpputils::base::ReadFileToString(options.path, &content);
+  }
+  EXPECT_MATCH(content, R"(file\.cpp:1\] eventually\n$)");
+}
+
+TEST(logging, FileLogger_rotates)
+{
+  TemporaryDir td;
+  cpputils::base::FileLoggerOptions options;
+  options.path = std::string(td.path) + "/log";
+  options.max_file_size = 400;
+  options.max_rotated_files = 2;
+  options.flush_severity = cpputils::base::VERBOSE;
+  {
+    cpputils::base::FileLogger logger(options);
+    for (int i = 0; i < 100; ++i)
+    {
+      logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 1,
+             std::to_string(i).c_str());
+    }
+  }
+
+  std::string newest, older, oldest;
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path, &newest));
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path + ".1", &older));
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path + ".2", &oldest));
+  EXPECT_EQ(-1, access((options.path + ".3").c_str(), F_OK));
+  for (const std::string *content : {&newest, &older, &oldest})
+  {
+    EXPECT_LE(content->size(), options.max_file_size);
+    EXPECT_FALSE(content->empty());
+  }
+  EXPECT_MATCH(newest, R"(\] 99\n$)");
+  // The files hold consecutive lines, oldest first.
+  std::string all = oldest + older + newest;
+  std::regex number_re(R"(\] (\d+)\n)");
+  int expected = -1;
+  for (std::sregex_iterator it(all.begin(), all.end(), number_re), end; it != end; ++it)
+  {
+    int n = std::stoi((*it)[1].str());
+    if (expected != -1)
+    {
+      EXPECT_EQ(expected, n);
+    }
+    expected = n + 1;
+  }
+  EXPECT_EQ(100, expected);
+}
+
+TEST(logging, FileLogger_many_threads)
+{
+  TemporaryDir td;
+  cpputils::base::FileLoggerOptions options;
+  options.path = std::string(td.path) + "/log";
+  options.buffer_size = 4096;
+  options.max_file_size = 0;
+  std::string content;
+  {
+    cpputils::base::FileLogger logger(options);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+      threads.emplace_back([&logger] {
+        for (int i = 0; i < 2000; ++i)
+        {
+          logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 1, "line");
+        }
+      });
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+  }
+  ASSERT_TRUE(cpputils::base::ReadFileToString(options.path, &content));
+  EXPECT_EQ(8000, std::count(content.begin(), content.end(), '\n'));
+}
+
+static void LogAtEverySeverityFromOneSite()
+{
+  for (cpputils::base::LogSeverity severity :
+       {cpputils::base::VERBOSE, cpputils::base::DEBUG, cpputils::base::INFO,
+        cpputils::base::WARNING, cpputils::base::ERROR})
+  {
+    LOG_TO(DEFAULT, severity) << severity;
+  }
+}
+
+static std::vector<std::string> TakeCollectedLines()
+{
+  std::lock_guard<std::mutex> lock(CollectingLogger::mutex);
+  std::vector<std::string> lines;
+  lines.swap(CollectingLogger::lines);
+  return lines;
+}
+
+TEST(logging, SetFileLogSeverity)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::WARNING);
+
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"3", "4"}), TakeCollectedLines());
+
+  // The cached severity of the call site follows every change.
+  cpputils::base::SetFileLogSeverity("logging_te?t", cpputils::base::DEBUG);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"1", "2", "3", "4"}), TakeCollectedLines());
+
+  cpputils::base::SetFileLogSeverity("logging_te?t", cpputils::base::ERROR);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"4"}), TakeCollectedLines());
+
+  cpputils::base::ClearLogSeverityOverrides();
+  cpputils::base::SetFileLogSeverity("*test/logging_test.cpp", cpputils::base::VERBOSE);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"0", "1", "2", "3", "4"}), TakeCollectedLines());
+
+  cpputils::base::ClearLogSeverityOverrides();
+  cpputils::base::SetFileLogSeverity("some_other_file", cpputils::base::VERBOSE);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"3", "4"}), TakeCollectedLines());
+
+  cpputils::base::ClearLogSeverityOverrides();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, SetTagLogSeverity)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+  std::string old_default_tag = cpputils::base::GetDefaultTag();
+
+  // This file does not define LOG_TAG, so the default tag applies.
+  cpputils::base::SetDefaultTag("severity_test_tag");
+  cpputils::base::SetTagLogSeverity("severity_test_tag", cpputils::base::ERROR);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"4"}), TakeCollectedLines());
+
+  // Changing the default tag invalidates cached severities too.
+  cpputils::base::SetDefaultTag("another_tag");
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"2", "3", "4"}), TakeCollectedLines());
+
+  // File patterns win over tags.
+  cpputils::base::SetTagLogSeverity("another_tag", cpputils::base::ERROR);
+  cpputils::base::SetFileLogSeverity("logging_test", cpputils::base::WARNING);
+  LogAtEverySeverityFromOneSite();
+  EXPECT_EQ((std::vector<std::string>{"3", "4"}), TakeCollectedLines());
+
+  // LOG_STREAM skips the call-site check, but LogMessage honours overrides too.
+  LOG_STREAM(INFO) << "not logged";
+  LOG_STREAM(WARNING) << "logged";
+  EXPECT_EQ((std::vector<std::string>{"logged"}), TakeCollectedLines());
+
+  cpputils::base::ClearLogSeverityOverrides();
+  cpputils::base::SetDefaultTag(old_default_tag);
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, LOG_EVERY_N_and_LOG_FIRST_N)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  for (int i = 0; i < 10; ++i)
+  {
+    LOG_EVERY_N(INFO, 4) << "every " << i;
+    LOG_FIRST_N(INFO, 2) << "first " << i;
+    // Filtered out statements do not use up their quota.
+    LOG_FIRST_N(DEBUG, 1) << "debug " << i;
+  }
+  EXPECT_EQ((std::vector<std::string>{"every 0", "first 0", "first 1", "every 4", "every 8"}),
+            TakeCollectedLines());
+
+  // The statement is a single statement, so an if without braces still works.
+  bool flag = false;
+  if (flag)
+    LOG_EVERY_N(INFO, 1) << "then";
+  else
+    LOG_EVERY_N(INFO, 1) << "else";
+  EXPECT_EQ((std::vector<std::string>{"else"}), TakeCollectedLines());
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; ++i)
+      {
+        LOG_FIRST_N(INFO, 10) << "racing";
+      }
+    });
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  EXPECT_EQ(std::vector<std::string>(10, "racing"), TakeCollectedLines());
+
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, LOG_EVERY_T_and_LOG_RATELIMITED_report_suppressed_messages)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  auto log_every_t = [](int i) { LOG_EVERY_T(INFO, std::chrono::milliseconds(100)) << i; };
+  for (int i = 0; i < 5; ++i)
+  {
+    log_every_t(i);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  log_every_t(5);
+  EXPECT_EQ((std::vector<std::string>{"0", "[4 messages suppressed] 5"}), TakeCollectedLines());
+
+  // A burst of three, then one message per 100ms.
+  auto log_ratelimited = [](int i) { LOG_RATELIMITED(INFO, 10, 3) << i; };
+  for (int i = 0; i < 5; ++i)
+  {
+    log_ratelimited(i);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  log_ratelimited(5);
+  log_ratelimited(6);
+  EXPECT_EQ((std::vector<std::string>{"0", "1", "2", "[2 messages suppressed] 5"}),
+            TakeCollectedLines());
+
+  // No refill: exactly a burst of ten, however long the process runs.
+  auto log_burst_only = [](int i) { LOG_RATELIMITED(INFO, 0, 10) << i; };
+  for (int i = 0; i < 15; ++i)
+  {
+    log_burst_only(i);
+  }
+  std::vector<std::string> expected;
+  for (int i = 0; i < 10; ++i)
+  {
+    expected.push_back(std::to_string(i));
+  }
+  EXPECT_EQ(expected, TakeCollectedLines());
+
+  // A refill so slow that its interval saturates still allows the burst.
+  auto log_slow = [](int i) { LOG_RATELIMITED(INFO, 1e-12, 2) << i; };
+  for (int i = 0; i < 4; ++i)
+  {
+    log_slow(i);
+  }
+  EXPECT_EQ((std::vector<std::string>{"0", "1"}), TakeCollectedLines());
+
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, StderrLogger_writes_multi_line_messages_and_async_batches)
+{
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+  const std::string prefix = R"(I [-\d :.]+ +\d+ +\d+ logging_test\.cpp:\d+\] )";
+
+  std::string output = StderrLoggerOutput([]() { LOG(INFO) << "first\nsecond\n\nfourth"; });
+  EXPECT_MATCH(output, "^[^\n]* " + prefix + "first\n" +
+                           "[^\n]* " + prefix + "second\n" +
+                           "[^\n]* " + prefix + "\n" +
+                           "[^\n]* " + prefix + "fourth\n$");
+
+  output = StderrLoggerOutput([]() {
+    cpputils::base::EnableAsyncLogging();
+    for (int i = 0; i < 500; ++i)
+    {
+      LOG(INFO) << "async " << i << "\nsecond line " << i;
+    }
+    cpputils::base::DisableAsyncLogging();
+  });
+  std::vector<std::string> lines = cpputils::base::Split(output, "\n");
+  ASSERT_EQ(1001u, lines.size());
+  for (int i = 0; i < 500; ++i)
+  {
+    EXPECT_MATCH(lines[2 * i], prefix + "async " + std::to_string(i) + "$");
+    EXPECT_MATCH(lines[2 * i + 1], prefix + "second line " + std::to_string(i) + "$");
+  }
+}
+
+TEST(logging, AddLogSink_fans_out_with_per_sink_severity)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  std::mutex mutex;
+  std::vector<std::string> all, errors;
+  cpputils::base::LogSinkOptions error_options;
+  error_options.min_severity = cpputils::base::ERROR;
+  uint64_t all_id = cpputils::base::AddLogSink(
+      [&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *, const char *,
+          unsigned int, const char *message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        all.push_back(message);
+      });
+  uint64_t error_id = cpputils::base::AddLogSink(
+      [&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *, const char *,
+          unsigned int, const char *message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        errors.push_back(message);
+      },
+      error_options);
+
+  LOG(DEBUG) << "filtered";
+  LOG(INFO) << "info";
+  LOG(ERROR) << "error\nsecond line";
+  cpputils::base::FlushLogs();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ((std::vector<std::string>{"info", "error", "second line"}), all);
+    EXPECT_EQ((std::vector<std::string>{"error", "second line"}), errors);
+  }
+  EXPECT_EQ((std::vector<std::string>{"info", "error", "second line"}), TakeCollectedLines());
+
+  EXPECT_TRUE(cpputils::base::RemoveLogSink(all_id));
+  EXPECT_FALSE(cpputils::base::RemoveLogSink(all_id));
+  LOG(ERROR) << "after removal";
+  EXPECT_TRUE(cpputils::base::RemoveLogSink(error_id));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(3u, all.size());
+    EXPECT_EQ("after removal", errors.back());
+  }
+
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+  TakeCollectedLines();
+}
+
+TEST(logging, AddLogSink_below_the_minimum_log_severity)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::WARNING);
+
+  // Log once from the site below, so that it caches the old minimum.
+  auto log_debug = []() { LOG(DEBUG) << "debug"; };
+  log_debug();
+
+  std::vector<std::string> received;
+  cpputils::base::LogSinkOptions options;
+  options.min_severity = cpputils::base::DEBUG;
+  uint64_t id = cpputils::base::AddLogSink(
+      [&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *, const char *,
+          unsigned int, const char *message) { received.push_back(message); },
+      options);
+  LOG(VERBOSE) << "verbose";
+  log_debug();
+  LOG(WARNING) << "warning";
+  cpputils::base::RemoveLogSink(id);
+
+  EXPECT_EQ((std::vector<std::string>{"debug", "warning"}), received);
+  EXPECT_EQ((std::vector<std::string>{"warning"}), TakeCollectedLines());
+
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, AddLogSink_slow_sink_does_not_block_logging)
+{
+  CollectingLogger::Reset();
+  cpputils::base::SetLogger(CollectingLogger::Log);
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  std::atomic<int> delivered(0);
+  cpputils::base::LogSinkOptions options;
+  options.queue.queue_capacity = 8;
+  uint64_t id = cpputils::base::AddLogSink(
+      [&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *, const char *,
+          unsigned int, const char *) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ++delivered;
+      },
+      options);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 100; ++i)
+  {
+    LOG(INFO) << i;
+  }
+  // 100 messages would take the sink a second.
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+  EXPECT_EQ(100u, TakeCollectedLines().size());
+
+  cpputils::base::RemoveLogSink(id);
+  // The sink got what fit in its queue plus the report of the rest.
+  EXPECT_GT(delivered.load(), 1);
+  EXPECT_LT(delivered.load(), 100);
+
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, SocketLogger)
+{
+  TemporaryDir td;
+  std::string path = std::string(td.path) + "/collector";
+  cpputils::base::SocketLogger logger(path);
+  // Nothing is listening yet, which must not be an error.
+  logger(cpputils::base::DEFAULT, cpputils::base::INFO, "tag", "file.cpp", 1, "lost");
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  ASSERT_NE(-1, fd);
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path.c_str());
+  ASSERT_EQ(0, bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+
+  logger(cpputils::base::DEFAULT, cpputils::base::WARNING, "tag", "file.cpp", 2, "received");
+  char buf[1024];
+  ssize_t size = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+  ASSERT_GT(size, 0);
+  EXPECT_MATCH(std::string(buf, size), R"(^tag W [^\n]+ file\.cpp:2\] received\n$)");
+  close(fd);
+}
+
+TEST(logging, SetDefaultTag_while_other_threads_log)
+{
+  std::string old_default_tag = cpputils::base::GetDefaultTag();
+  std::mutex mutex;
+  std::set<std::string> tags;
+  cpputils::base::SetLogger([&](cpputils::base::LogId, cpputils::base::LogSeverity,
+                                const char *tag, const char *, unsigned int, const char *) {
+    std::lock_guard<std::mutex> lock(mutex);
+    tags.insert(tag);
+  });
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  cpputils::base::SetDefaultTag("tag_a");
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back([&done]() {
+      while (!done.load())
+      {
+        LOG(INFO) << "tagged";
+      }
+    });
+  }
+  for (int i = 0; i < 100; ++i)
+  {
+    cpputils::base::SetDefaultTag((i % 2 == 0) ? "tag_b" : "tag_a");
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  done = true;
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+  EXPECT_EQ((std::set<std::string>{"tag_a", "tag_b"}), tags);
+
+  cpputils::base::SetDefaultTag("");
+  EXPECT_EQ("", cpputils::base::GetDefaultTag());
+  cpputils::base::SetDefaultTag(old_default_tag);
+}
+
+static std::string FlightRecorderDump()
+{
+  TemporaryFile tf;
+  cpputils::base::DumpFlightRecorder(tf.fd);
+  std::string dump;
+  EXPECT_TRUE(cpputils::base::ReadFileToString(tf.path, &dump));
+  return dump;
+}
+
+TEST(logging, FlightRecorder_records_lines_below_the_minimum_severity)
+{
+  std::vector<std::string> logged;
+  cpputils::base::SetLogger([&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *,
+                                const char *, unsigned int, const char *message) {
+    logged.push_back(message);
+  });
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::WARNING);
+  cpputils::base::FlightRecorderOptions options;
+  options.capacity = 4096;
+  options.min_severity = cpputils::base::DEBUG;
+  ASSERT_TRUE(cpputils::base::EnableFlightRecorder(options));
+
+  LOG(VERBOSE) << "below the recorder";
+  LOG(DEBUG) << "recorded only";
+  LOG(WARNING) << "recorded and logged\nsecond line";
+  std::string dump = FlightRecorderDump();
+  EXPECT_EQ((std::vector<std::string>{"recorded and logged", "second line"}), logged);
+  EXPECT_MATCH(dump, "^--- flight recorder: most recent log lines ---\n"
+                     "[^\n]+ D [^\n]+ logging_test\\.cpp:[0-9]+\\] recorded only\n"
+                     "[^\n]+ W [^\n]+\\] recorded and logged\n"
+                     "[^\n]+ W [^\n]+\\] second line\n"
+                     "--- end of flight recorder ---\n$");
+
+  // Once the ring wraps around only whole lines are dumped, up to the newest.
+  for (int i = 0; i < 1000; ++i)
+  {
+    LOG(DEBUG) << "line " << i;
+  }
+  std::vector<std::string> lines = cpputils::base::Split(FlightRecorderDump(), "\n");
+  ASSERT_GT(lines.size(), 10U);
+  int next = -1;
+  for (size_t i = 1; i < lines.size() - 2; ++i)
+  {
+    int n;
+    size_t end = lines[i].find("] line ");
+    ASSERT_NE(std::string::npos, end) << lines[i];
+    ASSERT_EQ(1, sscanf(lines[i].c_str() + end, "] line %d", &n)) << lines[i];
+    EXPECT_TRUE(next == -1 || n == next) << lines[i];
+    next = n + 1;
+  }
+  EXPECT_EQ(1000, next);
+
+  cpputils::base::DisableFlightRecorder();
+  EXPECT_EQ("", FlightRecorderDump());
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+}
+
+TEST(logging, FlightRecorder_file_outlives_the_recorder)
+{
+  TemporaryDir td;
+  cpputils::base::FlightRecorderOptions options;
+  options.path = std::string(td.path) + "/flight";
+  ASSERT_TRUE(cpputils::base::EnableFlightRecorder(options));
+  LOG(VERBOSE) << "kept in the file";
+  cpputils::base::DisableFlightRecorder();
+
+  TemporaryFile out;
+  ASSERT_TRUE(cpputils::base::DumpFlightRecorderFile(options.path, out.fd));
+  std::string dump;
+  ASSERT_TRUE(cpputils::base::ReadFileToString(out.path, &dump));
+  EXPECT_MATCH(dump, "\\] kept in the file\n--- end of flight recorder ---\n$");
+
+  TemporaryFile not_a_recorder;
+  ASSERT_TRUE(cpputils::base::WriteStringToFile(std::string(8192, 'x'), not_a_recorder.path));
+  errno = 0;
+  EXPECT_FALSE(cpputils::base::DumpFlightRecorderFile(not_a_recorder.path, out.fd));
+  EXPECT_EQ(EINVAL, errno);
+}
+
+TEST(logging, FlightRecorder_dumped_by_DefaultAborter)
+{
+  ASSERT_DEATH(
+      {
+        SuppressAbortUI();
+        cpputils::base::EnableFlightRecorder();
+        LOG(VERBOSE) << "before the crash";
+        LOG(FATAL) << "crash";
+      },
+      "most recent log lines ---\n[^\n]+\\] before the crash\n[^\n]+\\] crash\n--- end");
+}
+
+#if !defined(_WIN32)
+TEST(logging, FlightRecorder_dumped_by_signal_handlers)
+{
+  ASSERT_EXIT(
+      {
+        cpputils::base::EnableFlightRecorder();
+        cpputils::base::InstallFlightRecorderSignalHandlers();
+        LOG(VERBOSE) << "before the signal";
+        raise(SIGSEGV);
+      },
+      ::testing::KilledBySignal(SIGSEGV), "\\] before the signal\n--- end of flight recorder");
+}
+#endif
+
+TEST(logging, LOG_With_appends_fields_for_plain_loggers)
+{
+  std::vector<std::string> logged;
+  cpputils::base::SetLogger([&](cpputils::base::LogId, cpputils::base::LogSeverity, const char *,
+                                const char *, unsigned int, const char *message) {
+    logged.push_back(message);
+  });
+  cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+
+  LOG(INFO).With("req_id", 17).With("user", "a b").With("ok", true).With("empty", "") << "done";
+  errno = ENOENT;
+  PLOG(WARNING).With("path", "/x") << "open";
+  LOG_EVERY_N(INFO, 1).With("n", 1) << "sampled";
+  LOG(INFO) << std::hex << 255;
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+
+  std::vector<std::string> expected = {
+      "done req_id=17 user=\"a b\" ok=true empty=\"\"",
+      std::string("open: ") + strerror(ENOENT) + " path=/x",
+      "sampled n=1",
+      // The fields of one message do not leak into the next.
+      "ff",
+  };
+  EXPECT_EQ(expected, logged);
+}
+
+static std::string StructuredLoggerOutput(cpputils::base::LogEncoding encoding,
+                                          const std::function<void()> &log)
+{
+  TemporaryFile tf;
+  cpputils::base::SetLogger(cpputils::base::StructuredLogger(tf.fd, encoding));
+  {
+    cpputils::base::ScopedLogSeverity sls(cpputils::base::INFO);
+    log();
+  }
+  cpputils::base::FlushLogs();
+  cpputils::base::SetLogger(cpputils::base::StderrLogger);
+  std::string output;
+  EXPECT_TRUE(cpputils::base::ReadFileToString(tf.path, &output));
+  return output;
+}
+
+static void LogStructuredMessages()
+{
+  LOG(WARNING).With("lat_us", 2.5).With("bad", std::numeric_limits<double>::infinity())
+          .With("quote", "say \"hi\"\t\x01").With("ok", false)
+      << "first\nsecond";
+  LOG(INFO) << "plain";
+}
+
+TEST(logging, StructuredLogger_json)
+{
+  std::string output = StructuredLoggerOutput(cpputils::base::LogEncoding::kJson,
+                                              LogStructuredMessages);
+  const std::string fields =
+      R"("lat_us":2.5,"bad":"inf","quote":"say \\"hi\\"\\t\\u0001","ok":false\})";
+  EXPECT_MATCH(output,
+               R"(^\{"ts":[0-9]+\.[0-9]{6},"level":"warning","tag":"[^"]+","pid":[0-9]+,)"
+               R"("tid":[0-9]+,"file":"logging_test\.cpp","line":[0-9]+,"msg":"first",)" +
+                   fields + "\n" + R"(\{"ts":[^\n]+,"msg":"second",)" + fields + "\n" +
+                   R"(\{"ts":[^\n]+"level":"info"[^\n]+,"msg":"plain"\}\n$)");
+}
+
+TEST(logging, StructuredLogger_logfmt_with_async_logging)
+{
+  std::string output = StructuredLoggerOutput(cpputils::base::LogEncoding::kLogfmt, [] {
+    cpputils::base::EnableAsyncLogging();
+    LogStructuredMessages();
+    cpputils::base::DisableAsyncLogging();
+  });
+  const std::string fields = R"( lat_us=2.5 bad=inf quote="say \\"hi\\"\\t\\u0001" ok=false)";
+  EXPECT_MATCH(output,
+               R"(^ts=[0-9]+\.[0-9]{6} level=warning tag=[^ ]+ pid=[0-9]+ tid=[0-9]+ )"
+               R"(file=logging_test\.cpp line=[0-9]+ msg=first)" +
+                   fields + "\n" + R"(ts=[^\n]+ msg=second)" + fields + "\n" +
+                   R"(ts=[^\n]+ level=info [^\n]+ msg=plain\n$)");
+}
@@ -0,0 +1,175 @@
+#include "cpputils-base/metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpputils-base/chrono_utils.h"
+#include "cpputils-base/file.h"
+#include "cpputils-base/stringprintf.h"
+
+#include <gtest/gtest.h>
+
+using namespace cpputils::base;
+
+TEST(metrics, counters_add_up_across_threads) {
+  EXPECT_EQ(&GetCounter("metrics_test.counter"), &GetCounter("metrics_test.counter"));
+  EXPECT_NE(static_cast<void*>(&GetCounter("metrics_test.counter")),
+            static_cast<void*>(&GetGauge("metrics_test.counter")));
+
+  Counter counter;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&counter] {
+      for (int i = 0; i < 10000; ++i) counter.Increment();
+      counter.Increment(5);
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(8 * 10005, counter.Value());
+}
+
+TEST(metrics, gauge) {
+  Gauge& gauge = GetGauge("metrics_test.gauge");
+  gauge.Set(10);
+  gauge.Add(-3);
+  EXPECT_EQ(7, gauge.Value());
+}
+
+TEST(metrics, Histogram_buckets) {
+  for (size_t i = 0; i < Histogram::kBuckets; ++i) {
+    int64_t lower = Histogram::BucketLowerBound(i);
+    int64_t upper = Histogram::BucketUpperBound(i);
+    ASSERT_LE(lower, upper) << i;
+    ASSERT_EQ(i, Histogram::BucketIndex(lower)) << i;
+    ASSERT_EQ(i, Histogram::BucketIndex(upper)) << i;
+    if (i > 0) {
+      ASSERT_EQ(Histogram::BucketUpperBound(i - 1) + 1, lower) << i;
+    }
+    // No bucket is wider than 1/64th of its values.
+    ASSERT_LE(upper - lower, lower / 64) << i;
+  }
+  EXPECT_EQ(Histogram::kBuckets - 1, Histogram::BucketIndex(INT64_MAX));
+  EXPECT_EQ(INT64_MAX, Histogram::BucketUpperBound(Histogram::kBuckets - 1));
+  EXPECT_EQ(0U, Histogram::BucketIndex(-5));
+}
+
+TEST(metrics, Histogram_percentiles) {
+  Histogram histogram;
+  EXPECT_EQ(0U, histogram.Snapshot().count);
+  EXPECT_EQ(0, histogram.Snapshot().Percentile(50));
+
+  for (int64_t i = 1; i <= 100000; ++i) histogram.Record(i);
+  HistogramSnapshot snapshot = histogram.Snapshot();
+  EXPECT_EQ(100000U, snapshot.count);
+  EXPECT_EQ(int64_t(100000) * 100001 / 2, snapshot.sum);
+  EXPECT_EQ(1, snapshot.min);
+  EXPECT_EQ(100000, snapshot.max);
+  EXPECT_NEAR(50000, snapshot.Percentile(50), 500);
+  EXPECT_NEAR(99000, snapshot.Percentile(99), 990);
+  EXPECT_NEAR(99900, snapshot.Percentile(99.9), 999);
+  EXPECT_EQ(1, snapshot.Percentile(0));
+  EXPECT_EQ(100000, snapshot.Percentile(100));
+}
+
+TEST(metrics, HistogramSnapshot_Merge) {
+  Histogram low;
+  Histogram high;
+  for (int i = 0; i < 90; ++i) low.Record(10);
+  for (int i = 0; i < 10; ++i) high.Record(1000000);
+
+  HistogramSnapshot merged;
+  merged.Merge(low.Snapshot());
+  merged.Merge(HistogramSnapshot());
+  merged.Merge(high.Snapshot());
+  EXPECT_EQ(100U, merged.count);
+  EXPECT_EQ(10, merged.min);
+  EXPECT_EQ(1000000, merged.max);
+  EXPECT_EQ(10, merged.Percentile(90));
+  EXPECT_NEAR(1000000, merged.Percentile(91), 10000);
+  EXPECT_DOUBLE_EQ((90 * 10 + 10 * 1000000) / 100.0, merged.Mean());
+}
+
+TEST(metrics, Timer_RecordTo) {
+  Histogram histogram;
+  Timer timer;
+  usleep(10000);
+  timer.RecordTo(histogram);
+  HistogramSnapshot snapshot = histogram.Snapshot();
+  ASSERT_EQ(1U, snapshot.count);
+  EXPECT_GE(snapshot.min, 10000000);
+}
+
+TEST(metrics, WriteMetricsToFile) {
+  Counter& counter = GetCounter("metrics_test.written_counter");
+  counter.Increment(3);
+  GetGauge("metrics_test.written_gauge").Set(-4);
+  Histogram& histogram = GetHistogram("metrics_test.written_histogram");
+  histogram.Record(7);
+  uint64_t count = histogram.Snapshot().count;
+
+  TemporaryFile tf;
+  ASSERT_TRUE(WriteMetricsToFile(tf.path));
+  std::string text;
+  ASSERT_TRUE(ReadFileToString(tf.path, &text));
+  EXPECT_NE(std::string::npos,
+            text.find(StringPrintf("counter metrics_test.written_counter %" PRId64 "\n",
+                                   counter.Value())))
+      << text;
+  EXPECT_NE(std::string::npos, text.find("gauge metrics_test.written_gauge -4\n")) << text;
+  EXPECT_NE(std::string::npos,
+            text.find(StringPrintf("histogram metrics_test.written_histogram count=%" PRIu64
+                                   " sum=%" PRIu64 " min=7 max=7 p50=7 p90=7 p99=7 p99.9=7\n",
+                                   count, 7 * count)))
+      << text;
+
+  ASSERT_FALSE(WriteMetricsToFile("/nonexistent/metrics"));
+  EXPECT_EQ(ENOENT, errno);
+}
+
+TEST(metrics, MetricsServer) {
+  Counter& counter = GetCounter("metrics_test.served_counter");
+  counter.Increment(42);
+  std::string line = StringPrintf("counter metrics_test.served_counter %" PRId64 "\n",
+                                  counter.Value());
+
+  // An abstract socket, as socket_local_server() makes by default.
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::string name = StringPrintf("metrics_test.%d", getpid());
+  memcpy(addr.sun_path + 1, name.data(), name.size());
+  socklen_t addr_len = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+
+  unique_fd listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  ASSERT_NE(-1, listen_fd.get());
+  ASSERT_EQ(0, bind(listen_fd.get(), reinterpret_cast<sockaddr*>(&addr), addr_len));
+  ASSERT_EQ(0, listen(listen_fd.get(), 4));
+  MetricsServer server(std::move(listen_fd));
+
+  for (int i = 0; i < 2; ++i) {
+    unique_fd client(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    ASSERT_EQ(0, connect(client.get(), reinterpret_cast<sockaddr*>(&addr), addr_len));
+    std::string text;
+    ASSERT_TRUE(ReadFdToString(client.get(), &text));
+    EXPECT_NE(std::string::npos, text.find(line)) << text;
+  }
+
+  // A client that hangs up without reading does not stop the server.
+  {
+    unique_fd client(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    ASSERT_EQ(0, connect(client.get(), reinterpret_cast<sockaddr*>(&addr), addr_len));
+  }
+  unique_fd client(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  ASSERT_EQ(0, connect(client.get(), reinterpret_cast<sockaddr*>(&addr), addr_len));
+  std::string text;
+  ASSERT_TRUE(ReadFdToString(client.get(), &text));
+  EXPECT_NE(std::string::npos, text.find(line)) << text;
+}
@@ -0,0 +1,145 @@
+#include "cpputils-base/trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <map>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpputils-base/file.h"
+
+#include <gtest/gtest.h>
+
+using namespace cpputils::base;
+
+struct Event {
+  char phase;
+  uint64_t tid;
+  double ts;
+  std::string name;
+};
+
+// Pulls the events out of the JSON that WriteChromeTrace writes, which has
+// one object per event with the keys in a fixed order.
+static std::vector<Event> TraceEvents() {
+  TemporaryFile tf;
+  EXPECT_TRUE(WriteChromeTrace(tf.fd));
+  std::string json;
+  EXPECT_TRUE(ReadFileToString(tf.path, &json));
+  EXPECT_EQ(0U, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[")) << json;
+  EXPECT_EQ("]}\n", json.substr(json.size() - 3)) << json;
+
+  std::vector<Event> events;
+  std::regex event_regex(
+      R"re(\{"ph":"([BE])","pid":[0-9]+,"tid":([0-9]+),"ts":([0-9.]+),"name":"((?:[^"\\]|\\.)*)"\})re");
+  for (std::sregex_iterator it(json.begin(), json.end(), event_regex), end; it != end; ++it) {
+    events.push_back(Event{(*it)[1].str()[0], std::stoull((*it)[2].str()),
+                           std::stod((*it)[3].str()), (*it)[4].str()});
+  }
+  return events;
+}
+
+static void Inner() {
+  TRACE_SCOPE("inner");
+}
+
+static void Outer() {
+  TRACE_SCOPE("outer");
+  Inner();
+  Inner();
+}
+
+TEST(trace, nested_spans) {
+  Outer();  // Not recorded.
+  StartTracing();
+  Outer();
+  StopTracing();
+  Outer();  // Not recorded either.
+
+  std::vector<Event> events = TraceEvents();
+  std::vector<std::string> sequence;
+  for (const Event& event : events) sequence.push_back(event.phase + (" " + event.name));
+  EXPECT_EQ((std::vector<std::string>{"B outer", "B inner", "E inner", "B inner", "E inner",
+                                      "E outer"}),
+            sequence);
+  for (size_t i = 1; i < events.size(); ++i) {
+    EXPECT_LE(events[i - 1].ts, events[i].ts);
+    EXPECT_EQ(events[0].tid, events[i].tid);
+  }
+}
+
+TEST(trace, span_open_across_StopTracing_still_ends) {
+  StartTracing();
+  {
+    TRACE_SCOPE("open");
+    StopTracing();
+  }
+  std::vector<Event> events = TraceEvents();
+  ASSERT_EQ(2U, events.size());
+  EXPECT_EQ('E', events[1].phase);
+}
+
+TEST(trace, full_buffer_keeps_spans_balanced) {
+  TracingOptions options;
+  options.events_per_thread = 7;
+  StartTracing(options);
+  Outer();  // 6 events.
+  Outer();  // "outer" no longer fits with its end, so nothing is recorded.
+  {
+    TRACE_SCOPE("a");
+    TRACE_SCOPE("b");
+  }
+  StopTracing();
+  std::vector<Event> events = TraceEvents();
+  EXPECT_EQ(6U, events.size());
+  int depth = 0;
+  for (const Event& event : events) {
+    depth += (event.phase == 'B') ? 1 : -1;
+    EXPECT_GE(depth, 0);
+  }
+  EXPECT_EQ(0, depth);
+}
+
+TEST(trace, threads_and_names) {
+  StartTracing();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t] {
+#if defined(__linux__)
+      pthread_setname_np(pthread_self(), ("tracer" + std::to_string(t)).c_str());
+#endif
+      for (int i = 0; i < 1000; ++i) {
+        TRACE_SCOPE("work \"quoted\"");
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  StopTracing();
+
+  std::map<uint64_t, int> per_thread;
+  for (const Event& event : TraceEvents()) {
+    EXPECT_EQ("work \\\"quoted\\\"", event.name);
+    ++per_thread[event.tid];
+  }
+  EXPECT_EQ(4U, per_thread.size());
+  for (const auto& it : per_thread) EXPECT_EQ(2000, it.second);
+
+#if defined(__linux__)
+  TemporaryFile tf;
+  ASSERT_TRUE(WriteChromeTrace(tf.fd));
+  std::string json;
+  ASSERT_TRUE(ReadFileToString(tf.path, &json));
+  EXPECT_NE(std::string::npos, json.find("\"args\":{\"name\":\"tracer3\"}")) << json.substr(0, 500);
+#endif
+}
+
+TEST(trace, StartTracing_discards_the_previous_trace) {
+  StartTracing();
+  Inner();
+  StartTracing();
+  StopTracing();
+  EXPECT_TRUE(TraceEvents().empty());
+}
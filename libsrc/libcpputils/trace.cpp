@@ -0,0 +1,239 @@
+#include "cpputils-base/trace.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cpputils-base/chrono_utils.h"
+#include "cpputils-base/file.h"
+#include "cpputils-base/threads.h"
+
+namespace cpputils {
+namespace base {
+
+namespace trace_internal {
+std::atomic<uint32_t> gTraceGeneration(0);
+}  // namespace trace_internal
+
+using trace_internal::gTraceGeneration;
+
+struct TraceEvent {
+  const char* name;
+  int64_t time_ns;
+  char phase;
+};
+
+// The events of one thread. Only the owning thread appends, publishing each
+// event with a release store of `count`, so recording takes no lock. Starting
+// a new trace is noticed by the owner on its next span, which then resets the
+// buffer under ThreadTraceBuffersLock, so that an export never sees the events
+// array change under it.
+struct ThreadTraceBuffer {
+  ThreadTraceBuffer() : tid(GetThreadId()), thread_name(), generation(0), count(0), exited(false) {
+#if defined(__linux__)
+    pthread_getname_np(pthread_self(), thread_name, sizeof(thread_name));
+#endif
+  }
+
+  const uint64_t tid;
+  char thread_name[16];
+  std::unique_ptr<TraceEvent[]> events;
+  size_t capacity = 0;
+  // Spans begun but not yet ended; their end events always have room.
+  size_t open = 0;
+  std::atomic<uint32_t> generation;
+  std::atomic<size_t> count;
+  std::atomic<bool> exited;
+};
+
+// Guards the list of buffers, buffer resets and the trace settings.
+static std::mutex& ThreadTraceBuffersLock() {
+  static auto& lock = *new std::mutex();
+  return lock;
+}
+
+static std::vector<ThreadTraceBuffer*>& ThreadTraceBuffers() {
+  static auto& buffers = *new std::vector<ThreadTraceBuffer*>();
+  return buffers;
+}
+
+static uint32_t gLastTraceGeneration = 0;
+static size_t gEventsPerThread = 0;
+
+// A thread's buffer outlives it, so that its spans can still be exported; it
+// is freed by the next StartTracing. As in binary_logging.cpp, the pointer is
+// trivially destructible and a separate owner marks the thread as gone.
+static thread_local ThreadTraceBuffer* gThreadTraceBuffer = nullptr;
+static thread_local bool gThreadTraceBufferGone = false;
+
+struct ThreadTraceBufferOwner {
+  ~ThreadTraceBufferOwner() {
+    ThreadTraceBuffer* buffer = gThreadTraceBuffer;
+    gThreadTraceBuffer = nullptr;
+    gThreadTraceBufferGone = true;
+    if (buffer != nullptr) buffer->exited.store(true, std::memory_order_release);
+  }
+};
+static thread_local ThreadTraceBufferOwner gThreadTraceBufferOwner;
+
+static ThreadTraceBuffer* GetThreadTraceBuffer() {
+  if (LIKELY(gThreadTraceBuffer != nullptr)) return gThreadTraceBuffer;
+  if (gThreadTraceBufferGone) return nullptr;
+  // Odr-use the owner so that the buffer is released when the thread exits.
+  (void)&gThreadTraceBufferOwner;
+  ThreadTraceBuffer* buffer = new ThreadTraceBuffer();
+  {
+    std::lock_guard<std::mutex> lock(ThreadTraceBuffersLock());
+    ThreadTraceBuffers().push_back(buffer);
+  }
+  gThreadTraceBuffer = buffer;
+  return buffer;
+}
+
+// Gets the calling thread's buffer ready for `generation`. Returns false if
+// that trace is already over.
+static bool ResetThreadTraceBuffer(ThreadTraceBuffer* buffer, uint32_t generation) {
+  std::lock_guard<std::mutex> lock(ThreadTraceBuffersLock());
+  if (gTraceGeneration.load(std::memory_order_relaxed) != generation) return false;
+  if (buffer->capacity != gEventsPerThread) {
+    buffer->events.reset(new TraceEvent[gEventsPerThread]);
+    buffer->capacity = gEventsPerThread;
+  }
+  buffer->count.store(0, std::memory_order_relaxed);
+  buffer->open = 0;
+  buffer->generation.store(generation, std::memory_order_relaxed);
+  return true;
+}
+
+static int64_t TraceNow() {
+  return boot_clock::now().time_since_epoch().count();
+}
+
+static void AppendEvent(ThreadTraceBuffer* buffer, const char* name, char phase) {
+  size_t n = buffer->count.load(std::memory_order_relaxed);
+  buffer->events[n] = TraceEvent{name, TraceNow(), phase};
+  buffer->count.store(n + 1, std::memory_order_release);
+}
+
+namespace trace_internal {
+
+uint32_t BeginSpan(const char* name, uint32_t generation) {
+  ThreadTraceBuffer* buffer = GetThreadTraceBuffer();
+  if (buffer == nullptr) return 0;
+  if (buffer->generation.load(std::memory_order_relaxed) != generation &&
+      !ResetThreadTraceBuffer(buffer, generation)) {
+    return 0;
+  }
+  // Leave room for this span's end and for those of the open spans.
+  if (buffer->count.load(std::memory_order_relaxed) + buffer->open + 2 > buffer->capacity) {
+    return 0;
+  }
+  AppendEvent(buffer, name, 'B');
+  ++buffer->open;
+  return generation;
+}
+
+void EndSpan(const char* name, uint32_t generation) {
+  ThreadTraceBuffer* buffer = gThreadTraceBuffer;
+  // The buffer is gone if the thread is exiting, and was reset if another
+  // trace was started since the span began.
+  if (buffer == nullptr || buffer->generation.load(std::memory_order_relaxed) != generation) {
+    return;
+  }
+  AppendEvent(buffer, name, 'E');
+  --buffer->open;
+}
+
+}  // namespace trace_internal
+
+void StartTracing(const TracingOptions& options) {
+  std::lock_guard<std::mutex> lock(ThreadTraceBuffersLock());
+  std::vector<ThreadTraceBuffer*>& buffers = ThreadTraceBuffers();
+  for (size_t i = 0; i < buffers.size();) {
+    if (buffers[i]->exited.load(std::memory_order_acquire)) {
+      delete buffers[i];
+      buffers[i] = buffers.back();
+      buffers.pop_back();
+    } else {
+      ++i;
+    }
+  }
+  gEventsPerThread = std::max<size_t>(options.events_per_thread, 2);
+  // Skip 0, which means that tracing is off.
+  gLastTraceGeneration = (gLastTraceGeneration + 1 == 0) ? 1 : gLastTraceGeneration + 1;
+  gTraceGeneration.store(gLastTraceGeneration, std::memory_order_relaxed);
+}
+
+void StopTracing() {
+  std::lock_guard<std::mutex> lock(ThreadTraceBuffersLock());
+  gTraceGeneration.store(0, std::memory_order_relaxed);
+}
+
+// Span names are usually identifiers, but may be anything.
+static void AppendJsonString(std::string* out, const char* s) {
+  out->push_back('"');
+  for (; *s != '\0'; ++s) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out->append(escape);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+bool WriteChromeTrace(int fd) {
+  const int pid = getpid();
+  std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  char buf[128];
+  {
+    std::lock_guard<std::mutex> lock(ThreadTraceBuffersLock());
+    for (const ThreadTraceBuffer* buffer : ThreadTraceBuffers()) {
+      if (buffer->generation.load(std::memory_order_relaxed) != gLastTraceGeneration) continue;
+      size_t count = buffer->count.load(std::memory_order_acquire);
+      if (count == 0) continue;
+      if (buffer->thread_name[0] != '\0') {
+        snprintf(buf, sizeof(buf),
+                 "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%" PRIu64
+                 ",\"args\":{\"name\":",
+                 first ? "" : ",", pid, buffer->tid);
+        out.append(buf);
+        AppendJsonString(&out, buffer->thread_name);
+        out.append("}}");
+        first = false;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        const TraceEvent& event = buffer->events[i];
+        snprintf(buf, sizeof(buf),
+                 "%s{\"ph\":\"%c\",\"pid\":%d,\"tid\":%" PRIu64 ",\"ts\":%" PRId64
+                 ".%03d,\"name\":",
+                 first ? "" : ",", event.phase, pid, buffer->tid, event.time_ns / 1000,
+                 static_cast<int>(event.time_ns % 1000));
+        out.append(buf);
+        AppendJsonString(&out, event.name);
+        out.push_back('}');
+        first = false;
+      }
+    }
+  }
+  out.append("]}\n");
+  return WriteFully(fd, out.data(), out.size());
+}
+
+}  // namespace base
+}  // namespace cpputils
@@ -1,10 +1,14 @@
 #include <sys-fs/Dir.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cpputils-base/logging.h>
-#include <cpputils-base/strings.h>
 
 using namespace cpputils::base;
 
@@ -73,6 +77,130 @@ namespace Sys
             return *this;
         }
 
+        /**
+        *  @brief
+        *    Open directory read with getdents64(), a large buffer at a time
+        */
+        class Dir::Iterator::Reader
+        {
+        public:
+            explicit Reader(const std::string &dirPath)
+                : m_fd(open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)), m_buf(new char[kBufferSize]), m_pos(0), m_len(0)
+            {
+                if (m_fd < 0)
+                {
+                    LOG(ERROR) << dirPath << " : " << strerror(errno);
+                }
+                m_entry.m_path = dirPath + "/";
+            }
+
+            ~Reader()
+            {
+                if (m_fd >= 0)
+                    close(m_fd);
+            }
+
+            /* Read the next entry into m_entry; false at the end or on error. */
+            bool next()
+            {
+                if (m_fd < 0)
+                    return false;
+
+                while (true)
+                {
+                    if (m_pos >= m_len)
+                    {
+                        long n = syscall(SYS_getdents64, m_fd, m_buf.get(), kBufferSize);
+                        if (n <= 0)
+                        {
+                            if (n < 0)
+                            {
+                                LOG(ERROR) << m_entry.m_path << " : " << strerror(errno);
+                            }
+                            return false;
+                        }
+                        m_pos = 0;
+                        m_len = n;
+                    }
+
+                    const LinuxDirent64 *d = reinterpret_cast<const LinuxDirent64 *>(m_buf.get() + m_pos);
+                    m_pos += d->d_reclen;
+                    if ((strcmp(d->d_name, ".") == 0) || (strcmp(d->d_name, "..") == 0))
+                        continue;
+
+                    size_t dirLen = m_entry.m_path.size() - m_entry.m_name.size();
+                    m_entry.m_name = d->d_name;
+                    m_entry.m_path.replace(dirLen, std::string::npos, m_entry.m_name);
+                    m_entry.m_type = FsObject::Type(DTTOIF(d->d_type));
+
+                    struct stat sb;
+                    if ((d->d_type == DT_UNKNOWN) && (fstatat(m_fd, d->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0))
+                    {
+                        m_entry.m_type = FsObject::Type(sb.st_mode & S_IFMT);
+                    }
+                    return true;
+                }
+            }
+
+            const Entry &entry() const { return m_entry; }
+
+        private:
+            /* Record layout of getdents64(), which glibc did not wrap until 2.30. */
+            struct LinuxDirent64
+            {
+                ino64_t d_ino;
+                off64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[];
+            };
+
+            /* Enough for a few thousand entries per system call. */
+            static const size_t kBufferSize = 256 * 1024;
+
+            int m_fd;
+            std::unique_ptr<char[]> m_buf;
+            size_t m_pos;
+            size_t m_len;
+            Entry m_entry;
+        };
+
+        Dir::Iterator::Iterator()
+        {
+        }
+
+        Dir::Iterator::Iterator(const std::string &dirPath)
+            : m_reader(std::make_shared<Reader>(dirPath))
+        {
+            ++*this;
+        }
+
+        const Dir::Entry &Dir::Iterator::operator*() const
+        {
+            return m_reader->entry();
+        }
+
+        const Dir::Entry *Dir::Iterator::operator->() const
+        {
+            return &m_reader->entry();
+        }
+
+        Dir::Iterator &Dir::Iterator::operator++()
+        {
+            if (m_reader && !m_reader->next())
+            {
+                m_reader.reset();
+            }
+            return *this;
+        }
+
+        Dir::Entries Dir::entries() const
+        {
+            Entries range;
+            range.m_path = getAbsolutePath();
+            return range;
+        }
+
         std::vector<FsObject> &Dir::getEntries()
         {
             time_t mtime = getLastUpdateTime();
@@ -80,24 +208,21 @@ namespace Sys
             {
                 m_lastUpdate = mtime;
                 m_entries.clear();
-                std::vector<std::string> outlines;
-                std::string rpath = getAbsolutePath();
-                if (execCommand("ls " + m_realPath + "/", &outlines))
+                std::vector<std::string> paths;
+                for (const Entry &entry : entries())
                 {
-                    for (std::string line : outlines)
+                    /* Hidden entries are left out, as 'ls' left them out. */
+                    if (entry.name()[0] != '.')
                     {
-                        line = Trim(line);
-                        if (!line.empty())
-                        {
-                            line = rpath + "/" + line;
-                            FsObject fo(line);
-                            if (fo.isExist())
-                            {
-                                m_entries.push_back(fo);
-                            }
-                        }
+                        paths.push_back(entry.path());
                     }
                 }
+                std::sort(paths.begin(), paths.end());
+                m_entries.reserve(paths.size());
+                for (const std::string &path : paths)
+                {
+                    m_entries.push_back(FsObject(path));
+                }
             }
             return m_entries;
         }
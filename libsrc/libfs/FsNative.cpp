@@ -0,0 +1,648 @@
+#include "FsNative.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <cpputils-base/logging.h>
+
+namespace Sys
+{
+    namespace Fs
+    {
+        namespace Native
+        {
+            namespace
+            {
+                /* Most worker threads one tree operation may use. */
+                const unsigned int kMaxWorkers = 8;
+                /* Bytes asked of copy_file_range() and sendfile() per call. */
+                const size_t kKernelCopyChunk = 1 << 30;
+                /* Buffer of the read()/write() fallback. */
+                const size_t kCopyBufferSize = 1 << 20;
+
+                /**
+                *  @brief
+                *    Bounded pool of threads running the tasks of one tree operation
+                *
+                *    Tasks may post further tasks; wait() returns once no task is
+                *    queued or running. The newest task is run first.
+                */
+                class WorkerPool
+                {
+                public:
+                    WorkerPool()
+                        : m_busy(0), m_stop(false)
+                    {
+                        unsigned int workers = std::min(std::max(1u, std::thread::hardware_concurrency()), kMaxWorkers);
+                        for (unsigned int i = 0; i < workers; i++)
+                        {
+                            m_threads.emplace_back(&WorkerPool::run, this);
+                        }
+                    }
+
+                    ~WorkerPool()
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(m_lock);
+                            m_stop = true;
+                        }
+                        m_wake.notify_all();
+                        for (std::thread &t : m_threads)
+                        {
+                            t.join();
+                        }
+                    }
+
+                    void post(std::function<void()> task)
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(m_lock);
+                            m_tasks.push_back(std::move(task));
+                        }
+                        m_wake.notify_one();
+                    }
+
+                    void wait()
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        m_idle.wait(lock, [this] { return m_tasks.empty() && (m_busy == 0); });
+                    }
+
+                private:
+                    void run()
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        while (true)
+                        {
+                            m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                            if (m_tasks.empty())
+                                return;
+
+                            /* Newest first, so that trees are walked depth first and few directories are open at once. */
+                            std::function<void()> task = std::move(m_tasks.back());
+                            m_tasks.pop_back();
+                            m_busy++;
+                            lock.unlock();
+                            task();
+                            lock.lock();
+                            m_busy--;
+                            if (m_tasks.empty() && (m_busy == 0))
+                            {
+                                m_idle.notify_all();
+                            }
+                        }
+                    }
+
+                    std::mutex m_lock;
+                    std::condition_variable m_wake;
+                    std::condition_variable m_idle;
+                    std::deque<std::function<void()>> m_tasks;
+                    std::vector<std::thread> m_threads;
+                    unsigned int m_busy;
+                    bool m_stop;
+                };
+
+                bool logError(const std::string &path)
+                {
+                    LOG(ERROR) << path << " : " << strerror(errno);
+                    return false;
+                }
+
+                /* Ownership can only be given away by privileged users, so failing to keep it is not an error. */
+                void copyOwner(int dirfd, const std::string &path, const struct stat &sb)
+                {
+                    if (fchownat(dirfd, path.c_str(), sb.st_uid, sb.st_gid, AT_SYMLINK_NOFOLLOW) < 0 && (errno != EPERM))
+                    {
+                        logError(path);
+                    }
+                }
+
+                bool copyTimes(const std::string &path, const struct stat &sb)
+                {
+                    struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+                    if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0)
+                        return logError(path);
+                    return true;
+                }
+
+                /* Owner first, since chown() clears the set-user-ID and set-group-ID bits. */
+                bool copyMetadata(const std::string &path, const struct stat &sb)
+                {
+                    copyOwner(AT_FDCWD, path, sb);
+                    if (chmod(path.c_str(), sb.st_mode & 07777) < 0)
+                        return logError(path);
+                    return copyTimes(path, sb);
+                }
+
+                /* Copy the rest of 'in' to 'out', leaving the data to the kernel where possible. */
+                bool copyData(int in, int out, const struct stat &sb)
+                {
+#ifdef FICLONE
+                    if (ioctl(out, FICLONE, in) == 0)
+                        return true;
+#endif
+                    bool copied = false;
+                    while (true)
+                    {
+                        ssize_t n = copy_file_range(in, nullptr, out, nullptr, kKernelCopyChunk, 0);
+                        if (n > 0)
+                        {
+                            copied = true;
+                            continue;
+                        }
+                        /* Pseudo files report no data to copy_file_range() on older kernels. */
+                        if ((n == 0) && (copied || (sb.st_size == 0)))
+                            return true;
+                        if ((n < 0) && (errno == EINTR))
+                            continue;
+                        if ((n < 0) && (errno != EXDEV) && (errno != EINVAL) && (errno != ENOSYS) && (errno != EOPNOTSUPP) && (errno != EBADF))
+                            return false;
+                        break;
+                    }
+
+                    while (true)
+                    {
+                        ssize_t n = sendfile(out, in, nullptr, kKernelCopyChunk);
+                        if (n > 0)
+                            continue;
+                        if (n == 0)
+                            return true;
+                        if (errno == EINTR)
+                            continue;
+                        if ((errno != EINVAL) && (errno != ENOSYS))
+                            return false;
+                        break;
+                    }
+
+                    std::unique_ptr<char[]> buf(new char[kCopyBufferSize]);
+                    while (true)
+                    {
+                        ssize_t n = read(in, buf.get(), kCopyBufferSize);
+                        if (n == 0)
+                            return true;
+                        if (n < 0)
+                        {
+                            if (errno == EINTR)
+                                continue;
+                            return false;
+                        }
+                        for (ssize_t written = 0; written < n;)
+                        {
+                            ssize_t w = write(out, buf.get() + written, n - written);
+                            if (w < 0)
+                            {
+                                if (errno == EINTR)
+                                    continue;
+                                return false;
+                            }
+                            written += w;
+                        }
+                    }
+                }
+
+                bool copyFile(const std::string &src, const std::string &dst, const struct stat &sb)
+                {
+                    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (in < 0)
+                        return logError(src);
+
+                    /* Like 'cp -f', replace a destination that cannot be opened for writing. */
+                    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+                    if ((out < 0) && (errno != ENOENT) && (errno != EISDIR) && (unlink(dst.c_str()) == 0))
+                    {
+                        out = open(dst.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+                    }
+                    if (out < 0)
+                    {
+                        logError(dst);
+                        close(in);
+                        return false;
+                    }
+
+                    bool ok = false;
+                    struct stat dsb;
+                    if (fstat(out, &dsb) < 0)
+                    {
+                        logError(dst);
+                    }
+                    else if ((dsb.st_dev == sb.st_dev) && (dsb.st_ino == sb.st_ino))
+                    {
+                        LOG(ERROR) << src << "; " << dst << " : Source and destination are the same file.";
+                    }
+                    else if ((ftruncate(out, 0) < 0) || !copyData(in, out, sb))
+                    {
+                        logError(dst);
+                    }
+                    else
+                    {
+                        struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+                        if ((fchown(out, sb.st_uid, sb.st_gid) < 0) && (errno != EPERM))
+                            logError(dst);
+                        if ((fchmod(out, sb.st_mode & 07777) < 0) || (futimens(out, times) < 0))
+                            logError(dst);
+                        else
+                            ok = true;
+                    }
+
+                    close(in);
+                    if (close(out) < 0)
+                        ok = logError(dst);
+                    return ok;
+                }
+
+                bool copySymLink(const std::string &src, const std::string &dst, const struct stat &sb)
+                {
+                    std::vector<char> target(sb.st_size > 0 ? sb.st_size + 1 : PATH_MAX);
+                    ssize_t len = readlink(src.c_str(), target.data(), target.size());
+                    if (len < 0)
+                        return logError(src);
+                    std::string link(target.data(), len);
+
+                    if ((symlink(link.c_str(), dst.c_str()) < 0) && ((errno != EEXIST) || (unlink(dst.c_str()) < 0) || (symlink(link.c_str(), dst.c_str()) < 0)))
+                        return logError(dst);
+
+                    copyOwner(AT_FDCWD, dst, sb);
+                    return copyTimes(dst, sb);
+                }
+
+                bool copySpecial(const std::string &dst, const struct stat &sb)
+                {
+                    if ((mknod(dst.c_str(), sb.st_mode, sb.st_rdev) < 0) && ((errno != EEXIST) || (unlink(dst.c_str()) < 0) || (mknod(dst.c_str(), sb.st_mode, sb.st_rdev) < 0)))
+                        return logError(dst);
+                    return copyMetadata(dst, sb);
+                }
+
+                bool copyNode(const std::string &src, const std::string &dst, const struct stat &sb)
+                {
+                    if (S_ISREG(sb.st_mode))
+                        return copyFile(src, dst, sb);
+                    if (S_ISLNK(sb.st_mode))
+                        return copySymLink(src, dst, sb);
+                    return copySpecial(dst, sb);
+                }
+
+                /* The copy is kept writable until its entries are in; copyMetadata() sets the real mode. */
+                bool makeDir(const std::string &dst)
+                {
+                    if (mkdir(dst.c_str(), S_IRWXU) == 0)
+                        return true;
+                    if (errno != EEXIST)
+                        return logError(dst);
+
+                    struct stat sb;
+                    if (stat(dst.c_str(), &sb) < 0)
+                        return logError(dst);
+                    if (!S_ISDIR(sb.st_mode))
+                    {
+                        errno = ENOTDIR;
+                        return logError(dst);
+                    }
+                    return true;
+                }
+
+                /**
+                *  @brief
+                *    Directory being copied
+                *
+                *    Its mode and timestamps are copied only once all of its
+                *    entries are, since adding them would change both.
+                */
+                struct DirCopy
+                {
+                    DirCopy(const std::string &path, const struct stat &stats, const std::shared_ptr<DirCopy> &parentDir)
+                        : dst(path), sb(stats), parent(parentDir), pending(1)
+                    {
+                    }
+
+                    const std::string dst;
+                    const struct stat sb;
+                    const std::shared_ptr<DirCopy> parent;
+                    std::atomic<long> pending; ///< Listing of the directory and entries not yet copied
+                };
+
+                /**
+                *  @brief
+                *    Copy of a directory tree
+                *
+                *    Every directory is listed by a task of its own, and every file
+                *    in it is copied by another, so that both wide and deep trees keep
+                *    the workers busy.
+                */
+                class TreeCopy
+                {
+                public:
+                    TreeCopy()
+                        : m_ok(true)
+                    {
+                    }
+
+                    bool run(const std::string &src, const std::string &dst, const struct stat &sb)
+                    {
+                        if (!makeDir(dst))
+                            return false;
+
+                        std::shared_ptr<DirCopy> root = std::make_shared<DirCopy>(dst, sb, nullptr);
+                        m_pool.post([this, root, src] { listDir(root, src); });
+                        m_pool.wait();
+                        return m_ok;
+                    }
+
+                private:
+                    void listDir(const std::shared_ptr<DirCopy> &dir, const std::string &src)
+                    {
+                        DIR *dp = opendir(src.c_str());
+                        if (!dp)
+                        {
+                            m_ok = logError(src);
+                            finish(dir);
+                            return;
+                        }
+
+                        errno = 0;
+                        while (struct dirent *entry = readdir(dp))
+                        {
+                            if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+                                continue;
+
+                            std::string childSrc = src + "/" + entry->d_name;
+                            std::string childDst = dir->dst + "/" + entry->d_name;
+                            struct stat sb;
+                            if (fstatat(dirfd(dp), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+                            {
+                                m_ok = logError(childSrc);
+                            }
+                            else if (S_ISDIR(sb.st_mode))
+                            {
+                                if (makeDir(childDst))
+                                {
+                                    std::shared_ptr<DirCopy> child = std::make_shared<DirCopy>(childDst, sb, dir);
+                                    dir->pending++;
+                                    m_pool.post([this, child, childSrc] { listDir(child, childSrc); });
+                                }
+                                else
+                                {
+                                    m_ok = false;
+                                }
+                            }
+                            else
+                            {
+                                dir->pending++;
+                                m_pool.post([this, dir, childSrc, childDst, sb] {
+                                    if (!copyNode(childSrc, childDst, sb))
+                                        m_ok = false;
+                                    finish(dir);
+                                });
+                            }
+                            errno = 0;
+                        }
+                        if (errno != 0)
+                            m_ok = logError(src);
+
+                        closedir(dp);
+                        finish(dir);
+                    }
+
+                    void finish(std::shared_ptr<DirCopy> dir)
+                    {
+                        while (dir && (--dir->pending == 0))
+                        {
+                            if (!copyMetadata(dir->dst, dir->sb))
+                                m_ok = false;
+                            dir = dir->parent;
+                        }
+                    }
+
+                    std::atomic<bool> m_ok;
+                    WorkerPool m_pool; ///< Last, so that the workers stop before the rest is destroyed
+                };
+
+                /**
+                *  @brief
+                *    Directory being removed
+                *
+                *    It is opened and removed relative to its parent, whose descriptor
+                *    stays open until all of its subdirectories are gone, so that a
+                *    directory swapped for a symbolic link is never followed and paths
+                *    of any depth can be removed.
+                */
+                struct DirRemove
+                {
+                    DirRemove(const std::shared_ptr<DirRemove> &parentDir, const std::string &dirName, const std::string &dirPath)
+                        : parent(parentDir), name(dirName), path(dirPath), fd(-1), pending(1)
+                    {
+                    }
+
+                    ~DirRemove()
+                    {
+                        if (fd >= 0)
+                            close(fd);
+                    }
+
+                    const std::shared_ptr<DirRemove> parent;
+                    const std::string name;    ///< Name within the parent; the whole path at the top
+                    const std::string path;    ///< Path, for messages only
+                    int fd;                    ///< The directory itself, once it is opened
+                    std::atomic<long> pending; ///< Listing of the directory and subdirectories not yet removed
+                };
+
+                /**
+                *  @brief
+                *    Removal of a directory tree
+                *
+                *    Every directory is emptied by a task of its own, which unlinks
+                *    the files in it and posts a task for each subdirectory.
+                */
+                class TreeRemove
+                {
+                public:
+                    TreeRemove()
+                        : m_ok(true)
+                    {
+                    }
+
+                    bool run(const std::string &path)
+                    {
+                        std::shared_ptr<DirRemove> root = std::make_shared<DirRemove>(nullptr, path, path);
+                        m_pool.post([this, root] { emptyDir(root); });
+                        m_pool.wait();
+                        return m_ok;
+                    }
+
+                private:
+                    static int parentFd(const DirRemove &dir)
+                    {
+                        return dir.parent ? dir.parent->fd : AT_FDCWD;
+                    }
+
+                    void emptyDir(const std::shared_ptr<DirRemove> &dir)
+                    {
+                        /* Posted only once the parent is open, so its fd is set. */
+                        dir->fd = openat(parentFd(*dir), dir->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        /* fdopendir() takes over the descriptor it is given. */
+                        int listFd = (dir->fd < 0) ? -1 : fcntl(dir->fd, F_DUPFD_CLOEXEC, 0);
+                        DIR *dp = (listFd < 0) ? nullptr : fdopendir(listFd);
+                        if (!dp)
+                        {
+                            m_ok = logError(dir->path);
+                            if (listFd >= 0)
+                                close(listFd);
+                            finish(dir);
+                            return;
+                        }
+
+                        errno = 0;
+                        while (struct dirent *entry = readdir(dp))
+                        {
+                            if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
+                                continue;
+
+                            bool isDir = (entry->d_type == DT_DIR);
+                            struct stat sb;
+                            if ((entry->d_type == DT_UNKNOWN) && (fstatat(dir->fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0))
+                            {
+                                isDir = S_ISDIR(sb.st_mode);
+                            }
+
+                            if (isDir)
+                            {
+                                std::shared_ptr<DirRemove> child = std::make_shared<DirRemove>(dir, entry->d_name, dir->path + "/" + entry->d_name);
+                                dir->pending++;
+                                m_pool.post([this, child] { emptyDir(child); });
+                            }
+                            else if ((unlinkat(dir->fd, entry->d_name, 0) < 0) && (errno != ENOENT))
+                            {
+                                m_ok = logError(dir->path + "/" + entry->d_name);
+                            }
+                            errno = 0;
+                        }
+                        if (errno != 0)
+                            m_ok = logError(dir->path);
+
+                        closedir(dp);
+                        finish(dir);
+                    }
+
+                    void finish(std::shared_ptr<DirRemove> dir)
+                    {
+                        while (dir && (--dir->pending == 0))
+                        {
+                            if (dir->fd >= 0)
+                            {
+                                close(dir->fd);
+                                dir->fd = -1;
+                            }
+                            if ((unlinkat(parentFd(*dir), dir->name.c_str(), AT_REMOVEDIR) < 0) && (errno != ENOENT))
+                                m_ok = logError(dir->path);
+                            dir = dir->parent;
+                        }
+                    }
+
+                    std::atomic<bool> m_ok;
+                    WorkerPool m_pool; ///< Last, so that the workers stop before the rest is destroyed
+                };
+
+                std::string absolutePath(const std::string &path)
+                {
+                    char *tbuf = realpath(path.c_str(), NULL);
+                    if (tbuf)
+                    {
+                        std::string abs(tbuf);
+                        free(tbuf);
+                        return abs;
+                    }
+
+                    size_t pos = path.find_last_of('/');
+                    if ((pos == std::string::npos) || (pos == 0))
+                        return path;
+                    return absolutePath(path.substr(0, pos)) + path.substr(pos);
+                }
+
+            } // namespace
+
+            bool copy(const std::string &src, const std::string &dst)
+            {
+                struct stat sb;
+                if (lstat(src.c_str(), &sb) < 0)
+                    return logError(src);
+
+                if (!S_ISDIR(sb.st_mode))
+                    return copyNode(src, dst, sb);
+
+                std::string srcDir = absolutePath(src) + "/";
+                std::string dstDir = absolutePath(dst) + "/";
+                if (dstDir.compare(0, srcDir.size(), srcDir) == 0)
+                {
+                    LOG(ERROR) << src << "; " << dst << " : Cannot copy a directory into itself.";
+                    return false;
+                }
+
+                TreeCopy tree;
+                return tree.run(src, dst, sb);
+            }
+
+            bool remove(const std::string &path)
+            {
+                struct stat sb;
+                if (lstat(path.c_str(), &sb) < 0)
+                    return logError(path);
+
+                if (!S_ISDIR(sb.st_mode))
+                {
+                    if (unlink(path.c_str()) < 0)
+                        return logError(path);
+                    return true;
+                }
+
+                TreeRemove tree;
+                return tree.run(path);
+            }
+
+            bool move(const std::string &src, const std::string &dst)
+            {
+                struct stat sb;
+                int ret = -1;
+                bool tried = false;
+#ifdef RENAME_NOREPLACE
+                if ((lstat(dst.c_str(), &sb) < 0) && (errno == ENOENT))
+                {
+                    ret = renameat2(AT_FDCWD, src.c_str(), AT_FDCWD, dst.c_str(), RENAME_NOREPLACE);
+                    /* Not every file system supports the flag. */
+                    tried = (ret == 0) || ((errno != EINVAL) && (errno != ENOSYS));
+                }
+#endif
+                if (!tried)
+                {
+                    ret = rename(src.c_str(), dst.c_str());
+                }
+
+                if (ret == 0)
+                    return true;
+                if (errno != EXDEV)
+                    return logError(src + "; " + dst);
+
+                /* Like mv, replace a destination file before copying across file systems. */
+                if ((lstat(src.c_str(), &sb) == 0) && !S_ISDIR(sb.st_mode) && (unlink(dst.c_str()) < 0) && (errno != ENOENT))
+                    return logError(dst);
+                return copy(src, dst) && remove(src);
+            }
+
+        } // namespace Native
+    } // namespace Fs
+} // namespace Sys
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+
+namespace Sys
+{
+    namespace Fs
+    {
+        /**
+        *  @brief
+        *    In-process implementations of the file system operations
+        *    that FsObject used to run through the shell.
+        */
+        namespace Native
+        {
+            /**
+            *  @brief
+            *    Copy a file, symbolic link, special file or whole directory tree.
+            *
+            *  @param[in] src
+            *    Path to copy; symbolic links are copied as links, not followed
+            *  @param[in] dst
+            *    Path of the copy; existing files are overwritten and existing
+            *    directories are merged into
+            *
+            *  @return
+            *    'true' if everything was copied, else 'false'
+            *
+            *  @remarks
+            *    File data is cloned with FICLONE where the file system supports it,
+            *    else copied inside the kernel with copy_file_range() or sendfile(),
+            *    and only as a last resort through a user space buffer. Directory
+            *    trees are copied by a bounded pool of worker threads. Mode,
+            *    timestamps and, where permitted, ownership are preserved.
+            */
+            bool copy(const std::string &src, const std::string &dst);
+
+            /**
+            *  @brief
+            *    Remove a file, symbolic link or whole directory tree.
+            *
+            *  @param[in] path
+            *    Path to remove; symbolic links are removed, not followed
+            *
+            *  @return
+            *    'true' if everything was removed, else 'false'
+            *
+            *  @remarks
+            *    Every directory is opened with openat() relative to its parent and
+            *    removed with unlinkat(), without following symbolic links, and
+            *    subdirectories are emptied in parallel by a bounded pool of
+            *    worker threads.
+            */
+            bool remove(const std::string &path);
+
+            /**
+            *  @brief
+            *    Move or rename a file, symbolic link or directory tree.
+            *
+            *  @param[in] src
+            *    Path to move
+            *  @param[in] dst
+            *    New path; like rename(), an existing file or empty directory is replaced
+            *
+            *  @return
+            *    'true' if operation is successful, else 'false'
+            *
+            *  @remarks
+            *    A destination that does not exist yet is renamed to with
+            *    RENAME_NOREPLACE, so that one created meanwhile is not lost.
+            *    Across file systems, the source is copied with copy() and then
+            *    removed.
+            */
+            bool move(const std::string &src, const std::string &dst);
+
+        } // namespace Native
+    } // namespace Fs
+} // namespace Sys
@@ -1,9 +1,11 @@
 
 #include <sys-fs/FsObject.h>
+#include "FsNative.h"
 #include <string>
 #include <cstring>
 #include <cstdio>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <cpputils-base/logging.h>
 #include <fcntl.h>
@@ -16,32 +18,32 @@ namespace Sys
     namespace Fs
     {
         FsObject::FsObject()
-            : Path::Path(), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(false), m_statTtlMs(-1), m_statFields(STAT_BASIC), m_statValid(false), m_stat()
         {
         }
 
         FsObject::FsObject(const FsObject &fsPath)
-            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(fsPath.m_statCache), m_statTtlMs(fsPath.m_statTtlMs), m_statFields(fsPath.m_statFields), m_statValid(false), m_stat()
         {
         }
 
         FsObject::FsObject(FsObject &&fsPath)
-            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(fsPath.m_statCache), m_statTtlMs(fsPath.m_statTtlMs), m_statFields(fsPath.m_statFields), m_statValid(false), m_stat()
         {
         }
 
         FsObject::FsObject(const std::string &fsPath)
-            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(false), m_statTtlMs(-1), m_statFields(STAT_BASIC), m_statValid(false), m_stat()
         {
         }
 
         FsObject::FsObject(std::string &&fsPath)
-            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(false), m_statTtlMs(-1), m_statFields(STAT_BASIC), m_statValid(false), m_stat()
         {
         }
 
         FsObject::FsObject(const char *fsPath)
-            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN)
+            : Path::Path(fsPath), m_realPath(""), m_type(FsObject::Type::UKNOWN), m_statCache(false), m_statTtlMs(-1), m_statFields(STAT_BASIC), m_statValid(false), m_stat()
         {
         }
 
@@ -52,19 +54,27 @@ namespace Sys
         FsObject &FsObject::operator=(const FsObject &Path)
         {
             Path::operator=(Path);
+            m_statCache = Path.m_statCache;
+            m_statTtlMs = Path.m_statTtlMs;
+            m_statFields = Path.m_statFields;
+            m_statValid = false;
             return *this;
         }
 
         FsObject &FsObject::operator=(FsObject &&Path)
         {
             Path::operator=(Path);
+            m_statCache = Path.m_statCache;
+            m_statTtlMs = Path.m_statTtlMs;
+            m_statFields = Path.m_statFields;
+            m_statValid = false;
             return *this;
         }
 
         FsObject::Type FsObject::getType() const
         {
             struct stat sb;
-            if (!getStat(sb))
+            if (!getStat(sb, false, STAT_TYPE))
             {
                 return FsObject::Type::UKNOWN;
             }
@@ -100,7 +110,7 @@ namespace Sys
         long FsObject::getInode() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_INO))
             {
                 return (long)sb.st_ino;
             }
@@ -110,7 +120,7 @@ namespace Sys
         mode_t FsObject::getMode() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_MODE))
             {
 
                 return (unsigned long)(sb.st_mode & (~S_IFMT));
@@ -121,7 +131,7 @@ namespace Sys
         long FsObject::getLinkCount() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_NLINK))
             {
                 return (long)sb.st_nlink;
             }
@@ -131,7 +141,7 @@ namespace Sys
         long FsObject::getUID() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_UID))
             {
                 return (long)sb.st_uid;
             }
@@ -141,7 +151,7 @@ namespace Sys
         long FsObject::getGID() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_GID))
             {
                 return (long)sb.st_gid;
             }
@@ -175,7 +185,7 @@ namespace Sys
         long FsObject::getBlockSize() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, 0))
             {
                 return (long)sb.st_blksize;
             }
@@ -185,7 +195,7 @@ namespace Sys
         long long FsObject::getSize() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_SIZE))
             {
                 return (long)sb.st_size;
             }
@@ -195,7 +205,7 @@ namespace Sys
         long long FsObject::getBlockCount() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_BLOCKS))
             {
                 return (long)sb.st_blocks;
             }
@@ -205,7 +215,7 @@ namespace Sys
         time_t FsObject::getCreationTime() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_CTIME))
             {
                 return sb.st_ctim.tv_sec;
             }
@@ -215,7 +225,7 @@ namespace Sys
         time_t FsObject::getLastAccessTime() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_ATIME))
             {
                 return sb.st_atim.tv_sec;
             }
@@ -225,7 +235,7 @@ namespace Sys
         time_t FsObject::getLastUpdateTime() const
         {
             struct stat sb;
-            if (getStat(sb))
+            if (getStat(sb, false, STAT_MTIME))
             {
                 return sb.st_mtim.tv_sec;
             }
@@ -267,6 +277,7 @@ namespace Sys
                     }
                     else
                     {
+                        m_statValid = false;
                         return true;
                     }
                 }
@@ -280,6 +291,7 @@ namespace Sys
                     else
                     {
                         close(fd);
+                        m_statValid = false;
                         return true;
                     }
                 }
@@ -367,12 +379,18 @@ namespace Sys
                 }
             }
 
-            std::string cmd("mv ");
-            cmd = cmd + getAbsolutePath() + " " + newpath.toNative();
-            if (!execCommand(cmd))
+            /* As with mv, moving to a directory puts the object inside it. */
+            std::string src = getAbsolutePath();
+            std::string dst = newpath.getAbsolutePath();
+            if (newpath.getType() == DIRECTORY)
+            {
+                dst += "/" + Path(src).fileName();
+            }
+            if (!Native::move(src, dst))
                 return false;
 
             m_exists = false;
+            m_statValid = false;
             return true;
         }
 
@@ -406,9 +424,14 @@ namespace Sys
                 }
             }
 
-            std::string cmd("cp -rf ");
-            cmd = cmd + getAbsolutePath() + " " + newpath.toNative();
-            return execCommand(cmd);
+            /* As with 'cp -r', copying to a directory puts the copy inside it. */
+            std::string src = getAbsolutePath();
+            std::string dst = newpath.getAbsolutePath();
+            if (newpath.getType() == DIRECTORY)
+            {
+                dst += "/" + Path(src).fileName();
+            }
+            return Native::copy(src, dst);
         }
 
         bool FsObject::createSymLink(const std::string &dstPath) const
@@ -445,23 +468,11 @@ namespace Sys
             if (!isExist())
                 return false;
 
-            if (getType() == Type::DIRECTORY)
-            {
-                std::string cmd("rm -rf ");
-                cmd = cmd + getAbsolutePath();
-                if (!execCommand(cmd))
-                    return false;
-            }
-            else
-            {
-                if (unlink(getAbsolutePath().c_str()) < 0)
-                {
-                    LOG(ERROR) << m_realPath << " : " << strerror(errno);
-                    return false;
-                }
-            }
+            if (!Native::remove(getAbsolutePath()))
+                return false;
 
             m_exists = false;
+            m_statValid = false;
             return true;
         }
 
@@ -492,6 +503,7 @@ namespace Sys
             {
                 std::string cmd("chown ");
                 cmd += owner + " " + getAbsolutePath();
+                m_statValid = false;
                 return execCommand(cmd);
             }
             return false;
@@ -506,6 +518,7 @@ namespace Sys
             {
                 std::string cmd("chgrp ");
                 cmd += group + " " + getAbsolutePath();
+                m_statValid = false;
                 return execCommand(cmd);
             }
             return false;
@@ -517,7 +530,7 @@ namespace Sys
                 return false;
 
             struct stat sb;
-            if (!getStat(sb))
+            if (!getStat(sb, false, STAT_TYPE))
                 return false;
 
             mode = (sb.st_mode & S_IFMT) | (mode & (~S_IFMT));
@@ -526,6 +539,7 @@ namespace Sys
                 LOG(ERROR) << m_realPath << " : " << strerror(errno);
                 return false;
             }
+            m_statValid = false;
             return true;
         }
 
@@ -612,11 +626,89 @@ namespace Sys
             return true;
         }
 
-        bool FsObject::getStat(struct stat &sb, bool lState) const
+        /* One statx() of the requested fields, into a struct stat; stat() where statx() is missing. */
+        static int statFields(const std::string &path, unsigned int fields, struct stat &sb)
+        {
+#ifdef STATX_BASIC_STATS
+            static_assert(FsObject::STAT_BASIC == STATX_BASIC_STATS, "StatField must match the STATX_* flags");
+            struct statx stx;
+            if (statx(AT_FDCWD, path.c_str(), 0, fields, &stx) == 0)
+            {
+                memset(&sb, 0, sizeof(sb));
+                sb.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+                sb.st_ino = stx.stx_ino;
+                sb.st_mode = stx.stx_mode;
+                sb.st_nlink = stx.stx_nlink;
+                sb.st_uid = stx.stx_uid;
+                sb.st_gid = stx.stx_gid;
+                sb.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+                sb.st_size = stx.stx_size;
+                sb.st_blksize = stx.stx_blksize;
+                sb.st_blocks = stx.stx_blocks;
+                sb.st_atim.tv_sec = stx.stx_atime.tv_sec;
+                sb.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+                sb.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+                sb.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+                sb.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+                sb.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+                return 0;
+            }
+            /* Seccomp profiles older than statx() refuse it with EPERM. */
+            if ((errno != ENOSYS) && (errno != EPERM))
+                return -1;
+#else
+            (void)fields;
+#endif
+            return stat(path.c_str(), &sb);
+        }
+
+        void FsObject::enableStatCache(long ttlMs, unsigned int fields)
+        {
+            m_statCache = true;
+            m_statTtlMs = ttlMs;
+            m_statFields = fields | STAT_TYPE;
+        }
+
+        void FsObject::disableStatCache()
+        {
+            m_statCache = false;
+        }
+
+        bool FsObject::refresh() const
+        {
+            if (isEmpty())
+                return false;
+
+            if (statFields(fullPath(), m_statFields, m_stat) < 0)
+            {
+                if (errno != ENOENT)
+                {
+                    LOG(ERROR) << fullPath() << " : " << strerror(errno);
+                }
+                return false;
+            }
+
+            m_statValid = true;
+            m_statPath = fullPath();
+            m_statTime = cpputils::base::coarse_clock::now();
+            return true;
+        }
+
+        bool FsObject::getStat(struct stat &sb, bool lState, unsigned int fields) const
         {
             if (isEmpty())
                 return false;
 
+            if (m_statCache && !lState && ((fields & ~m_statFields) == 0))
+            {
+                bool expired = (m_statTtlMs >= 0) && (cpputils::base::coarse_clock::now() - m_statTime >= std::chrono::milliseconds(m_statTtlMs));
+                if ((!m_statValid || expired || (m_statPath != fullPath())) && !refresh())
+                    return false;
+
+                sb = m_stat;
+                return true;
+            }
+
             int ret = 0;
             if (lState)
             {
@@ -645,7 +737,7 @@ namespace Sys
                 return;
 
             struct stat stats;
-            if (getStat(stats))
+            if (getStat(stats, false, STAT_TYPE))
             {
                 if (((m_type == FsObject::Type::REGULAR_FILE) && !S_ISREG(stats.st_mode)) || ((m_type == FsObject::Type::DIRECTORY) && !S_ISDIR(stats.st_mode)))
                 {
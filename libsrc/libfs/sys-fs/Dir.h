@@ -2,6 +2,9 @@
 
 #include <sys-fs/FsObject.h>
 #include <sys-fs/File.h>
+#include <cstddef>
+#include <iterator>
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -93,18 +96,122 @@ namespace Sys
             */
             Dir &operator=(Dir &&fsPath);
 
+            /**
+            *  @brief
+            *    Entry of a directory, as read from the directory itself
+            */
+            class Entry
+            {
+            public:
+                /**
+                *  @brief
+                *    Get name of the entry within its directory
+                */
+                const std::string &name() const { return m_name; }
+
+                /**
+                *  @brief
+                *    Get absolute path of the entry
+                */
+                const std::string &path() const { return m_path; }
+
+                /**
+                *  @brief
+                *    Get type of the entry, as reported by the directory
+                *
+                *  @remarks
+                *    Symbolic links are not followed, so a link is SYMBOLIC_LINK
+                *    whatever it points to. The entry is stat'ed only on file systems
+                *    that do not report types in the directory.
+                */
+                FsObject::Type type() const { return m_type; }
+
+            private:
+                friend class Dir;
+
+                std::string m_name;    ///< Name within the directory
+                std::string m_path;    ///< Absolute path
+                FsObject::Type m_type; ///< Type, symbolic links not followed
+            };
+
+            /**
+            *  @brief
+            *    Input iterator reading a directory's entries as it advances
+            */
+            class Iterator
+            {
+            public:
+                typedef std::input_iterator_tag iterator_category;
+                typedef Entry value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const Entry *pointer;
+                typedef const Entry &reference;
+
+                /**
+                *  @brief
+                *    Constructor of the end iterator
+                */
+                Iterator();
+
+                const Entry &operator*() const;
+                const Entry *operator->() const;
+                Iterator &operator++();
+                bool operator==(const Iterator &other) const { return m_reader == other.m_reader; }
+                bool operator!=(const Iterator &other) const { return m_reader != other.m_reader; }
+
+            private:
+                friend class Dir;
+                class Reader;
+
+                explicit Iterator(const std::string &dirPath);
+
+                std::shared_ptr<Reader> m_reader; ///< Open directory; null at the end
+            };
+
+            /**
+            *  @brief
+            *    Range over a directory's entries, for range-based for loops
+            */
+            class Entries
+            {
+            public:
+                Iterator begin() const { return Iterator(m_path); }
+                Iterator end() const { return Iterator(); }
+
+            private:
+                friend class Dir;
+
+                std::string m_path; ///< Absolute path of the directory
+            };
+
             /**
             *  @brief
             *    Get this directory enties
             *
-            *  @param[in] fsPath
-            *    Right-hand value to move
-            *
             *  @return
-            *    vector array of file system objects
+            *    vector array of file system objects, sorted by name
+            *
+            *  @remarks
+            *    The entries are cached until the directory is modified. Hidden
+            *    entries, whose names start with '.', are left out; entries()
+            *    includes them.
             */
             std::vector<FsObject> &getEntries();
 
+            /**
+            *  @brief
+            *    Read this directory's entries lazily
+            *
+            *  @return
+            *    Range of the entries, read in directory order while iterating over it
+            *
+            *  @remarks
+            *    Nothing is cached, and entries are not stat'ed. Hidden entries
+            *    are included, '.' and '..' are not:
+            *    for (const Dir::Entry &entry : dir.entries()) { ... }
+            */
+            Entries entries() const;
+
         protected:
             std::vector<FsObject> m_entries; ///< Directory entries
             time_t m_lastUpdate;             ///< Last modification time
@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <cpputils-base/chrono_utils.h>
 
 namespace Sys
 {
@@ -52,6 +53,26 @@ namespace Sys
                 X_OTH = 00001,    ///< execute/search by others
             };
 
+            /**
+            *  @brief
+            *    Metadata fields, with the values of the matching STATX_* flags of statx(2).
+            */
+            enum StatField
+            {
+                STAT_TYPE = 0x0001,   ///< Type, for getType() and isExist()
+                STAT_MODE = 0x0002,   ///< Permission mode, for getMode()
+                STAT_NLINK = 0x0004,  ///< Link count, for getLinkCount()
+                STAT_UID = 0x0008,    ///< Owner, for getUID() and getOwner()
+                STAT_GID = 0x0010,    ///< Group, for getGID() and getGroup()
+                STAT_ATIME = 0x0020,  ///< Last access time, for getLastAccessTime()
+                STAT_MTIME = 0x0040,  ///< Last modification time, for getLastUpdateTime()
+                STAT_CTIME = 0x0080,  ///< Last status change time, for getCreationTime()
+                STAT_INO = 0x0100,    ///< Inode number, for getInode()
+                STAT_SIZE = 0x0200,   ///< Size, for getSize()
+                STAT_BLOCKS = 0x0400, ///< Blocks allocated, for getBlockCount()
+                STAT_BASIC = 0x07ff,  ///< All of the above
+            };
+
         public:
             /**
             *  @brief
@@ -287,6 +308,37 @@ namespace Sys
             */
             bool isExist() const;
 
+            /**
+            *  @brief
+            *    Cache the metadata that the getters return.
+            *
+            *  @param[in] ttlMs
+            *    Milliseconds for which a snapshot is used; negative to use it until refresh()
+            *  @param[in] fields
+            *    StatField flags of the fields to cache; getters of other fields stat() as usual
+            *
+            *  @remarks
+            *    Without the cache, every getter is a stat() of its own. With it, one
+            *    statx() of only the requested fields fills a snapshot that the getters
+            *    read until it expires, refresh() is called or the path changes.
+            */
+            void enableStatCache(long ttlMs = -1, unsigned int fields = STAT_BASIC);
+
+            /**
+            *  @brief
+            *    Stop caching metadata, so that every getter stat()s again.
+            */
+            void disableStatCache();
+
+            /**
+            *  @brief
+            *    Take a new snapshot of the cached metadata.
+            *
+            *  @return
+            *    'true' if the file system object could be stat'ed, else 'false'
+            */
+            bool refresh() const;
+
             /**
             *  @brief
             *    Create file system object.
@@ -411,7 +463,7 @@ namespace Sys
             */
             bool makePath(const mode_t mode = 0777) const;
 
-            bool getStat(struct stat &sb, bool lState = false) const;
+            bool getStat(struct stat &sb, bool lState = false, unsigned int fields = STAT_BASIC) const;
 
             void checkIfExists() const;
 
@@ -420,6 +472,14 @@ namespace Sys
         protected:
             mutable std::string m_realPath; ///< Absolute path (without trailing separators)
             mutable Type m_type;            ///< Type of filesystem object.
+
+            bool m_statCache;                                              ///< 'true' if metadata is cached
+            long m_statTtlMs;                                              ///< Lifetime of a snapshot; negative for no expiry
+            unsigned int m_statFields;                                     ///< StatField flags of the cached fields
+            mutable bool m_statValid;                                      ///< 'true' if m_stat holds a snapshot
+            mutable struct stat m_stat;                                    ///< Snapshot of the cached fields
+            mutable std::string m_statPath;                                ///< Path the snapshot was taken of
+            mutable cpputils::base::coarse_clock::time_point m_statTime;   ///< When the snapshot was taken
         };
 
     } // namespace Fs
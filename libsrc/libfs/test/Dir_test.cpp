@@ -4,6 +4,11 @@
 #include <sys-fs/File.h>
 #include <gtest/gtest.h>
 #include <cpputils-base/logging.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 using namespace Sys::Fs;
 
@@ -53,3 +58,63 @@ TEST(SysFsDir, Dir_getEntries)
   ASSERT_TRUE(print(dp));
   ASSERT_TRUE(dp.remove());
 }
+
+TEST(SysFsDir, entries_reads_names_and_types_without_stat)
+{
+  Dir dp("/tmp/sysfsDirEntriesTest");
+  ASSERT_TRUE(dp.create());
+  const std::vector<std::string> names = {"plain.txt", "with space.txt", "with\nnewline", ".hidden", "sub dir", "link"};
+  for (size_t i = 0; i < 4; i++)
+  {
+    File f(dp.fullPath() + "/" + names[i]);
+    f.openWrite();
+    f << names[i];
+    f.close();
+  }
+  Dir sub(dp.fullPath() + "/sub dir");
+  ASSERT_TRUE(sub.create());
+  ASSERT_EQ(0, symlink("sub dir", (dp.fullPath() + "/link").c_str()));
+  // Long names, so that the 2000 entries take more than one 256 KiB
+  // getdents64() buffer.
+  const std::string longName(190, 'x');
+  for (int i = 0; i < 2000; i++)
+  {
+    File f(sub.fullPath() + "/" + longName + std::to_string(i));
+    f.openWrite();
+    f.close();
+  }
+
+  std::map<std::string, FsObject::Type> seen;
+  for (const Dir::Entry &entry : dp.entries())
+  {
+    EXPECT_EQ(dp.getAbsolutePath() + "/" + entry.name(), entry.path());
+    seen[entry.name()] = entry.type();
+  }
+  ASSERT_EQ(names.size(), seen.size());
+  EXPECT_EQ(FsObject::Type::REGULAR_FILE, seen["with\nnewline"]);
+  EXPECT_EQ(FsObject::Type::REGULAR_FILE, seen[".hidden"]);
+  EXPECT_EQ(FsObject::Type::DIRECTORY, seen["sub dir"]);
+  EXPECT_EQ(FsObject::Type::SYMBOLIC_LINK, seen["link"]);
+
+  // The reader refills its buffer and neither loses nor repeats an entry.
+  std::set<std::string> subNames;
+  for (Dir::Iterator it = sub.entries().begin(); it != sub.entries().end(); ++it)
+  {
+    EXPECT_TRUE(subNames.insert(it->name()).second) << it->name();
+  }
+  EXPECT_EQ(2000u, subNames.size());
+
+  // getEntries() leaves hidden entries out, as 'ls' did.
+  std::vector<FsObject> &entries = dp.getEntries();
+  ASSERT_EQ(names.size() - 1, entries.size());
+  EXPECT_EQ("link", entries[0].fileName());
+  EXPECT_EQ("with space.txt", entries.back().fileName());
+  for (FsObject &f : entries)
+  {
+    EXPECT_TRUE(f.isExist()) << f.fullPath();
+  }
+
+  Dir missing("/tmp/sysfsDirEntriesTest/none");
+  EXPECT_TRUE(missing.entries().begin() == missing.entries().end());
+  ASSERT_TRUE(dp.remove());
+}
@@ -4,6 +4,11 @@
 #include <gtest/gtest.h>
 #include <cpputils-base/logging.h>
 #include <cpputils-base/sysutil.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <string>
 
 using namespace Sys::Fs;
 using namespace cpputils::base::Unix;
@@ -156,4 +161,226 @@ TEST(SysFsFsObject, createSymLink_removeSymLink)
   ASSERT_TRUE(lp.isSymbolicLink());
   ASSERT_TRUE(lp.removeSymLink());
   ASSERT_TRUE(p.remove());
-}
\ No newline at end of file
+}
+TEST(SysFsFsObject, copy_tree_keeps_contents_and_metadata)
+{
+  FsObject top("/tmp/FsObjectCopyTest");
+  top.remove();
+  std::string src = top.fullPath() + "/src";
+  ASSERT_EQ(0, mkdir(top.fullPath().c_str(), 0755));
+  ASSERT_EQ(0, mkdir(src.c_str(), 0750));
+  std::string contents(3 * 1024 * 1024 + 17, 'x');
+  for (int i = 0; i < 20; i++)
+  {
+    std::string dir = src + "/dir" + std::to_string(i);
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    for (int j = 0; j < 5; j++)
+    {
+      std::string path = dir + "/file" + std::to_string(j) + ".txt";
+      FILE *fp = fopen(path.c_str(), "w");
+      ASSERT_TRUE(fp != nullptr);
+      fputs(path.c_str(), fp);
+      fclose(fp);
+    }
+  }
+  std::string big = src + "/dir0/big.bin";
+  FILE *fp = fopen(big.c_str(), "w");
+  ASSERT_TRUE(fp != nullptr);
+  fwrite(contents.data(), 1, contents.size(), fp);
+  fclose(fp);
+  ASSERT_EQ(0, chmod(big.c_str(), 0604));
+  struct timespec times[2] = {{1000000000, 0}, {1234567890, 123456789}};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, big.c_str(), times, 0));
+  ASSERT_EQ(0, symlink("dir0/big.bin", (src + "/link").c_str()));
+
+  FsObject p(src);
+  ASSERT_TRUE(p.copy(top.fullPath() + "/dst"));
+
+  // As with 'cp -r', the new directory receives the copy.
+  std::string dst = top.fullPath() + "/dst/src";
+  struct stat sb;
+  ASSERT_EQ(0, stat(dst.c_str(), &sb));
+  EXPECT_EQ(0750u, sb.st_mode & 07777);
+  for (int i = 0; i < 20; i++)
+  {
+    for (int j = 0; j < 5; j++)
+    {
+      std::string name = "/dir" + std::to_string(i) + "/file" + std::to_string(j) + ".txt";
+      char buf[256] = {};
+      fp = fopen((dst + name).c_str(), "r");
+      ASSERT_TRUE(fp != nullptr) << name;
+      ASSERT_TRUE(fgets(buf, sizeof(buf), fp) != nullptr);
+      fclose(fp);
+      EXPECT_EQ(src + name, buf);
+    }
+  }
+  ASSERT_EQ(0, stat((dst + "/dir0/big.bin").c_str(), &sb));
+  EXPECT_EQ((off_t)contents.size(), sb.st_size);
+  EXPECT_EQ(0604u, sb.st_mode & 07777);
+  EXPECT_EQ(1234567890, sb.st_mtim.tv_sec);
+  EXPECT_EQ(123456789, sb.st_mtim.tv_nsec);
+  char target[64] = {};
+  ASSERT_EQ(12, readlink((dst + "/link").c_str(), target, sizeof(target)));
+  EXPECT_STREQ("dir0/big.bin", target);
+
+  // Copying over an existing tree overwrites it.
+  ASSERT_TRUE(p.copy(top.fullPath() + "/dst"));
+  ASSERT_FALSE(p.copy(src + "/dir1"));
+  ASSERT_TRUE(top.remove());
+}
+
+TEST(SysFsFsObject, remove_tree_does_not_follow_links)
+{
+  FsObject keep("/tmp/FsObjectKeep.txt");
+  FILE *fp = fopen(keep.fullPath().c_str(), "w");
+  ASSERT_TRUE(fp != nullptr);
+  fclose(fp);
+
+  std::string top = "/tmp/FsObjectRemove Test";
+  std::string dir = top;
+  ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+  for (int depth = 0; depth < 4; depth++)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      std::string sub = dir + "/sub dir " + std::to_string(i);
+      ASSERT_EQ(0, mkdir(sub.c_str(), 0755));
+      fp = fopen((sub + "/a file.txt").c_str(), "w");
+      ASSERT_TRUE(fp != nullptr);
+      fclose(fp);
+      ASSERT_EQ(0, chmod((sub + "/a file.txt").c_str(), 0444));
+    }
+    ASSERT_EQ(0, symlink(keep.fullPath().c_str(), (dir + "/link").c_str()));
+    ASSERT_EQ(0, symlink("/tmp", (dir + "/dirlink").c_str()));
+    dir += "/sub dir 0";
+  }
+
+  FsObject p(top);
+  ASSERT_TRUE(p.remove());
+  ASSERT_TRUE(!p.isExist());
+  struct stat sb;
+  ASSERT_EQ(-1, lstat(top.c_str(), &sb));
+  ASSERT_TRUE(keep.isExist());
+  ASSERT_TRUE(keep.remove());
+}
+
+TEST(SysFsFsObject, remove_tree_deeper_than_PATH_MAX)
+{
+  std::string top = "/tmp/FsObjectRemoveDeep";
+  ASSERT_EQ(0, mkdir(top.c_str(), 0755));
+  std::string name(200, 'd');
+  int fd = open(top.c_str(), O_RDONLY | O_DIRECTORY);
+  ASSERT_GE(fd, 0);
+  for (int depth = 0; depth < 30; depth++)
+  {
+    ASSERT_EQ(0, mkdirat(fd, name.c_str(), 0755));
+    int file = openat(fd, "file", O_WRONLY | O_CREAT, 0644);
+    ASSERT_GE(file, 0);
+    close(file);
+    int child = openat(fd, name.c_str(), O_RDONLY | O_DIRECTORY);
+    close(fd);
+    ASSERT_GE(child, 0);
+    fd = child;
+  }
+  close(fd);
+
+  FsObject p(top);
+  ASSERT_TRUE(p.remove());
+  struct stat sb;
+  ASSERT_EQ(-1, lstat(top.c_str(), &sb));
+}
+
+TEST(SysFsFsObject, move_tree_with_spaces_and_across_file_systems)
+{
+  std::string top = "/tmp/FsObjectMove Test";
+  std::string src = top + "/my dir";
+  ASSERT_EQ(0, mkdir(top.c_str(), 0755));
+  ASSERT_EQ(0, mkdir(src.c_str(), 0755));
+  FILE *fp = fopen((src + "/my file.txt").c_str(), "w");
+  ASSERT_TRUE(fp != nullptr);
+  fputs("Hello Jagdish", fp);
+  fclose(fp);
+
+  FsObject p(src);
+  ASSERT_TRUE(p.move(top + "/new name"));
+  struct stat sb;
+  ASSERT_EQ(0, stat((top + "/new name/my dir/my file.txt").c_str(), &sb));
+  ASSERT_EQ(-1, stat(src.c_str(), &sb));
+
+  // /dev/shm is a tmpfs of its own, so rename() fails with EXDEV and the tree is copied.
+  if (stat("/dev/shm", &sb) == 0 && access("/dev/shm", W_OK) == 0)
+  {
+    p.setPath(top + "/new name/my dir");
+    ASSERT_TRUE(p.move("/dev/shm/FsObjectMove Test/"));
+    ASSERT_EQ(0, stat("/dev/shm/FsObjectMove Test/my dir/my file.txt", &sb));
+    EXPECT_EQ(13, sb.st_size);
+    ASSERT_EQ(-1, stat((top + "/new name/my dir").c_str(), &sb));
+    p.setPath("/dev/shm/FsObjectMove Test");
+    ASSERT_TRUE(p.remove());
+  }
+
+  p.setPath(top);
+  ASSERT_TRUE(p.remove());
+}
+
+TEST(SysFsFsObject, stat_cache)
+{
+  FsObject p("/tmp/FsObjectStatCache.txt");
+  p.remove();
+  FILE *fp = fopen(p.fullPath().c_str(), "w");
+  ASSERT_TRUE(fp != nullptr);
+  fputs("Hello", fp);
+  fclose(fp);
+
+  p.enableStatCache();
+  ASSERT_TRUE(p.refresh());
+  EXPECT_EQ(5, p.getSize());
+  EXPECT_TRUE(p.getType() == FsObject::Type::REGULAR_FILE);
+  struct stat sb;
+  ASSERT_EQ(0, stat(p.fullPath().c_str(), &sb));
+  EXPECT_EQ((long)sb.st_ino, p.getInode());
+  EXPECT_EQ(sb.st_mtim.tv_sec, p.getLastUpdateTime());
+
+  // The snapshot is kept until refresh().
+  fp = fopen(p.fullPath().c_str(), "a");
+  ASSERT_TRUE(fp != nullptr);
+  fputs(" Jagdish", fp);
+  fclose(fp);
+  EXPECT_EQ(5, p.getSize());
+  ASSERT_TRUE(p.refresh());
+  EXPECT_EQ(13, p.getSize());
+
+  // Changes made through the object itself are seen at once.
+  mode_t mode = p.getMode();
+  ASSERT_TRUE(p.changeMode(0600));
+  EXPECT_EQ(0600u, p.getMode());
+  ASSERT_TRUE(p.changeMode(mode));
+
+  // A snapshot of only some fields; other getters stat() as usual.
+  p.enableStatCache(0, FsObject::STAT_SIZE);
+  EXPECT_EQ(13, p.getSize());
+  EXPECT_EQ((long)sb.st_ino, p.getInode());
+  ASSERT_EQ(0, truncate(p.fullPath().c_str(), 1));
+  EXPECT_EQ(1, p.getSize());
+
+  // Assignment takes the cache mode along, as copying does.
+  FsObject cached(p.fullPath());
+  cached.enableStatCache();
+  EXPECT_EQ(1, cached.getSize());
+  FsObject assigned;
+  assigned = cached;
+  FsObject copied(cached);
+  ASSERT_EQ(0, truncate(p.fullPath().c_str(), 3));
+  EXPECT_EQ(1, cached.getSize());
+  assigned.refresh();
+  copied.refresh();
+  ASSERT_EQ(0, truncate(p.fullPath().c_str(), 4));
+  EXPECT_EQ(3, assigned.getSize());
+  EXPECT_EQ(3, copied.getSize());
+
+  p.disableStatCache();
+  ASSERT_EQ(0, truncate(p.fullPath().c_str(), 2));
+  EXPECT_EQ(2, p.getSize());
+  ASSERT_TRUE(p.remove());
+  EXPECT_FALSE(p.refresh());
+}